@@ -4,9 +4,27 @@
 // mkfifo save
 // cat file.tzx > load
 // cat save > file.tzx
-// ./a.out file.rom [-o]
-// ./a.out file.sna
+// ./a.out file.rom [-o] [-lazy | -lazy-check] [-jit | -jit-check] [-cache [-fusions file.fusion]] [-fusion-profile]
+//         [-speed 1 | 2 | 4 | 10 | max] [-slice frame | N] [-audio-sync] [-headless [-pcm] [-ppm]]
+//         [-profile N [-symbols file.sym]] [-rt-stats]
+// ./a.out file.sna [-lazy | -lazy-check] [-jit | -jit-check] [-cache [-fusions file.fusion]] [-fusion-profile]
+//         [-speed 1 | 2 | 4 | 10 | max] [-slice frame | N] [-audio-sync] [-headless [-pcm] [-ppm]]
+//         [-profile N [-symbols file.sym]] [-rt-stats]
+// -slice runs a frame or N T states at a time and then waits for the wall clock once, the sound goes out a slice at a time
+// -audio-sync paces the emulation by the sound device instead of the wall clock, without a device it is ignored
+// F1 - F5 switch the speed at runtime between 1x, 2x, 4x, 10x and max
+// -headless runs without window and sound device until SIGINT or SIGTERM; -pcm writes the sound to out.pcm (U8 mono), -ppm the screen to out.ppm
+// -profile N samples the guest PC and call stack every N T states into out.folded for flamegraph.pl,
+// -symbols file.sym names the frames with label=address lines, the address in hex
+// -fusion-profile counts the opcode pairs and triples next to each other in memory into out.fusion,
+// -fusions file.fusion fuses only the sequences listed there, by default -cache fuses all it has a handler for
+// -jit translates hot blocks to x86-64 that run from block to block up to the next task, -jit-check reruns
+// every block in the interpreter and reports the differences
+// -rt-stats records the scheduler lag, lead, oversleep, frame and task times, kill -USR2 or the exit prints them
 // ./a.out file.tzx [-p0]
+// ./a.out -batch jobs.txt [-lazy] [-jit] [-cache [-fusions file.fusion]]
+// ./a.out -bench file.rom [-lazy] [-jit] [-cache [-fusions file.fusion]] > bench.json
+// gcc -DZ80_OPCODE_STATS ... counts every opcode, the report goes to stderr at exit and on kill -USR1
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -18,10 +36,17 @@
 #include <math.h>
 #include <poll.h>
 #include <unistd.h>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/freeglut.h>
 #include <errno.h>
 #include <alsa/asoundlib.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <signal.h>
+#if defined(Z80_OPCODE_STATS) && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 #define MAX0 0x01
 #define MAX1 0x02
@@ -52,6 +77,7 @@
 #define MASK_HNC 0x13
 #define MASK_HVNC 0x17
 #define MASK_NONE 0x00
+#define MASK_FLAGS 0xD7
 
 #define REG8_ONE \
     (REG8) { .value = 1 }
@@ -61,27 +87,95 @@
 #define SCREEN_WIDTH 352
 #define SCREEN_HEIGHT 304
 #define SCREEN_ZOOM 2
+#define SCREEN_REFRESH_MS 10
 
 #define TAPE_LOAD_EVENT 1
 #define TAPE_SAVE_EVENT 2
 
-#define RT_MAX 5
+#define RT_CAPACITY 8
+
+#define ULA_FRAME_T_STATES ((SCREEN_HEIGHT + 8) * 224)
+
+#define BATCH_NAME_MAX 1024
+#define BENCH_BOOT_FRAMES 200
+#define BENCH_KEY_DOWN_FRAMES 4
+#define BENCH_KEY_UP_FRAMES 6
+#define BENCH_CODE 0x8000
+#define PROFILE_DEPTH 32
+#define PROFILE_CALLS 256
+#define PROFILE_STACKS 65536
+#define PROFILE_LABEL_MAX 64
+
+#define CODE_JIT 0x01
+#define CODE_DECODED 0x02
+
+#define IDLE_MAX_BYTES 64
+#define IDLE_MAX_STEPS 64
+
+#define FUSION_MAX 3
+#define FUSION_PROFILE_TOP 32
+#define FUSION_TRIPLES 4096
+#define STATS_NONE 0
+#define STATS_CB 1
+#define STATS_ED 2
+#define STATS_DD_FD 3
+
+#define JIT_HOT 32
+#define JIT_MAX_INSTRUCTIONS 32
+#define JIT_MAX_BYTES 128
+#define JIT_MAX_CODE 0x4000
+#define JIT_CODE_SIZE 0x400000
+#define JIT_PAGE 0x1000
+#define JIT_EXIT 32
+#define JIT_JAE 0x83
+#define JIT_JE 0x84
+#define JIT_JNE 0x85
+#define JIT_JMP 0xE9
+
+#define LAZY_NONE 0
+#define LAZY_ADD 1
+#define LAZY_SUB 2
+#define LAZY_LOGIC 3
+#define LAZY_INC 4
+#define LAZY_DEC 5
 
 #define PCM_SAMPLE 48000
-#define Z80_FREQ 3500000.0L
+#define PCM_SYNC_FRAMES (PCM_SAMPLE / 20)
+#define Z80_FREQ 3500000ULL
+#define TIME_NS_PER_SECOND 1000000000ULL
+#define TIME_NS_PER_MS 1000000ULL
+#define TIME_SPIN_NS 200000ULL
+#define TIME_SPEED_MAX 0
+#define KEYBOARD_RELEASE 0x100
+#define KEYBOARD_ALT 0x200
+#define KEYBOARD_SHIFT 0x400
+#define TIME_BUCKETS 40
+#define RT_STATS_LAG 0
+#define RT_STATS_LEAD 1
+#define RT_STATS_OVERSLEEP 2
+#define RT_STATS_FRAME 3
+#define RT_STATS_ULA 4
+#define RT_STATS_PCM 5
+#define RT_STATS_TAPE 6
+#define RT_STATS_CPU 7
+#define RT_STATS_MAX 8
 
 #define sign(X) (X < 0)
 #define is_bit(I, B) (I & (B))
 #define register_is_zero(X) ((X).value == 0)
 #define register_is_bit(R, B) (is_bit((R).byte_value, B))
-#define register_is_flag(B) (register_is_bit(z80_reg_af.bytes.low, B))
+#define register_flags_materialize() (register_lazy_op != LAZY_NONE ? register_lazy_materialize() : (void)0)
+#define register_is_flag(B) (register_flags_materialize(), register_is_bit(z80_reg_af.bytes.low, B))
 #define set_bit(I, B) (I |= (B))
 #define unset_bit(I, B) (I &= ~(B))
 #define set_or_unset_bit(I, B, V) (V ? set_bit(I, B) : unset_bit(I, B))
 #define register_set_or_unset_bit(R, B, V) (set_or_unset_bit((R).byte_value, B, V))
-#define register_set_or_unset_flag(B, V) (register_set_or_unset_bit(z80_reg_af.bytes.low, B, V))
+#define register_set_or_unset_flag(B, V) (register_flags_materialize(), register_set_or_unset_bit(z80_reg_af.bytes.low, B, V))
+#define register_store_flags(F, M) (z80_reg_af.bytes.low.byte_value = (z80_reg_af.bytes.low.byte_value & ~((M) & MASK_FLAGS)) | ((F) & (M)))
+#define register_set_flags(F, M) (register_flags_materialize(), register_store_flags(F, M))
+#define memory_written(A) (memory_writes++, memory_code_pages[(A) >> 8 & 0xFF] ? memory_invalidate((A) & 0xFFFF) : (void)0)
 #define register_split_8_to_4(R) (div((R).byte_value, MAX4))
-#define time_ts_to_seconds(T) (T.tv_sec + T.tv_nsec / 1000000000.0L)
+#define time_ts_to_ns(T) (T.tv_sec * TIME_NS_PER_SECOND + T.tv_nsec)
 
 typedef union
 {
@@ -102,18 +196,25 @@ typedef union
 
 typedef struct
 {
-    GLfloat red;
-    GLfloat green;
-    GLfloat blue;
-} RGB;
+    const char *name;
+    unsigned long long count, total, max;
+    unsigned long long buckets[TIME_BUCKETS];
+} TIMEHISTOGRAM;
 
-typedef struct TTASK
+typedef struct
 {
     unsigned long long t_states;
-    void (*task)();
-    struct TTASK *next;
+    void (*task)(void *context);
+    void *context;
+    unsigned long long id;
 } TASK;
 
+typedef struct RTEVENT
+{
+    TASK task;
+    struct RTEVENT *_Atomic next;
+} RTEVENT;
+
 typedef struct TREG8BLOCK
 {
     unsigned char last_used, pulses_per_sample;
@@ -125,52 +226,343 @@ typedef struct TREG8BLOCK
     struct TREG8BLOCK *next;
 } REG8BLOCK;
 
-REG8 memory[MAX16];
-RGB ula_screen[SCREEN_HEIGHT][SCREEN_WIDTH];
-RGB ula_border[SCREEN_HEIGHT];
-REG8 keyboard[] = {(REG8){.value = 0xFF}, (REG8){.value = 0xFF}, (REG8){.value = 0xFF},
-                   (REG8){.value = 0xFF}, (REG8){.value = 0xFF}, (REG8){.value = 0xFF},
-                   (REG8){.value = 0xFF}, (REG8){.value = 0xFF}};
-RGB ula_colors[] = {(RGB){0.0f, 0.0f, 0.0f}, (RGB){0.0f, 0.0f, 0.9f},
-                    (RGB){0.5f, 0.0f, 0.0f}, (RGB){0.4f, 0.0f, 0.4f},
-                    (RGB){0.0f, 0.9f, 0.0f}, (RGB){0.0f, 0.4f, 0.4f},
-                    (RGB){0.9f, 0.9f, 0.0f}, (RGB){0.9f, 0.9f, 0.9f}};
-RGB ula_bright_colors[] = {(RGB){0.0f, 0.0f, 0.0f}, (RGB){0.0f, 0.0f, 1.0f},
-                           (RGB){1.0f, 0.0f, 0.0f}, (RGB){0.5f, 0.0f, 0.5f},
-                           (RGB){0.0f, 1.0f, 0.0f}, (RGB){0.0f, 1.0f, 1.0f},
-                           (RGB){1.0f, 1.0f, 0.0f}, (RGB){1.0f, 1.0f, 1.0f}};
+typedef struct
+{
+    REG16 bc, de, hl, af, pc, sp, ix, iy;
+    REG16 bc_2, de_2, hl_2, af_2;
+    REG8 i, r;
+    bool iff1, iff2, halt;
+    int imode;
+} Z80STATE;
+
+// code is the first field so that a translated block can jump through the jit_blocks entry
+typedef struct
+{
+    unsigned char *code;
+    REG16 start;
+    int size;
+} JITBLOCK;
+
+// a way out of the block at the deadline or after a write to translated code, refresh counts
+// the opcode fetches not yet added to R
+typedef struct
+{
+    unsigned char *jumps[2];
+    REG16 pc;
+    int refresh;
+} JITEXIT;
+
+typedef struct
+{
+    unsigned char *code, *start;
+    REG16 pc, block;
+    int refresh, exits_size;
+    JITEXIT exits[JIT_MAX_INSTRUCTIONS];
+} JITCOMPILER;
+
+typedef struct
+{
+    char *filename;
+    unsigned long long t_states;
+} BATCHJOB;
+
+typedef struct
+{
+    int begin, end;
+    pthread_mutex_t lock;
+} BATCHQUEUE;
+
+typedef struct
+{
+    const char *name;
+    const unsigned char *code;
+    int code_size;
+    const char *keys;
+    int frames;
+} BENCHMARK;
+
+typedef struct
+{
+    unsigned long long count;
+    int depth;
+    REG16 frames[PROFILE_DEPTH];
+} PROFILESTACK;
+
+typedef struct
+{
+    REG16 sp;
+    REG16 site;
+} PROFILECALL;
+
+typedef struct
+{
+    char label[PROFILE_LABEL_MAX];
+    unsigned int address;
+} PROFILESYMBOL;
+
+// opcode counters of one machine, depth is the nesting of prefix handlers and prefix, op the innermost one
+typedef struct
+{
+    unsigned long long count[4][MAX8], t_states[4][MAX8], cycles[4][MAX8];
+    unsigned long long histogram[MAX8];
+    int depth, prefix, op;
+} Z80OPSTATS;
+
+typedef int (*Z80OP)(REG8 reg);
+typedef int (*Z80OP_INDEX)(REG8 reg, REG16 *other);
+typedef int (*Z80OP_INDEX_CB)(REG8 reg, REG8 *alt);
+
+// an instruction decoded once and run by exec, an empty entry has no exec; r and s index z80_all8,
+// rr z80_bc_de_hl_sp or z80_bc_de_hl_af (IX or IY after DD or FD), nn is the immediate word or the jump target,
+// n the immediate byte and op the opcode after the prefixes
+typedef struct Z80DECODED
+{
+    int (*exec)(struct Z80DECODED *decoded);
+    REG16 nn;
+    REG8 op, n, d;
+    unsigned char r, s, rr;
+} Z80DECODED;
+
+typedef struct
+{
+    int length;
+    unsigned char ops[FUSION_MAX];
+    int (*exec)(Z80DECODED *decoded);
+    bool enabled;
+} Z80FUSION;
+
+// the opcodes of a counted pair or triple, a triple with bit 24 set
+typedef struct
+{
+    unsigned int key, count;
+} Z80FUSIONCOUNT;
+
+// everything that belongs to one emulated machine, the hot CPU state first
+typedef struct __attribute__((aligned(64)))
+{
+    REG16 z80_reg_bc, z80_reg_de, z80_reg_hl, z80_reg_af, z80_reg_pc, z80_reg_sp, z80_reg_ix, z80_reg_iy;
+    REG16 z80_reg_bc_2, z80_reg_de_2, z80_reg_hl_2, z80_reg_af_2;
+    REG8 z80_reg_i, z80_reg_r, z80_data_bus;
+    bool z80_iff1, z80_iff2, z80_can_execute, z80_halt;
+    bool z80_maskable_interrupt_flag, z80_nonmaskable_interrupt_flag;
+    int z80_imode;
+    unsigned long long z80_t_states_all, z80_deadline;
+    int register_lazy_op;
+    REG8 register_lazy_a, register_lazy_b, register_lazy_shadow;
+    bool register_lazy_c;
+    REG8 *z80_all8[8];
+    REG16 *z80_bc_de_hl_sp[4];
+    REG16 *z80_bc_de_hl_af[4];
+    unsigned long long memory_writes, z80_instructions;
+    REG8 memory[MAX16];
+    unsigned char memory_code_pages[MAX8];
+    TASK *rt_timeline;
+    RTEVENT *_Atomic rt_inbox_head;
+    RTEVENT *rt_inbox_tail, rt_inbox_stub;
+    int rt_size, rt_capacity;
+    unsigned long long rt_sequence;
+    bool running;
+    unsigned long long time_start;
+    unsigned long long time_start_t_states, time_slice_end;
+    int time_start_speed;
+    unsigned int ula_draw_counter, ula_line, ula_state;
+    _Atomic unsigned int ula_frames;
+    int ula_border_color;
+    REG16 ula_addr_bitmap, ula_addr_attrib;
+    REG8 keyboard[8];
+    bool sound_ear, sound_mic, sound_input;
+    Z80STATE z80_idle_state;
+    unsigned long long z80_idle_t, z80_idle_writes, z80_idle_instructions;
+    int z80_idle_steps;
+    bool z80_idle_r_read;
+    unsigned long long tape_save_t_states, tape_save_duration, tape_index, tape_break_index;
+    int tape_load_state, tape_save_state, tape_save_counter;
+    int tape_save_index, tape_save_buffer_size;
+    char *tape_save_buffer;
+    bool tape_save_mic;
+    REG8BLOCK *tape_block_head, *tape_block_last;
+    unsigned char ula_screen[SCREEN_HEIGHT][SCREEN_WIDTH];
+    JITBLOCK *jit_blocks[MAX16];
+    unsigned char jit_hits[MAX16];
+    unsigned char *jit_code;
+    int jit_code_used, jit_count;
+    bool jit_invalidated;
+    REG8 jit_check_memory[MAX1][MAX16];
+    Z80DECODED z80_decoded[MAX16];
+    unsigned int z80_pair_counts[MAX8][MAX8];
+    Z80FUSIONCOUNT z80_triple_counts[FUSION_TRIPLES];
+    int z80_triples_size, z80_fusion_run;
+    REG8 z80_fusion_ops[2];
+    REG16 z80_fusion_next;
+    PROFILECALL profile_calls[PROFILE_CALLS];
+    int profile_calls_size;
+#ifdef Z80_OPCODE_STATS
+    Z80OPSTATS z80_stats;
+#endif
+} MACHINE;
+
+__thread MACHINE *machine;
+MACHINE main_machine;
+
+#define z80_reg_bc (machine->z80_reg_bc)
+#define z80_reg_de (machine->z80_reg_de)
+#define z80_reg_hl (machine->z80_reg_hl)
+#define z80_reg_af (machine->z80_reg_af)
+#define z80_reg_pc (machine->z80_reg_pc)
+#define z80_reg_sp (machine->z80_reg_sp)
+#define z80_reg_ix (machine->z80_reg_ix)
+#define z80_reg_iy (machine->z80_reg_iy)
+#define z80_reg_bc_2 (machine->z80_reg_bc_2)
+#define z80_reg_de_2 (machine->z80_reg_de_2)
+#define z80_reg_hl_2 (machine->z80_reg_hl_2)
+#define z80_reg_af_2 (machine->z80_reg_af_2)
+#define z80_reg_i (machine->z80_reg_i)
+#define z80_reg_r (machine->z80_reg_r)
+#define z80_data_bus (machine->z80_data_bus)
+#define z80_iff1 (machine->z80_iff1)
+#define z80_iff2 (machine->z80_iff2)
+#define z80_can_execute (machine->z80_can_execute)
+#define z80_halt (machine->z80_halt)
+#define z80_maskable_interrupt_flag (machine->z80_maskable_interrupt_flag)
+#define z80_nonmaskable_interrupt_flag (machine->z80_nonmaskable_interrupt_flag)
+#define z80_imode (machine->z80_imode)
+#define z80_t_states_all (machine->z80_t_states_all)
+#define z80_deadline (machine->z80_deadline)
+#define register_lazy_op (machine->register_lazy_op)
+#define register_lazy_a (machine->register_lazy_a)
+#define register_lazy_b (machine->register_lazy_b)
+#define register_lazy_shadow (machine->register_lazy_shadow)
+#define register_lazy_c (machine->register_lazy_c)
+#define z80_all8 (machine->z80_all8)
+#define z80_bc_de_hl_sp (machine->z80_bc_de_hl_sp)
+#define z80_bc_de_hl_af (machine->z80_bc_de_hl_af)
+#define memory_writes (machine->memory_writes)
+#define z80_instructions (machine->z80_instructions)
+#define memory (machine->memory)
+#define memory_code_pages (machine->memory_code_pages)
+#define rt_timeline (machine->rt_timeline)
+#define rt_inbox_head (machine->rt_inbox_head)
+#define rt_inbox_tail (machine->rt_inbox_tail)
+#define rt_inbox_stub (machine->rt_inbox_stub)
+#define rt_size (machine->rt_size)
+#define rt_capacity (machine->rt_capacity)
+#define rt_sequence (machine->rt_sequence)
+#define running (machine->running)
+#define time_start (machine->time_start)
+#define time_start_t_states (machine->time_start_t_states)
+#define time_slice_end (machine->time_slice_end)
+#define time_start_speed (machine->time_start_speed)
+#define ula_draw_counter (machine->ula_draw_counter)
+#define ula_line (machine->ula_line)
+#define ula_frames (machine->ula_frames)
+#define ula_state (machine->ula_state)
+#define ula_border_color (machine->ula_border_color)
+#define ula_addr_bitmap (machine->ula_addr_bitmap)
+#define ula_addr_attrib (machine->ula_addr_attrib)
+#define keyboard (machine->keyboard)
+#define sound_ear (machine->sound_ear)
+#define sound_mic (machine->sound_mic)
+#define sound_input (machine->sound_input)
+#define z80_idle_state (machine->z80_idle_state)
+#define z80_idle_t (machine->z80_idle_t)
+#define z80_idle_writes (machine->z80_idle_writes)
+#define z80_idle_instructions (machine->z80_idle_instructions)
+#define z80_idle_steps (machine->z80_idle_steps)
+#define z80_idle_r_read (machine->z80_idle_r_read)
+#define tape_save_t_states (machine->tape_save_t_states)
+#define tape_save_duration (machine->tape_save_duration)
+#define tape_index (machine->tape_index)
+#define tape_break_index (machine->tape_break_index)
+#define tape_load_state (machine->tape_load_state)
+#define tape_save_state (machine->tape_save_state)
+#define tape_save_counter (machine->tape_save_counter)
+#define tape_save_index (machine->tape_save_index)
+#define tape_save_buffer_size (machine->tape_save_buffer_size)
+#define tape_save_buffer (machine->tape_save_buffer)
+#define tape_save_mic (machine->tape_save_mic)
+#define tape_block_head (machine->tape_block_head)
+#define tape_block_last (machine->tape_block_last)
+#define ula_screen (machine->ula_screen)
+#define jit_blocks (machine->jit_blocks)
+#define jit_hits (machine->jit_hits)
+#define jit_code (machine->jit_code)
+#define jit_code_used (machine->jit_code_used)
+#define jit_count (machine->jit_count)
+#define jit_invalidated (machine->jit_invalidated)
+#define jit_check_memory (machine->jit_check_memory)
+#define z80_decoded (machine->z80_decoded)
+#define z80_pair_counts (machine->z80_pair_counts)
+#define z80_triple_counts (machine->z80_triple_counts)
+#define z80_triples_size (machine->z80_triples_size)
+#define z80_fusion_run (machine->z80_fusion_run)
+#define z80_fusion_ops (machine->z80_fusion_ops)
+#define z80_fusion_next (machine->z80_fusion_next)
+#define profile_calls (machine->profile_calls)
+#define profile_calls_size (machine->profile_calls_size)
+#define z80_stats (machine->z80_stats)
+
+// RGBA of the ula_screen indices, the bright colors are at 8 to 15
+unsigned char ula_palette[16][4] = {{0, 0, 0, 255}, {0, 0, 229, 255}, {127, 0, 0, 255}, {102, 0, 102, 255},
+                                    {0, 229, 0, 255}, {0, 102, 102, 255}, {229, 229, 0, 255}, {229, 229, 229, 255},
+                                    {0, 0, 0, 255}, {0, 0, 255, 255}, {255, 0, 0, 255}, {127, 0, 127, 255},
+                                    {0, 255, 0, 255}, {0, 255, 255, 255}, {255, 255, 0, 255}, {255, 255, 255, 255}};
 const unsigned int memory_size = MAX16;
-long double time_start = 0.0L, state_duration = 1.0L / Z80_FREQ;
-unsigned long long z80_t_states_all = 0;
-unsigned int ula_draw_counter = 0, ula_line = 0, ula_state;
-int ula_border_color;
-bool sound_ear = false, sound_mic = false, sound_input = false;
-REG16 ula_addr_bitmap, ula_addr_attrib;
-REG16 z80_reg_bc, z80_reg_de, z80_reg_hl, z80_reg_af, z80_reg_pc, z80_reg_sp, z80_reg_ix, z80_reg_iy;
-REG16 z80_reg_bc_2, z80_reg_de_2, z80_reg_hl_2, z80_reg_af_2;
-REG8 z80_reg_i, z80_reg_r, z80_data_bus;
-REG8 *z80_all8[] = {&z80_reg_bc.bytes.high, &z80_reg_bc.bytes.low,
-                    &z80_reg_de.bytes.high, &z80_reg_de.bytes.low,
-                    &z80_reg_hl.bytes.high, &z80_reg_hl.bytes.low,
-                    NULL, &z80_reg_af.bytes.high};
-REG16 *z80_bc_de_hl_sp[] = {&z80_reg_bc, &z80_reg_de, &z80_reg_hl, &z80_reg_sp};
-REG16 *z80_bc_de_hl_af[] = {&z80_reg_bc, &z80_reg_de, &z80_reg_hl, &z80_reg_af};
+int time_speed = 1;
+unsigned long long time_slice;
+int time_speeds[] = {1, 2, 4, 10, TIME_SPEED_MAX};
+bool rt_stats = false;
+volatile sig_atomic_t rt_stats_requested;
+unsigned long long rt_stats_frame_start;
+TIMEHISTOGRAM rt_stats_histograms[RT_STATS_MAX] = {{"lag"}, {"lead"}, {"oversleep"}, {"frame"}, {"ula"}, {"pcm"}, {"tape"}, {"cpu"}};
 int z80_rst_addr[] = {0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38};
-bool running;
-bool z80_maskable_interrupt_flag, z80_nonmaskable_interrupt_flag;
-bool z80_iff1, z80_iff2, z80_can_execute, z80_halt;
-int z80_imode;
-unsigned long long tape_save_t_states, tape_save_duration, tape_index, tape_break_index;
-int tape_load_state, tape_save_state, tape_save_counter;
-int tape_save_index, tape_save_buffer_size;
-char *tape_save_buffer = NULL;
-bool tape_save_mic;
-REG8BLOCK *tape_block_head = NULL, *tape_block_last = NULL;
-TASK rt_timeline[RT_MAX], rt_pending;
-bool rt_is_pending = false;
-int rt_size = 0;
+unsigned char register_szp_flags[MAX8], register_inc8_flags[MAX8], register_dec8_flags[MAX8];
+unsigned char register_left8_flags[MAX1][MAX8], register_right8_flags[MAX1][MAX8];
+unsigned char register_add8_flags[MAX1][MAX8][MAX8], register_sub8_flags[MAX1][MAX8][MAX8];
+REG16 register_daa_table[MAX2][MAX8];
+bool z80_decode_cache = false, z80_fusion_profile = false;
+bool jit_enabled = false, jit_check = false;
+bool register_lazy = false, register_lazy_check = false;
+int z80_condition_flags[] = {FLAG_Z, FLAG_Z, FLAG_C, FLAG_C, FLAG_PV, FLAG_PV, FLAG_S, FLAG_S};
 snd_pcm_t *pcm_handle;
+FILE *pcm_file;
 int pcm_states = Z80_FREQ / PCM_SAMPLE;
+unsigned char pcm_buffer[PCM_SAMPLE];
+int pcm_buffered, pcm_chunk = 1;
+bool pcm_sync = false;
+GLuint screen_texture, screen_buffer;
+unsigned int screen_frame;
+BATCHJOB *batch_jobs;
+BATCHQUEUE *batch_queues;
+int batch_size, batch_threads;
+pthread_mutex_t batch_output = PTHREAD_MUTEX_INITIALIZER;
+// DI; LD HL,4000h; LD DE,4001h; LD BC,1AFFh; INC (HL); LDIR; JR -14
+const unsigned char bench_ldir_code[] = {0xF3, 0x21, 0x00, 0x40, 0x11, 0x01, 0x40, 0x01, 0xFF, 0x1A, 0x34, 0xED, 0xB0, 0x18, 0xF2};
+// DI; LD SP,FF00h; LD IX,9000h; LD IY,9080h, then a loop over the main, CB, ED, DD and FD groups
+const unsigned char bench_exerciser_code[] = {0xF3, 0x31, 0x00, 0xFF, 0xDD, 0x21, 0x00, 0x90, 0xFD, 0x21, 0x80, 0x90,
+                                              0x80, 0x27, 0xCB, 0x01, 0xED, 0x52, 0xDD, 0x86, 0x01, 0xFD, 0x77, 0x02,
+                                              0xDD, 0xCB, 0x03, 0x16, 0xCB, 0x7A, 0xED, 0x44, 0x8F, 0xD9, 0x09, 0x13,
+                                              0xD9, 0x08, 0x1F, 0x08, 0xC5, 0xE1, 0x19, 0xEB, 0xED, 0x6A, 0xA9, 0xB2,
+                                              0x04, 0x0D, 0xDD, 0x34, 0x04, 0xFD, 0x35, 0x05, 0xCB, 0x3F, 0xC3, 0x0C, 0x80};
+// keys are typed in K mode after the boot, an uppercase key is pressed with SYMBOL SHIFT
+BENCHMARK bench_workloads[] = {
+    {"boot", NULL, 0, NULL, 0},
+    // FOR i=1 TO 60000: NEXT i
+    {"basic_for", NULL, 0, "fiL1F60000Zni\r", 1000},
+    // FOR i=1 TO 60000: LET x=i/3*i: NEXT i
+    {"basic_float", NULL, 0, "fiL1F60000ZlxLiV3BiZni\r", 1000},
+    {"ldir_fill", bench_ldir_code, sizeof(bench_ldir_code), NULL, 1000},
+    {"exerciser", bench_exerciser_code, sizeof(bench_exerciser_code), NULL, 1000}};
+const char *bench_keys;
+bool bench_key_down;
+PROFILESTACK *profile_stacks;
+PROFILESYMBOL *profile_symbols;
+int profile_period, profile_symbols_size;
+unsigned long long profile_dropped;
+#ifdef Z80_OPCODE_STATS
+Z80OPSTATS z80_stats_total;
+pthread_mutex_t z80_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t z80_stats_requested;
+#endif
 // int debug = 100;
 
 void to_binary(unsigned char c, char *o)
@@ -194,37 +586,163 @@ int system_little_endian()
 
 // ===TIME===============================================
 
-long double time_in_seconds()
+// all the times are integer ns on CLOCK_MONOTONIC
+unsigned long long time_in_ns()
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return time_ts_to_seconds(ts);
+    return time_ts_to_ns(ts);
+}
+
+void time_ns_to_timespec(struct timespec *ts, unsigned long long ns)
+{
+    ts->tv_sec = ns / TIME_NS_PER_SECOND;
+    ts->tv_nsec = ns % TIME_NS_PER_SECOND;
 }
 
-void time_seconds_to_timespec(struct timespec *ts, long double s)
+// the exact duration of the T states, rounded down, without accumulating an error
+unsigned long long time_t_states_to_ns(unsigned long long t_states)
 {
-    long double temp;
-    ts->tv_nsec = modfl(s, &temp) * 1000000000.0L;
-    ts->tv_sec = temp;
+    return t_states / Z80_FREQ * TIME_NS_PER_SECOND + t_states % Z80_FREQ * TIME_NS_PER_SECOND / Z80_FREQ;
 }
 
-void time_sleep_in_seconds(long double s)
+void time_sleep_until_ns(unsigned long long ns)
 {
     struct timespec ts;
-    if (s > 0.0L)
+    time_ns_to_timespec(&ts, ns);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+void time_sleep_in_ms(int ms)
+{
+    time_sleep_until_ns(time_in_ns() + ms * TIME_NS_PER_MS);
+}
+
+// with slices the sleep stops TIME_SPIN_NS early and spins the rest, a slice ends once so it can afford it
+void time_wait_until_ns(unsigned long long ns)
+{
+    if (time_slice == 0)
+    {
+        time_sleep_until_ns(ns);
+    }
+    else
+    {
+        if (ns > TIME_SPIN_NS)
+        {
+            time_sleep_until_ns(ns - TIME_SPIN_NS);
+        }
+        while (time_in_ns() < ns)
+        {
+        }
+    }
+}
+
+// bucket i counts the durations below 2^i ns
+void time_histogram_add(TIMEHISTOGRAM *histogram, unsigned long long ns)
+{
+    int i = 0;
+    while (i < TIME_BUCKETS - 1 && ns >> i != 0)
+    {
+        i++;
+    }
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->total += ns;
+    histogram->max = (ns > histogram->max ? ns : histogram->max);
+}
+
+// the upper bound of the bucket that holds the percentile, at most the maximum
+unsigned long long time_histogram_percentile(TIMEHISTOGRAM *histogram, double percentile)
+{
+    unsigned long long n = 0;
+    int i;
+    for (i = 0; i < TIME_BUCKETS - 1; i++)
+    {
+        n += histogram->buckets[i];
+        if (n >= histogram->count * percentile)
+        {
+            break;
+        }
+    }
+    return (1ULL << i) < histogram->max ? 1ULL << i : histogram->max;
+}
+
+void time_histogram_print(FILE *f, TIMEHISTOGRAM *histogram)
+{
+    int i;
+    if (histogram->count == 0)
+    {
+        return;
+    }
+    fprintf(f, "%s: count %llu mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu ns\n", histogram->name,
+            histogram->count, histogram->total / histogram->count, time_histogram_percentile(histogram, 0.5),
+            time_histogram_percentile(histogram, 0.9), time_histogram_percentile(histogram, 0.99),
+            time_histogram_percentile(histogram, 0.999), histogram->max);
+    for (i = 0; i < TIME_BUCKETS; i++)
     {
-        time_seconds_to_timespec(&ts, s);
-        nanosleep(&ts, &ts);
+        if (histogram->buckets[i] > 0)
+        {
+            fprintf(f, "  < %llu ns %llu\n", 1ULL << i, histogram->buckets[i]);
+        }
     }
 }
 
+void time_restart()
+{
+    time_start = time_in_ns();
+    time_start_t_states = z80_t_states_all;
+    time_start_speed = time_speed;
+    time_slice_end = 0;
+}
+
+// time_speed is a multiple of Z80_FREQ, TIME_SPEED_MAX does not sleep at all;
+// with time_slice the tasks of a slice run as fast as possible and the first task of the next one waits;
+// with pcm_sync the sound device sets the pace in pcm_run instead of the wall clock
 void time_sync()
 {
-    time_sleep_in_seconds(time_start + z80_t_states_all * state_duration - time_in_seconds());
+    if (time_start_speed != time_speed)
+    {
+        time_restart();
+    }
+    if (time_speed == TIME_SPEED_MAX || pcm_sync || z80_t_states_all < time_slice_end)
+    {
+        return;
+    }
+    if (time_slice > 0)
+    {
+        time_slice_end = z80_t_states_all - z80_t_states_all % time_slice + time_slice;
+    }
+    unsigned long long target = time_start;
+    if (z80_t_states_all > time_start_t_states)
+    {
+        target += time_t_states_to_ns(z80_t_states_all - time_start_t_states) / time_speed;
+    }
+    if (!rt_stats)
+    {
+        time_wait_until_ns(target);
+    }
+    else
+    {
+        unsigned long long now = time_in_ns();
+        if (target > now)
+        {
+            time_histogram_add(&rt_stats_histograms[RT_STATS_LEAD], target - now);
+            time_wait_until_ns(target);
+            time_histogram_add(&rt_stats_histograms[RT_STATS_OVERSLEEP], time_in_ns() - target);
+        }
+        else
+        {
+            time_histogram_add(&rt_stats_histograms[RT_STATS_LAG], now - target);
+        }
+    }
 }
 
 // ===REGISTER===========================================
 
+void register_lazy_materialize();
+
 void register_set_8_from_4(REG8 *reg, div_t d)
 {
     reg->byte_value = d.quot * MAX4 + d.rem;
@@ -238,12 +756,10 @@ void register_exchange16(REG16 *reg, REG16 *alt)
 
 void register_set_flag_s_z_p(REG8 reg, int mask)
 {
-    register_set_or_unset_flag(FLAG_S & mask, sign(reg.value));
-    register_set_or_unset_flag(FLAG_Z & mask, register_is_zero(reg));
-    register_set_or_unset_flag(FLAG_PV & mask, !__builtin_parity(reg.byte_value));
+    register_set_flags(register_szp_flags[reg.byte_value], mask & (FLAG_S | FLAG_Z | FLAG_PV));
 }
 
-void register_left8_with_flags(REG8 *reg, int mask, bool b)
+void register_compute_left8(REG8 *reg, int mask, bool b)
 {
     register_set_or_unset_flag(FLAG_C & mask, reg->byte_value & MAX7);
     register_set_or_unset_flag(FLAG_HC & mask, false);
@@ -253,7 +769,7 @@ void register_left8_with_flags(REG8 *reg, int mask, bool b)
     register_set_flag_s_z_p(*reg, mask);
 }
 
-void register_right8_with_flags(REG8 *reg, int mask, bool b)
+void register_compute_right8(REG8 *reg, int mask, bool b)
 {
     register_set_or_unset_flag(FLAG_C & mask, reg->byte_value & MAX0);
     register_set_or_unset_flag(FLAG_HC & mask, false);
@@ -263,7 +779,7 @@ void register_right8_with_flags(REG8 *reg, int mask, bool b)
     register_set_flag_s_z_p(*reg, mask);
 }
 
-void register_add8_with_flags(REG8 *reg, REG8 alt, int mask)
+void register_compute_add8(REG8 *reg, REG8 alt, int mask)
 {
     REG8 other;
     int r = reg->byte_value + alt.byte_value;
@@ -278,7 +794,7 @@ void register_add8_with_flags(REG8 *reg, REG8 alt, int mask)
     *reg = other;
 }
 
-void register_sub8_with_flags(REG8 *reg, REG8 alt, int mask)
+void register_compute_sub8(REG8 *reg, REG8 alt, int mask)
 {
     REG8 other;
     other.value = reg->value - alt.value;
@@ -292,87 +808,382 @@ void register_sub8_with_flags(REG8 *reg, REG8 alt, int mask)
     *reg = other;
 }
 
-void register_add16_with_flags(REG16 *reg, REG16 alt, int mask)
+void register_compute_adc8(REG8 *reg, REG8 alt, bool c)
 {
-    REG16 other;
-    int r = reg->byte_value + alt.byte_value;
-    other.byte_value = r;
-    bool s = sign(other.value);
-    register_set_or_unset_flag(FLAG_C & mask, r >= MAX16);
-    register_set_or_unset_flag(FLAG_HC & mask, (reg->byte_value & 0xFFF) + (alt.byte_value & 0xFFF) >= MAX12);
-    register_set_or_unset_flag(FLAG_N & mask, false);
-    register_set_or_unset_flag(FLAG_PV & mask, sign(reg->value) == sign(alt.value) && s != sign(reg->value));
-    register_set_or_unset_flag(FLAG_S & mask, s);
-    register_set_or_unset_flag(FLAG_Z & mask, other.value == 0);
-    *reg = other;
+    int mask;
+    register_compute_add8(reg, alt, MASK_ALL);
+    if (c)
+    {
+        mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
+        register_compute_add8(reg, REG8_ONE, mask);
+    }
 }
 
-void register_sub16_with_flags(REG16 *reg, REG16 alt, int mask)
+void register_compute_sbc8(REG8 *reg, REG8 alt, bool c)
 {
-    REG16 other;
-    other.value = reg->value - alt.value;
-    bool s = sign(other.value);
-    register_set_or_unset_flag(FLAG_C & mask, alt.byte_value > reg->byte_value);
-    register_set_or_unset_flag(FLAG_HC & mask, (alt.byte_value & 0xFFF) > (reg->byte_value & 0xFFF));
-    register_set_or_unset_flag(FLAG_N & mask, true);
-    register_set_or_unset_flag(FLAG_PV & mask, sign(reg->value) != sign(alt.value) && s != sign(reg->value));
-    register_set_or_unset_flag(FLAG_S & mask, s);
-    register_set_or_unset_flag(FLAG_Z & mask, other.value == 0);
-    *reg = other;
+    int mask;
+    register_compute_sub8(reg, alt, MASK_ALL);
+    if (c)
+    {
+        mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
+        register_compute_sub8(reg, REG8_ONE, mask);
+    }
 }
 
-// ===FILE===============================================
+void register_compute_daa(REG8 *reg)
+{
+    div_t qr = register_split_8_to_4(*reg);
+    bool c = register_is_flag(FLAG_C);
+    bool hc = register_is_flag(FLAG_HC);
+    if (c == false && hc == false && qr.quot <= 0x09 && qr.rem <= 0x09)
+    {
+    }
+    else if (c == false && hc == false && qr.quot <= 0x08 && qr.rem >= 0x0A && qr.rem <= 0x0F)
+    {
+        reg->byte_value += 0x06;
+    }
+    else if (c == false && hc == true && qr.quot <= 0x09 && qr.rem <= 0x03)
+    {
+        reg->byte_value += 0x06;
+    }
+    else if (c == false && hc == false && qr.quot >= 0x0A && qr.quot <= 0x0F && qr.rem <= 0x09)
+    {
+        reg->byte_value += 0x60;
+        register_set_or_unset_flag(FLAG_C, true);
+    }
+    else if (c == false && hc == false && qr.quot >= 0x09 && qr.quot <= 0x0F && qr.rem >= 0x0A && qr.rem <= 0x0F)
+    {
+        reg->byte_value += 0x66;
+        register_set_or_unset_flag(FLAG_C, true);
+    }
+    else if (c == false && hc == true && qr.quot >= 0x0A && qr.quot <= 0x0F && qr.rem <= 0x03)
+    {
+        reg->byte_value += 0x66;
+        register_set_or_unset_flag(FLAG_C, true);
+    }
+    else if (c == true && hc == false && qr.quot <= 0x02 && qr.rem <= 0x09)
+    {
+        reg->byte_value += 0x60;
+    }
+    else if (c == true && hc == false && qr.quot <= 0x02 && qr.rem >= 0x0A && qr.rem <= 0x0F)
+    {
+        reg->byte_value += 0x66;
+    }
+    else if (c == true && hc == true && qr.quot <= 0x03 && qr.rem <= 0x03)
+    {
+        reg->byte_value += 0x66;
+    }
+    else if (c == false && hc == true && qr.quot <= 0x08 && qr.rem >= 0x06 && qr.rem <= 0x0F)
+    {
+        reg->byte_value += 0xFA;
+    }
+    else if (c == true && hc == false && qr.quot >= 0x07 && qr.quot <= 0x0F && qr.rem <= 0x09)
+    {
+        reg->byte_value += 0xA0;
+    }
+    else if (c == true && hc == true && qr.quot >= 0x06 && qr.quot <= 0x07 && qr.rem >= 0x06 && qr.rem <= 0x0F)
+    {
+        reg->byte_value += 0x9A;
+    }
+    register_set_flag_s_z_p(*reg, MASK_ALL);
+}
 
-bool file_has_extension(const char *filename, const char *ext)
+// the tables are filled by running the bit by bit computations above over every input
+void register_init_tables()
 {
-    int i = strlen(filename);
-    int j = strlen(ext);
-    return (i > j && strcmp(filename + i - j, ext) == 0);
+    REG8 reg;
+    REG16 duplicate_af = z80_reg_af;
+    int a, b, c;
+    for (a = 0; a < MAX8; a++)
+    {
+        register_szp_flags[a] = (a & FLAG_S) | (a == 0 ? FLAG_Z : 0) | (__builtin_parity(a) ? 0 : FLAG_PV);
+    }
+    for (a = 0; a < MAX8; a++)
+    {
+        z80_reg_af.bytes.low.byte_value = 0;
+        reg.byte_value = a;
+        register_compute_add8(&reg, REG8_ONE, MASK_SZHVN);
+        register_inc8_flags[a] = z80_reg_af.bytes.low.byte_value;
+        z80_reg_af.bytes.low.byte_value = 0;
+        reg.byte_value = a;
+        register_compute_sub8(&reg, REG8_ONE, MASK_SZHVN);
+        register_dec8_flags[a] = z80_reg_af.bytes.low.byte_value;
+        for (c = 0; c < MAX1; c++)
+        {
+            z80_reg_af.bytes.low.byte_value = 0;
+            reg.byte_value = a;
+            register_compute_left8(&reg, MASK_ALL, c);
+            register_left8_flags[c][a] = z80_reg_af.bytes.low.byte_value;
+            z80_reg_af.bytes.low.byte_value = 0;
+            reg.byte_value = a;
+            register_compute_right8(&reg, MASK_ALL, c);
+            register_right8_flags[c][a] = z80_reg_af.bytes.low.byte_value;
+            for (b = 0; b < MAX8; b++)
+            {
+                z80_reg_af.bytes.low.byte_value = 0;
+                reg.byte_value = a;
+                register_compute_adc8(&reg, (REG8){.byte_value = b}, c);
+                register_add8_flags[c][a][b] = z80_reg_af.bytes.low.byte_value;
+                z80_reg_af.bytes.low.byte_value = 0;
+                reg.byte_value = a;
+                register_compute_sbc8(&reg, (REG8){.byte_value = b}, c);
+                register_sub8_flags[c][a][b] = z80_reg_af.bytes.low.byte_value;
+            }
+        }
+        for (c = 0; c < MAX2; c++)
+        {
+            z80_reg_af.bytes.low.byte_value = (c & MAX0 ? FLAG_C : 0) | (c & MAX1 ? FLAG_HC : 0);
+            reg.byte_value = a;
+            register_compute_daa(&reg);
+            register_daa_table[c][a] = (REG16){.bytes.high = reg, .bytes.low = z80_reg_af.bytes.low};
+        }
+    }
+    z80_reg_af = duplicate_af;
 }
 
-void file_load_rom(const char *filename)
+// the flags of a lazy operation are recomputed with the bit by bit routines when checking
+void register_lazy_record(int op, REG8 a, REG8 b, bool c)
 {
-    FILE *f = fopen(filename, "r");
-    fread(memory, 1, memory_size, f);
-    fclose(f);
+    REG8 reg = a;
+    REG8 duplicate_f;
+    if (register_lazy_check)
+    {
+        register_flags_materialize();
+        duplicate_f = z80_reg_af.bytes.low;
+        switch (op)
+        {
+        case LAZY_ADD:
+            register_compute_adc8(&reg, b, c);
+            break;
+        case LAZY_SUB:
+            register_compute_sbc8(&reg, b, c);
+            break;
+        case LAZY_LOGIC:
+            register_set_flag_s_z_p(reg, MASK_ALL);
+            register_set_or_unset_flag(FLAG_N | FLAG_C, false);
+            register_set_or_unset_flag(FLAG_HC, b.byte_value & FLAG_HC);
+            break;
+        case LAZY_INC:
+            register_compute_add8(&reg, REG8_ONE, MASK_SZHVN);
+            break;
+        case LAZY_DEC:
+            register_compute_sub8(&reg, REG8_ONE, MASK_SZHVN);
+            break;
+        }
+        register_lazy_shadow = z80_reg_af.bytes.low;
+        z80_reg_af.bytes.low = duplicate_f;
+    }
+    register_lazy_op = op;
+    register_lazy_a = a;
+    register_lazy_b = b;
+    register_lazy_c = c;
 }
 
-void file_load_sna(const char *filename)
+void register_lazy_materialize()
 {
-    FILE *f = fopen(filename, "r");
-    fread(&z80_reg_i, 1, 1, f);
-    fread(&z80_reg_hl_2, 2, 1, f);
-    fread(&z80_reg_de_2, 2, 1, f);
-    fread(&z80_reg_bc_2, 2, 1, f);
-    fread(&z80_reg_af_2, 2, 1, f);
-    fread(&z80_reg_hl, 2, 1, f);
-    fread(&z80_reg_de, 2, 1, f);
-    fread(&z80_reg_bc, 2, 1, f);
-    fread(&z80_reg_iy, 2, 1, f);
-    fread(&z80_reg_ix, 2, 1, f);
-    fread(&z80_iff2, 1, 1, f);
-    fread(&z80_reg_r, 1, 1, f);
-    fread(&z80_reg_af, 2, 1, f);
-    fread(&z80_reg_sp, 2, 1, f);
-    fread(&z80_imode, 1, 1, f);
-    fread(&ula_border_color, 1, 1, f);
-    fread(memory + 0x4000, 1, 49152, f);
-    fclose(f);
+    int mask = MASK_ALL;
+    unsigned char f;
+    switch (register_lazy_op)
+    {
+    case LAZY_ADD:
+        f = register_add8_flags[register_lazy_c][register_lazy_a.byte_value][register_lazy_b.byte_value];
+        break;
+    case LAZY_SUB:
+        f = register_sub8_flags[register_lazy_c][register_lazy_a.byte_value][register_lazy_b.byte_value];
+        break;
+    case LAZY_LOGIC:
+        f = register_szp_flags[register_lazy_a.byte_value] | register_lazy_b.byte_value;
+        break;
+    case LAZY_INC:
+        f = register_inc8_flags[register_lazy_a.byte_value];
+        mask = MASK_SZHVN;
+        break;
+    case LAZY_DEC:
+        f = register_dec8_flags[register_lazy_a.byte_value];
+        mask = MASK_SZHVN;
+        break;
+    default:
+        return;
+    }
+    register_store_flags(f, mask);
+    if (register_lazy_check && z80_reg_af.bytes.low.byte_value != register_lazy_shadow.byte_value)
+    {
+        fprintf(stderr, "Lazy flags %02x instead of %02x after op %d with %02x %02x %d\n",
+                z80_reg_af.bytes.low.byte_value, register_lazy_shadow.byte_value,
+                register_lazy_op, register_lazy_a.byte_value, register_lazy_b.byte_value, register_lazy_c);
+        z80_reg_af.bytes.low = register_lazy_shadow;
+    }
+    register_lazy_op = LAZY_NONE;
 }
 
-void file_save_sna(const char *filename)
+void register_left8_with_flags(REG8 *reg, int mask, bool b)
 {
-    FILE *f = fopen(filename, "w");
-    fwrite(&z80_reg_i, 1, 1, f);
-    fwrite(&z80_reg_hl_2, 2, 1, f);
-    fwrite(&z80_reg_de_2, 2, 1, f);
-    fwrite(&z80_reg_bc_2, 2, 1, f);
-    fwrite(&z80_reg_af_2, 2, 1, f);
-    fwrite(&z80_reg_hl, 2, 1, f);
-    fwrite(&z80_reg_de, 2, 1, f);
-    fwrite(&z80_reg_bc, 2, 1, f);
-    fwrite(&z80_reg_iy, 2, 1, f);
-    fwrite(&z80_reg_ix, 2, 1, f);
+    register_set_flags(register_left8_flags[b][reg->byte_value], mask);
+    reg->byte_value = reg->byte_value << 1 | b;
+}
+
+void register_right8_with_flags(REG8 *reg, int mask, bool b)
+{
+    register_set_flags(register_right8_flags[b][reg->byte_value], mask);
+    reg->byte_value = reg->byte_value >> 1 | b << 7;
+}
+
+void register_inc8_with_flags(REG8 *reg)
+{
+    if (register_lazy)
+    {
+        register_flags_materialize();
+        register_lazy_record(LAZY_INC, *reg, REG8_ONE, false);
+    }
+    else
+    {
+        register_set_flags(register_inc8_flags[reg->byte_value], MASK_SZHVN);
+    }
+    reg->byte_value++;
+}
+
+void register_dec8_with_flags(REG8 *reg)
+{
+    if (register_lazy)
+    {
+        register_flags_materialize();
+        register_lazy_record(LAZY_DEC, *reg, REG8_ONE, false);
+    }
+    else
+    {
+        register_set_flags(register_dec8_flags[reg->byte_value], MASK_SZHVN);
+    }
+    reg->byte_value--;
+}
+
+void register_add8_with_flags(REG8 *reg, REG8 alt, bool c)
+{
+    if (register_lazy)
+    {
+        register_lazy_record(LAZY_ADD, *reg, alt, c);
+    }
+    else
+    {
+        register_set_flags(register_add8_flags[c][reg->byte_value][alt.byte_value], MASK_ALL);
+    }
+    reg->byte_value += alt.byte_value + c;
+}
+
+void register_sub8_with_flags(REG8 *reg, REG8 alt, bool c)
+{
+    if (register_lazy)
+    {
+        register_lazy_record(LAZY_SUB, *reg, alt, c);
+    }
+    else
+    {
+        register_set_flags(register_sub8_flags[c][reg->byte_value][alt.byte_value], MASK_ALL);
+    }
+    reg->byte_value -= alt.byte_value + c;
+}
+
+void register_logic8_with_flags(REG8 reg, bool hc)
+{
+    if (register_lazy)
+    {
+        register_lazy_record(LAZY_LOGIC, reg, (REG8){.byte_value = hc ? FLAG_HC : 0}, false);
+    }
+    else
+    {
+        register_set_flags(register_szp_flags[reg.byte_value] | (hc ? FLAG_HC : 0), MASK_ALL);
+    }
+}
+
+void register_daa_with_flags(REG8 *reg)
+{
+    int i = (register_is_flag(FLAG_C) ? MAX0 : 0) | (register_is_flag(FLAG_HC) ? MAX1 : 0);
+    REG16 alt = register_daa_table[i][reg->byte_value];
+    register_set_flags(alt.bytes.low.byte_value, FLAG_S | FLAG_Z | FLAG_PV | FLAG_C);
+    *reg = alt.bytes.high;
+}
+
+void register_add16_with_flags(REG16 *reg, REG16 alt, int mask)
+{
+    REG16 other;
+    int r = reg->byte_value + alt.byte_value;
+    other.byte_value = r;
+    bool s = sign(other.value);
+    register_set_or_unset_flag(FLAG_C & mask, r >= MAX16);
+    register_set_or_unset_flag(FLAG_HC & mask, (reg->byte_value & 0xFFF) + (alt.byte_value & 0xFFF) >= MAX12);
+    register_set_or_unset_flag(FLAG_N & mask, false);
+    register_set_or_unset_flag(FLAG_PV & mask, sign(reg->value) == sign(alt.value) && s != sign(reg->value));
+    register_set_or_unset_flag(FLAG_S & mask, s);
+    register_set_or_unset_flag(FLAG_Z & mask, other.value == 0);
+    *reg = other;
+}
+
+void register_sub16_with_flags(REG16 *reg, REG16 alt, int mask)
+{
+    REG16 other;
+    other.value = reg->value - alt.value;
+    bool s = sign(other.value);
+    register_set_or_unset_flag(FLAG_C & mask, alt.byte_value > reg->byte_value);
+    register_set_or_unset_flag(FLAG_HC & mask, (alt.byte_value & 0xFFF) > (reg->byte_value & 0xFFF));
+    register_set_or_unset_flag(FLAG_N & mask, true);
+    register_set_or_unset_flag(FLAG_PV & mask, sign(reg->value) != sign(alt.value) && s != sign(reg->value));
+    register_set_or_unset_flag(FLAG_S & mask, s);
+    register_set_or_unset_flag(FLAG_Z & mask, other.value == 0);
+    *reg = other;
+}
+
+// ===FILE===============================================
+
+bool file_has_extension(const char *filename, const char *ext)
+{
+    int i = strlen(filename);
+    int j = strlen(ext);
+    return (i > j && strcmp(filename + i - j, ext) == 0);
+}
+
+void file_load_rom(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    fread(memory, 1, memory_size, f);
+    fclose(f);
+}
+
+void file_load_sna(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    fread(&z80_reg_i, 1, 1, f);
+    fread(&z80_reg_hl_2, 2, 1, f);
+    fread(&z80_reg_de_2, 2, 1, f);
+    fread(&z80_reg_bc_2, 2, 1, f);
+    fread(&z80_reg_af_2, 2, 1, f);
+    fread(&z80_reg_hl, 2, 1, f);
+    fread(&z80_reg_de, 2, 1, f);
+    fread(&z80_reg_bc, 2, 1, f);
+    fread(&z80_reg_iy, 2, 1, f);
+    fread(&z80_reg_ix, 2, 1, f);
+    fread(&z80_iff2, 1, 1, f);
+    fread(&z80_reg_r, 1, 1, f);
+    fread(&z80_reg_af, 2, 1, f);
+    fread(&z80_reg_sp, 2, 1, f);
+    fread(&z80_imode, 1, 1, f);
+    fread(&ula_border_color, 1, 1, f);
+    fread(memory + 0x4000, 1, 49152, f);
+    fclose(f);
+}
+
+void file_save_sna(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    register_flags_materialize();
+    fwrite(&z80_reg_i, 1, 1, f);
+    fwrite(&z80_reg_hl_2, 2, 1, f);
+    fwrite(&z80_reg_de_2, 2, 1, f);
+    fwrite(&z80_reg_bc_2, 2, 1, f);
+    fwrite(&z80_reg_af_2, 2, 1, f);
+    fwrite(&z80_reg_hl, 2, 1, f);
+    fwrite(&z80_reg_de, 2, 1, f);
+    fwrite(&z80_reg_bc, 2, 1, f);
+    fwrite(&z80_reg_iy, 2, 1, f);
+    fwrite(&z80_reg_ix, 2, 1, f);
     fwrite(&z80_iff2, 1, 1, f);
     fwrite(&z80_reg_r, 1, 1, f);
     fwrite(&z80_reg_af, 2, 1, f);
@@ -383,8 +1194,72 @@ void file_save_sna(const char *filename)
     fclose(f);
 }
 
+// writes the ULA framebuffer as a binary PPM image
+void file_save_ppm(const char *filename)
+{
+    int x, y;
+    FILE *f = fopen(filename, "w");
+    fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+    for (y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        for (x = 0; x < SCREEN_WIDTH; x++)
+        {
+            fwrite(ula_palette[ula_screen[y][x]], 1, 3, f);
+        }
+    }
+    fclose(f);
+}
+
+// ===MACHINE============================================
+
+// clears a machine and makes it the current one of the calling thread
+void machine_init(MACHINE *m)
+{
+    int i;
+    memset(m, 0, sizeof(MACHINE));
+    machine = m;
+    for (i = 0; i < 8; i++)
+    {
+        keyboard[i].byte_value = 0xFF;
+    }
+    rt_inbox_tail = &rt_inbox_stub;
+    atomic_init(&rt_inbox_head, &rt_inbox_stub);
+    z80_all8[0] = &z80_reg_bc.bytes.high;
+    z80_all8[1] = &z80_reg_bc.bytes.low;
+    z80_all8[2] = &z80_reg_de.bytes.high;
+    z80_all8[3] = &z80_reg_de.bytes.low;
+    z80_all8[4] = &z80_reg_hl.bytes.high;
+    z80_all8[5] = &z80_reg_hl.bytes.low;
+    z80_all8[7] = &z80_reg_af.bytes.high;
+    z80_bc_de_hl_sp[0] = z80_bc_de_hl_af[0] = &z80_reg_bc;
+    z80_bc_de_hl_sp[1] = z80_bc_de_hl_af[1] = &z80_reg_de;
+    z80_bc_de_hl_sp[2] = z80_bc_de_hl_af[2] = &z80_reg_hl;
+    z80_bc_de_hl_sp[3] = &z80_reg_sp;
+    z80_bc_de_hl_af[3] = &z80_reg_af;
+    z80_idle_steps = -1;
+    register_lazy_op = LAZY_NONE;
+#ifdef Z80_OPCODE_STATS
+    z80_stats.prefix = -1;
+#endif
+}
+
 // ===MEMORY=============================================
 
+void jit_invalidate(int page);
+void z80_decode_invalidate(int address);
+
+void memory_invalidate(int address)
+{
+    if (memory_code_pages[address >> 8] & CODE_DECODED)
+    {
+        z80_decode_invalidate(address);
+    }
+    if (memory_code_pages[address >> 8] & CODE_JIT)
+    {
+        jit_invalidate(address >> 8);
+    }
+}
+
 REG8 memory_read8(const REG16 reg)
 {
     return memory[reg.byte_value];
@@ -392,42 +1267,64 @@ REG8 memory_read8(const REG16 reg)
 
 void memory_write8(const REG16 reg, const REG8 alt)
 {
+    memory_written(reg.byte_value);
     memory[reg.byte_value] = alt;
 }
 
 REG8 memory_read8_indexed(const REG16 reg16, const REG8 reg8)
 {
-    return memory[reg16.byte_value + reg8.value];
+    return memory[(reg16.byte_value + reg8.value) & 0xFFFF];
 }
 
 void memory_write8_indexed(const REG16 reg16, const REG8 reg8, REG8 alt)
 {
-    memory[reg16.byte_value + reg8.value] = alt;
+    memory_written(reg16.byte_value + reg8.value);
+    memory[(reg16.byte_value + reg8.value) & 0xFFFF] = alt;
 }
 
+// a word at 0xFFFF wraps around to 0x0000
 REG16 memory_read16(REG16 reg)
 {
+    if (reg.byte_value == 0xFFFF)
+    {
+        return (REG16){.bytes.low = memory[0xFFFF], .bytes.high = memory[0]};
+    }
     return *((REG16 *)&memory[reg.byte_value]);
 }
 
 void memory_write16(REG16 reg, REG16 alt)
 {
-    *((REG16 *)&memory[reg.byte_value]) = alt;
+    memory_written(reg.byte_value);
+    memory_written(reg.byte_value + 1);
+    if (reg.byte_value == 0xFFFF)
+    {
+        memory[0xFFFF] = alt.bytes.low;
+        memory[0] = alt.bytes.high;
+    }
+    else
+    {
+        *((REG16 *)&memory[reg.byte_value]) = alt;
+    }
+}
+
+void memory_exchange16(REG16 reg, REG16 *alt)
+{
+    REG16 temp = memory_read16(reg);
+    memory_write16(reg, *alt);
+    *alt = temp;
 }
 
+// the references are used for read-modify-write so they count as writes
 REG8 *memory_ref8(const REG16 reg)
 {
+    memory_written(reg.byte_value);
     return &memory[reg.byte_value];
 }
 
 REG8 *memory_ref8_indexed(const REG16 reg16, const REG8 reg8)
 {
-    return &memory[reg16.byte_value + reg8.value];
-}
-
-REG16 *memory_ref16(REG16 reg)
-{
-    return (REG16 *)memory_ref8(reg);
+    memory_written(reg16.byte_value + reg8.value);
+    return &memory[(reg16.byte_value + reg8.value) & 0xFFFF];
 }
 
 // ======================================================
@@ -448,17 +1345,35 @@ REG8 keyboard_read8(const REG16 reg)
     return alt;
 }
 
-void keyboard_press(unsigned char key, const bool value)
+void keyboard_set(unsigned char key, const bool value);
+void rt_post_task(TASK task);
+
+void keyboard_run(void *context)
 {
-    int modifier = glutGetModifiers();
-    if (modifier & GLUT_ACTIVE_ALT || value)
+    long event = (long)context;
+    bool value = event & KEYBOARD_RELEASE;
+    if (event & KEYBOARD_ALT || value)
     {
         register_set_or_unset_bit(keyboard[0], MAX0, value);
     }
-    if (modifier & GLUT_ACTIVE_SHIFT || value)
+    if (event & KEYBOARD_SHIFT || value)
     {
         register_set_or_unset_bit(keyboard[7], MAX1, value);
     }
+    keyboard_set(event & 0xFF, value);
+}
+
+// the GLUT thread posts the key with its modifiers, the real-time thread changes the keyboard matrix
+void keyboard_press(unsigned char key, const bool value)
+{
+    int modifier = glutGetModifiers();
+    long event = key | (value ? KEYBOARD_RELEASE : 0) | (modifier & GLUT_ACTIVE_ALT ? KEYBOARD_ALT : 0) |
+                 (modifier & GLUT_ACTIVE_SHIFT ? KEYBOARD_SHIFT : 0);
+    rt_post_task((TASK){.t_states = z80_t_states_all, .task = keyboard_run, .context = (void *)event});
+}
+
+void keyboard_set(unsigned char key, const bool value)
+{
     switch (tolower(key))
     {
     case 'z':
@@ -602,6 +1517,15 @@ void keyboard_press_up(unsigned char key, int x, int y)
     keyboard_press(key, true);
 }
 
+// F1 - F5 select the speed: 1x, 2x, 4x, 10x, max
+void keyboard_special_down(int key, int x, int y)
+{
+    if (key >= GLUT_KEY_F1 && key < GLUT_KEY_F1 + sizeof(time_speeds) / sizeof(int))
+    {
+        time_speed = time_speeds[key - GLUT_KEY_F1];
+    }
+}
+
 void sound_ear_on_off(bool on)
 {
     if (on && !sound_ear)
@@ -643,9 +1567,141 @@ void port_write8(const REG16 reg, const REG8 alt)
 
 // ===Z80================================================
 
+#ifdef Z80_OPCODE_STATS
+// an instruction counts once, at the outermost call, under the prefix and opcode the innermost call resolved to
+#define Z80_STATS(prefix, reg, call) ({ unsigned long long c_ = z80_stats_clock(); int t_; z80_stats.depth++; \
+    t_ = (call); z80_stats_add(prefix, reg.byte_value, t_, z80_stats_clock() - c_); t_; })
+#else
+#define Z80_STATS(prefix, reg, call) (call)
+#endif
+
+// the handlers of the r operand families are instantiated once for each of B, C, D, E, H, L and A, so they
+// name their register instead of decoding it from the opcode; define gets the suffix, the register and the rest
+#define Z80_REGISTERS(define, ...) \
+    define(b, z80_reg_bc.bytes.high, ##__VA_ARGS__) \
+    define(c, z80_reg_bc.bytes.low, ##__VA_ARGS__) \
+    define(d, z80_reg_de.bytes.high, ##__VA_ARGS__) \
+    define(e, z80_reg_de.bytes.low, ##__VA_ARGS__) \
+    define(h, z80_reg_hl.bytes.high, ##__VA_ARGS__) \
+    define(l, z80_reg_hl.bytes.low, ##__VA_ARGS__) \
+    define(a, z80_reg_af.bytes.high, ##__VA_ARGS__)
+
+// the same list for the source register of LD r,s, a macro cannot expand inside itself
+#define Z80_REGISTERS_SOURCE(define, ...) \
+    define(b, z80_reg_bc.bytes.high, ##__VA_ARGS__) \
+    define(c, z80_reg_bc.bytes.low, ##__VA_ARGS__) \
+    define(d, z80_reg_de.bytes.high, ##__VA_ARGS__) \
+    define(e, z80_reg_de.bytes.low, ##__VA_ARGS__) \
+    define(h, z80_reg_hl.bytes.high, ##__VA_ARGS__) \
+    define(l, z80_reg_hl.bytes.low, ##__VA_ARGS__) \
+    define(a, z80_reg_af.bytes.high, ##__VA_ARGS__)
+
+// a table row of the handlers of one r family, at_hl takes the place of r = 6
+#define Z80_ROW(name, at_hl) \
+    z80_op_##name##_b, z80_op_##name##_c, z80_op_##name##_d, z80_op_##name##_e, z80_op_##name##_h, z80_op_##name##_l, at_hl, z80_op_##name##_a
+
+#ifdef Z80_OPCODE_STATS
+unsigned long long z80_stats_clock()
+{
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// the innermost call returns first and names the instruction, the outermost one has its T states and cycles
+void z80_stats_add(int prefix, int op, int t_states, unsigned long long cycles)
+{
+    if (z80_stats.prefix < 0)
+    {
+        z80_stats.prefix = prefix;
+        z80_stats.op = op;
+    }
+    if (--z80_stats.depth == 0)
+    {
+        z80_stats.count[z80_stats.prefix][z80_stats.op]++;
+        z80_stats.t_states[z80_stats.prefix][z80_stats.op] += t_states;
+        z80_stats.cycles[z80_stats.prefix][z80_stats.op] += cycles;
+        z80_stats.histogram[t_states & 0xFF]++;
+        z80_stats.prefix = -1;
+    }
+}
+
+// adds the counters of the current machine to the totals and clears them
+void z80_stats_merge()
+{
+    int i, j;
+    pthread_mutex_lock(&z80_stats_lock);
+    for (i = 0; i < 4; i++)
+    {
+        for (j = 0; j < MAX8; j++)
+        {
+            z80_stats_total.count[i][j] += z80_stats.count[i][j];
+            z80_stats_total.t_states[i][j] += z80_stats.t_states[i][j];
+            z80_stats_total.cycles[i][j] += z80_stats.cycles[i][j];
+        }
+    }
+    for (j = 0; j < MAX8; j++)
+    {
+        z80_stats_total.histogram[j] += z80_stats.histogram[j];
+    }
+    pthread_mutex_unlock(&z80_stats_lock);
+    memset(&z80_stats, 0, sizeof(Z80OPSTATS));
+    z80_stats.prefix = -1;
+}
+
+int z80_stats_compare(const void *a, const void *b)
+{
+    unsigned long long x = ((unsigned long long *)z80_stats_total.cycles)[*(const int *)a];
+    unsigned long long y = ((unsigned long long *)z80_stats_total.cycles)[*(const int *)b];
+    return (x < y) - (x > y);
+}
+
+// opcodes of all machines sorted by host cycles, then how many instructions took each number of T states;
+// the current machine is merged first, the batch workers merge theirs after every job
+void z80_stats_print()
+{
+    const char *prefixes[] = {"", "CB", "ED", "DD/FD"};
+    int i, order[4 * MAX8];
+    z80_stats_merge();
+    pthread_mutex_lock(&z80_stats_lock);
+    for (i = 0; i < 4 * MAX8; i++)
+    {
+        order[i] = i;
+    }
+    qsort(order, 4 * MAX8, sizeof(int), z80_stats_compare);
+    fprintf(stderr, "prefix opcode count t_states host_cycles cycles/op\n");
+    for (i = 0; i < 4 * MAX8 && z80_stats_total.count[order[i] / MAX8][order[i] % MAX8] > 0; i++)
+    {
+        int prefix = order[i] / MAX8, op = order[i] % MAX8;
+        fprintf(stderr, "%-6s %02X %llu %llu %llu %.1f\n", prefixes[prefix], op, z80_stats_total.count[prefix][op],
+                z80_stats_total.t_states[prefix][op], z80_stats_total.cycles[prefix][op],
+                (double)z80_stats_total.cycles[prefix][op] / z80_stats_total.count[prefix][op]);
+    }
+    fprintf(stderr, "t_states count\n");
+    for (i = 0; i < MAX8; i++)
+    {
+        if (z80_stats_total.histogram[i] > 0)
+        {
+            fprintf(stderr, "%d %llu\n", i, z80_stats_total.histogram[i]);
+        }
+    }
+    pthread_mutex_unlock(&z80_stats_lock);
+}
+
+void z80_stats_signal(int signal)
+{
+    z80_stats_requested = true;
+}
+#endif
+
 void z80_print()
 {
     char o[9];
+    register_flags_materialize();
     to_binary(z80_reg_af.bytes.low.byte_value, o);
     printf("  BC   DE   HL   AF   PC   SP   IX   IY  I  RIM  IFF1 SZ5H3PNC\n");
     printf("%04x %04x %04x %04x %04x %04x %04x %04x %02x %02x %d %s %s\n",
@@ -672,6 +1728,7 @@ void z80_reset()
     z80_halt = false;
     z80_can_execute = true;
     z80_imode = 0;
+    register_lazy_op = LAZY_NONE;
     z80_reg_af.byte_value = 0xFFFF;
     z80_reg_sp.byte_value = 0xFFFF;
     z80_reg_pc.byte_value = 0;
@@ -686,6 +1743,11 @@ void z80_memory_refresh()
     z80_reg_r.byte_value = ((z80_reg_r.byte_value + 1) & 0x7F) | (z80_reg_r.byte_value & MAX7);
 }
 
+void z80_memory_refresh_by(unsigned long long n)
+{
+    z80_reg_r.byte_value = ((z80_reg_r.byte_value + n) & 0x7F) | (z80_reg_r.byte_value & MAX7);
+}
+
 REG8 z80_next8()
 {
     REG8 v = memory_read8(z80_reg_pc);
@@ -706,6 +1768,31 @@ void z80_push16(const REG16 reg)
     memory_write16(z80_reg_sp, reg);
 }
 
+// the calls whose return address is below SP have returned or were unwound, SP 0 is an empty stack
+void profile_unwind(unsigned int sp)
+{
+    while (profile_calls_size > 0 && profile_calls[profile_calls_size - 1].sp.byte_value < sp)
+    {
+        profile_calls_size--;
+    }
+}
+
+// pushes the return address and, when profiling, records the call site on the shadow call stack
+void z80_push_call(REG16 site)
+{
+    z80_push16(z80_reg_pc);
+    if (profile_period > 0)
+    {
+        profile_unwind(z80_reg_sp.byte_value + 1);
+        if (profile_calls_size == PROFILE_CALLS)
+        {
+            memmove(&profile_calls[0], &profile_calls[1], (PROFILE_CALLS - 1) * sizeof(PROFILECALL));
+            profile_calls_size--;
+        }
+        profile_calls[profile_calls_size++] = (PROFILECALL){.sp = z80_reg_sp, .site = site};
+    }
+}
+
 REG16 z80_pop16()
 {
     REG16 v = memory_read16(z80_reg_sp);
@@ -719,45 +1806,10 @@ REG8 z80_fetch_opcode()
     return z80_next8();
 }
 
-REG8 *z80_decode_reg8(REG8 reg, int pos, bool *r)
-{
-    int i = reg.byte_value >> pos & 0x07;
-    if (i == 0x06)
-    {
-        *r = true;
-        return memory_ref8(z80_reg_hl);
-    }
-    else
-    {
-        *r = false;
-        return z80_all8[i];
-    }
-}
-
 bool z80_decode_condition(REG8 reg)
 {
     int i = reg.byte_value >> 3 & 0x07;
-    switch (i)
-    {
-    case 0x00:
-        return !register_is_flag(FLAG_Z);
-    case 0x01:
-        return register_is_flag(FLAG_Z);
-    case 0x02:
-        return !register_is_flag(FLAG_C);
-    case 0x03:
-        return register_is_flag(FLAG_C);
-    case 0x04:
-        return !register_is_flag(FLAG_PV);
-    case 0x05:
-        return register_is_flag(FLAG_PV);
-    case 0x06:
-        return !register_is_flag(FLAG_S);
-    case 0x07:
-        return register_is_flag(FLAG_S);
-    default:
-        return 0; // fail
-    }
+    return (i & 0x01) ? register_is_flag(z80_condition_flags[i]) : !register_is_flag(z80_condition_flags[i]);
 }
 
 int z80_jump_with_condition(bool c)
@@ -802,7 +1854,7 @@ int z80_call_with_condition(bool c)
     REG16 reg = z80_next16();
     if (c)
     {
-        z80_push16(z80_reg_pc);
+        z80_push_call((REG16){.byte_value = z80_reg_pc.byte_value - 3});
         z80_reg_pc = reg;
         return 17;
     }
@@ -812,1804 +1864,4480 @@ int z80_call_with_condition(bool c)
     }
 }
 
-int z80_execute_simple(REG8 reg)
+void z80_alu_add(REG8 alt)
 {
-    REG8 *alt;
-    div_t qr;
-    int mask = MASK_ALL;
-    bool c, hc, hl;
-    REG8 duplicate_a = z80_reg_af.bytes.high;
-    switch (reg.byte_value)
+    register_add8_with_flags(&z80_reg_af.bytes.high, alt, false);
+}
+
+void z80_alu_adc(REG8 alt)
+{
+    register_add8_with_flags(&z80_reg_af.bytes.high, alt, register_is_flag(FLAG_C));
+}
+
+void z80_alu_sub(REG8 alt)
+{
+    register_sub8_with_flags(&z80_reg_af.bytes.high, alt, false);
+}
+
+void z80_alu_sbc(REG8 alt)
+{
+    register_sub8_with_flags(&z80_reg_af.bytes.high, alt, register_is_flag(FLAG_C));
+}
+
+void z80_alu_and(REG8 alt)
+{
+    z80_reg_af.bytes.high.byte_value &= alt.byte_value;
+    register_logic8_with_flags(z80_reg_af.bytes.high, true);
+}
+
+void z80_alu_xor(REG8 alt)
+{
+    z80_reg_af.bytes.high.byte_value ^= alt.byte_value;
+    register_logic8_with_flags(z80_reg_af.bytes.high, false);
+}
+
+void z80_alu_or(REG8 alt)
+{
+    z80_reg_af.bytes.high.byte_value |= alt.byte_value;
+    register_logic8_with_flags(z80_reg_af.bytes.high, false);
+}
+
+void z80_alu_cp(REG8 alt)
+{
+    REG8 duplicate_a = z80_reg_af.bytes.high;
+    register_sub8_with_flags(&duplicate_a, alt, false);
+}
+
+void z80_alu_rlc(REG8 *alt)
+{
+    register_left8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
+}
+
+void z80_alu_rrc(REG8 *alt)
+{
+    register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX0));
+}
+
+void z80_alu_rl(REG8 *alt)
+{
+    register_left8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
+}
+
+void z80_alu_rr(REG8 *alt)
+{
+    register_right8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
+}
+
+void z80_alu_sla(REG8 *alt)
+{
+    register_left8_with_flags(alt, MASK_ALL, false);
+}
+
+void z80_alu_sra(REG8 *alt)
+{
+    register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
+}
+
+void z80_alu_sll(REG8 *alt)
+{
+    register_left8_with_flags(alt, MASK_ALL, true);
+}
+
+void z80_alu_srl(REG8 *alt)
+{
+    register_right8_with_flags(alt, MASK_ALL, false);
+}
+
+void z80_alu_bit(REG8 reg, REG8 alt)
+{
+    register_set_or_unset_flag(FLAG_Z, !register_is_bit(alt, 0x01 << (reg.byte_value >> 3 & 0x07)));
+    register_set_or_unset_flag(FLAG_HC, true);
+    register_set_or_unset_flag(FLAG_N, false);
+}
+
+// ---CB-------------------------------------------------
+
+#define Z80_OP_SHIFT_R(r, alt, name) \
+    int z80_op_##name##_##r(REG8 reg) \
+    { \
+        z80_alu_##name(&alt); \
+        return 8; \
+    }
+
+#define Z80_OP_BIT_R(r, alt) \
+    int z80_op_bit_##r(REG8 reg) \
+    { \
+        z80_alu_bit(reg, alt); \
+        return 8; \
+    }
+
+#define Z80_OP_SET_R(r, alt, name, value) \
+    int z80_op_##name##_##r(REG8 reg) \
+    { \
+        register_set_or_unset_bit(alt, 0x01 << (reg.byte_value >> 3 & 0x07), value); \
+        return 8; \
+    }
+
+// RLC r
+Z80_REGISTERS(Z80_OP_SHIFT_R, rlc)
+
+// RLC (HL)
+int z80_op_rlc_at_hl(REG8 reg)
+{
+    z80_alu_rlc(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// RRC r
+Z80_REGISTERS(Z80_OP_SHIFT_R, rrc)
+
+// RRC (HL)
+int z80_op_rrc_at_hl(REG8 reg)
+{
+    z80_alu_rrc(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// RL r
+Z80_REGISTERS(Z80_OP_SHIFT_R, rl)
+
+// RL (HL)
+int z80_op_rl_at_hl(REG8 reg)
+{
+    z80_alu_rl(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// RR r
+Z80_REGISTERS(Z80_OP_SHIFT_R, rr)
+
+// RR (HL)
+int z80_op_rr_at_hl(REG8 reg)
+{
+    z80_alu_rr(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// SLA r
+Z80_REGISTERS(Z80_OP_SHIFT_R, sla)
+
+// SLA (HL)
+int z80_op_sla_at_hl(REG8 reg)
+{
+    z80_alu_sla(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// SRA r
+Z80_REGISTERS(Z80_OP_SHIFT_R, sra)
+
+// SRA (HL)
+int z80_op_sra_at_hl(REG8 reg)
+{
+    z80_alu_sra(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// SLL r
+Z80_REGISTERS(Z80_OP_SHIFT_R, sll)
+
+// SLL (HL)
+int z80_op_sll_at_hl(REG8 reg)
+{
+    z80_alu_sll(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// SRL r
+Z80_REGISTERS(Z80_OP_SHIFT_R, srl)
+
+// SRL (HL)
+int z80_op_srl_at_hl(REG8 reg)
+{
+    z80_alu_srl(memory_ref8(z80_reg_hl));
+    return 15;
+}
+
+// BIT b,r
+Z80_REGISTERS(Z80_OP_BIT_R)
+
+// BIT b,(HL)
+int z80_op_bit_at_hl(REG8 reg)
+{
+    z80_alu_bit(reg, memory_read8(z80_reg_hl));
+    return 12;
+}
+
+// RES b,r
+Z80_REGISTERS(Z80_OP_SET_R, res, false)
+
+// RES b,(HL)
+int z80_op_res_at_hl(REG8 reg)
+{
+    register_set_or_unset_bit(*memory_ref8(z80_reg_hl), 0x01 << (reg.byte_value >> 3 & 0x07), false);
+    return 15;
+}
+
+// SET b,r
+Z80_REGISTERS(Z80_OP_SET_R, set, true)
+
+// SET b,(HL)
+int z80_op_set_at_hl(REG8 reg)
+{
+    register_set_or_unset_bit(*memory_ref8(z80_reg_hl), 0x01 << (reg.byte_value >> 3 & 0x07), true);
+    return 15;
+}
+
+Z80OP z80_ops_cb[MAX8] = {
+    /* 0x00 */ Z80_ROW(rlc, z80_op_rlc_at_hl),
+    /* 0x08 */ Z80_ROW(rrc, z80_op_rrc_at_hl),
+    /* 0x10 */ Z80_ROW(rl, z80_op_rl_at_hl),
+    /* 0x18 */ Z80_ROW(rr, z80_op_rr_at_hl),
+    /* 0x20 */ Z80_ROW(sla, z80_op_sla_at_hl),
+    /* 0x28 */ Z80_ROW(sra, z80_op_sra_at_hl),
+    /* 0x30 */ Z80_ROW(sll, z80_op_sll_at_hl),
+    /* 0x38 */ Z80_ROW(srl, z80_op_srl_at_hl),
+    /* 0x40 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x48 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x50 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x58 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x60 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x68 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x70 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x78 */ Z80_ROW(bit, z80_op_bit_at_hl),
+    /* 0x80 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0x88 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0x90 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0x98 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0xA0 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0xA8 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0xB0 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0xB8 */ Z80_ROW(res, z80_op_res_at_hl),
+    /* 0xC0 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xC8 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xD0 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xD8 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xE0 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xE8 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xF0 */ Z80_ROW(set, z80_op_set_at_hl),
+    /* 0xF8 */ Z80_ROW(set, z80_op_set_at_hl)};
+
+int z80_execute_cb(REG8 reg)
+{
+    return Z80_STATS(STATS_CB, reg, z80_ops_cb[reg.byte_value](reg));
+}
+
+// ---ED-------------------------------------------------
+
+int z80_op_fail(REG8 reg)
+{
+    return 0; // fail
+}
+
+// IN r,(C)
+int z80_op_in_r_c(REG8 reg)
+{
+    REG8 *alt = z80_all8[reg.byte_value >> 3 & 0x07];
+    *alt = port_read8(z80_reg_bc);
+    register_set_flag_s_z_p(*alt, MASK_ALL);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 12;
+}
+
+// IN 0,(C)
+int z80_op_in_c(REG8 reg)
+{
+    register_set_flag_s_z_p(port_read8(z80_reg_bc), MASK_ALL);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 12;
+}
+
+// OUT (C),r
+int z80_op_out_c_r(REG8 reg)
+{
+    port_write8(z80_reg_bc, *z80_all8[reg.byte_value >> 3 & 0x07]);
+    return 12;
+}
+
+// OUT (C),0
+int z80_op_out_c_0(REG8 reg)
+{
+    port_write8(z80_reg_bc, (REG8){.value = 0});
+    return 12;
+}
+
+// SBC HL,ss
+int z80_op_sbc_hl_ss(REG8 reg)
+{
+    int mask;
+    bool c = register_is_flag(FLAG_C);
+    register_sub16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], MASK_ALL);
+    if (c)
+    {
+        mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
+        register_sub16_with_flags(&z80_reg_hl, REG16_ONE, mask);
+    }
+    return 15;
+}
+
+// ADC HL,ss
+int z80_op_adc_hl_ss(REG8 reg)
+{
+    int mask;
+    bool c = register_is_flag(FLAG_C);
+    register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], MASK_ALL);
+    if (c)
+    {
+        mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
+        register_add16_with_flags(&z80_reg_hl, REG16_ONE, mask);
+    }
+    return 15;
+}
+
+// LD (nn),dd
+int z80_op_ld_at_nn_dd(REG8 reg)
+{
+    memory_write16(z80_next16(), *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03]);
+    return 20;
+}
+
+// LD dd,(nn)
+int z80_op_ld_dd_at_nn(REG8 reg)
+{
+    *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03] = memory_read16(z80_next16());
+    return 20;
+}
+
+// NEG
+int z80_op_neg(REG8 reg)
+{
+    REG8 duplicate_a = z80_reg_af.bytes.high;
+    z80_reg_af.bytes.high.value = 0;
+    register_sub8_with_flags(&z80_reg_af.bytes.high, duplicate_a, false);
+    return 8;
+}
+
+// RETN
+int z80_op_retn(REG8 reg)
+{
+    z80_reg_pc = z80_pop16();
+    z80_iff1 = z80_iff2;
+    return 14;
+}
+
+// RETI
+int z80_op_reti(REG8 reg)
+{
+    z80_reg_pc = z80_pop16();
+    return 14;
+}
+
+// IM 0
+int z80_op_im0(REG8 reg)
+{
+    z80_imode = 0;
+    return 8;
+}
+
+// IM 1
+int z80_op_im1(REG8 reg)
+{
+    z80_imode = 1;
+    return 8;
+}
+
+// IM 2
+int z80_op_im2(REG8 reg)
+{
+    z80_imode = 2;
+    return 8;
+}
+
+// LD I,A
+int z80_op_ld_i_a(REG8 reg)
+{
+    z80_reg_i = z80_reg_af.bytes.high;
+    return 9;
+}
+
+// LD R,A
+int z80_op_ld_refresh_a(REG8 reg)
+{
+    z80_reg_r = z80_reg_af.bytes.high;
+    return 9;
+}
+
+// LD A,I
+int z80_op_ld_a_i(REG8 reg)
+{
+    z80_reg_af.bytes.high = z80_reg_i;
+    register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
+    register_set_or_unset_flag(FLAG_PV, z80_iff2);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 9;
+}
+
+// LD A,R
+int z80_op_ld_a_refresh(REG8 reg)
+{
+    z80_idle_r_read = true;
+    z80_reg_af.bytes.high = z80_reg_r;
+    register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
+    register_set_or_unset_flag(FLAG_PV, z80_iff2);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 9;
+}
+
+// RRD
+int z80_op_rrd(REG8 reg)
+{
+    REG8 *alt = memory_ref8(z80_reg_hl);
+    div_t qr = register_split_8_to_4(*alt);
+    div_t qr_alt = register_split_8_to_4(z80_reg_af.bytes.high);
+    register_set_8_from_4(&z80_reg_af.bytes.high, (div_t){.quot = qr_alt.quot, .rem = qr.rem});
+    register_set_8_from_4(alt, (div_t){.quot = qr_alt.rem, .rem = qr.quot});
+    register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 18;
+}
+
+// RLD
+int z80_op_rld(REG8 reg)
+{
+    REG8 *alt = memory_ref8(z80_reg_hl);
+    div_t qr = register_split_8_to_4(*alt);
+    div_t qr_alt = register_split_8_to_4(z80_reg_af.bytes.high);
+    register_set_8_from_4(&z80_reg_af.bytes.high, (div_t){.quot = qr_alt.quot, .rem = qr.quot});
+    register_set_8_from_4(alt, (div_t){.quot = qr.rem, .rem = qr_alt.rem});
+    register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 18;
+}
+
+// NOPD
+int z80_op_nopd(REG8 reg)
+{
+    return 8;
+}
+
+bool z80_repeat_ld()
+{
+    return register_is_flag(FLAG_PV);
+}
+
+bool z80_repeat_cp()
+{
+    return register_is_flag(FLAG_PV) && !register_is_flag(FLAG_Z);
+}
+
+bool z80_repeat_io()
+{
+    return !register_is_flag(FLAG_Z);
+}
+
+int z80_repeat_count()
+{
+    return z80_reg_bc.byte_value == 0 ? MAX16 - 1 : z80_reg_bc.byte_value - 1;
+}
+
+// limits n to the writes from address by step that come before the instruction bytes at PC - 2
+int z80_repeat_clamp(int n, int address, int step)
+{
+    int a = ((z80_reg_pc.byte_value - 2 - address) * step) & 0xFFFF;
+    int b = ((z80_reg_pc.byte_value - 1 - address) * step) & 0xFFFF;
+    n = n < a ? n : a;
+    return n < b ? n : b;
+}
+
+// the instruction is still in memory, otherwise whatever was written over it runs next
+bool z80_repeat_fetched(REG8 reg)
+{
+    return memory_read8((REG16){.byte_value = z80_reg_pc.byte_value - 2}).byte_value == 0xED &&
+           memory_read8((REG16){.byte_value = z80_reg_pc.byte_value - 1}).byte_value == reg.byte_value;
+}
+
+// the kernels run up to limit iterations that are known to repeat and leave the last one to the handler
+
+int z80_kernel_ldir(int limit)
+{
+    int n = z80_repeat_count(), d = (REG16){.byte_value = z80_reg_de.byte_value - z80_reg_hl.byte_value}.byte_value;
+    n = n < limit ? n : limit;
+    n = n < MAX16 - z80_reg_hl.byte_value ? n : MAX16 - z80_reg_hl.byte_value;
+    n = n < MAX16 - z80_reg_de.byte_value ? n : MAX16 - z80_reg_de.byte_value;
+    n = (d != 0 && d < n) ? d : n;
+    n = z80_repeat_clamp(n, z80_reg_de.byte_value, 1);
+    memmove(&memory[z80_reg_de.byte_value], &memory[z80_reg_hl.byte_value], n);
+    for (int i = 0; i < n; i++)
+    {
+        memory_written(z80_reg_de.byte_value + i);
+    }
+    z80_reg_hl.byte_value += n;
+    z80_reg_de.byte_value += n;
+    z80_reg_bc.byte_value -= n;
+    return n;
+}
+
+int z80_kernel_lddr(int limit)
+{
+    int n = z80_repeat_count(), d = (REG16){.byte_value = z80_reg_hl.byte_value - z80_reg_de.byte_value}.byte_value;
+    n = n < limit ? n : limit;
+    n = n < z80_reg_hl.byte_value + 1 ? n : z80_reg_hl.byte_value + 1;
+    n = n < z80_reg_de.byte_value + 1 ? n : z80_reg_de.byte_value + 1;
+    n = (d != 0 && d < n) ? d : n;
+    n = z80_repeat_clamp(n, z80_reg_de.byte_value, -1);
+    memmove(&memory[z80_reg_de.byte_value + 1 - n], &memory[z80_reg_hl.byte_value + 1 - n], n);
+    for (int i = 0; i < n; i++)
+    {
+        memory_written(z80_reg_de.byte_value - i);
+    }
+    z80_reg_hl.byte_value -= n;
+    z80_reg_de.byte_value -= n;
+    z80_reg_bc.byte_value -= n;
+    return n;
+}
+
+int z80_kernel_cpir(int limit)
+{
+    int n = z80_repeat_count();
+    n = n < limit ? n : limit;
+    n = n < MAX16 - z80_reg_hl.byte_value ? n : MAX16 - z80_reg_hl.byte_value;
+    REG8 *found = memchr(&memory[z80_reg_hl.byte_value], z80_reg_af.bytes.high.byte_value, n);
+    n = (found == NULL ? n : found - &memory[z80_reg_hl.byte_value]);
+    z80_reg_hl.byte_value += n;
+    z80_reg_bc.byte_value -= n;
+    return n;
+}
+
+int z80_kernel_cpdr(int limit)
+{
+    int i, n = z80_repeat_count();
+    n = n < limit ? n : limit;
+    n = n < z80_reg_hl.byte_value + 1 ? n : z80_reg_hl.byte_value + 1;
+    for (i = 0; i < n && memory[z80_reg_hl.byte_value - i].byte_value != z80_reg_af.bytes.high.byte_value; i++)
+        ;
+    z80_reg_hl.byte_value -= i;
+    z80_reg_bc.byte_value -= i;
+    return i;
+}
+
+// repeats a block instruction in place for every iteration that starts before the next task is due,
+// the time is advanced while repeating so that the ports see the same T states as when stepping
+int z80_repeat_block(Z80OP op, REG8 reg, bool (*again)(), int (*kernel)(int limit))
+{
+    unsigned long long t = z80_t_states_all;
+    int n;
+    op(reg);
+    while (again() && z80_repeat_fetched(reg) && z80_t_states_all + 21 < z80_deadline)
+    {
+        z80_t_states_all += 21;
+        if (kernel != NULL)
+        {
+            n = kernel((z80_deadline - z80_t_states_all - 1) / 21);
+            z80_t_states_all += 21 * n;
+            z80_memory_refresh_by(2 * n);
+            z80_instructions += n;
+        }
+        z80_memory_refresh_by(2);
+        z80_instructions++;
+        op(reg);
+    }
+    if (again())
+    {
+        z80_reg_pc.value -= 2;
+        n = 21;
+    }
+    else
+    {
+        n = 16;
+    }
+    n += z80_t_states_all - t;
+    z80_t_states_all = t;
+    return n;
+}
+
+// LDI
+int z80_op_ldi(REG8 reg)
+{
+    memory_write8(z80_reg_de, memory_read8(z80_reg_hl));
+    z80_reg_de.value++;
+    z80_reg_hl.value++;
+    z80_reg_bc.value--;
+    register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 16;
+}
+
+// LDIR
+int z80_op_ldir(REG8 reg)
+{
+    return z80_repeat_block(z80_op_ldi, reg, z80_repeat_ld, z80_kernel_ldir);
+}
+
+// CPI
+int z80_op_cpi(REG8 reg)
+{
+    z80_alu_cp(memory_read8(z80_reg_hl));
+    z80_reg_hl.value++;
+    z80_reg_bc.value--;
+    register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
+    return 16;
+}
+
+// CPIR
+int z80_op_cpir(REG8 reg)
+{
+    return z80_repeat_block(z80_op_cpi, reg, z80_repeat_cp, z80_kernel_cpir);
+}
+
+// INI
+int z80_op_ini(REG8 reg)
+{
+    memory_write8(z80_reg_hl, port_read8(z80_reg_bc));
+    z80_reg_bc.bytes.high.value--;
+    z80_reg_hl.value++;
+    register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
+    register_set_or_unset_flag(FLAG_N, true);
+    return 16;
+}
+
+// INIR
+int z80_op_inir(REG8 reg)
+{
+    return z80_repeat_block(z80_op_ini, reg, z80_repeat_io, NULL);
+}
+
+// OUTI
+int z80_op_outi(REG8 reg)
+{
+    z80_reg_bc.bytes.high.value--;
+    port_write8(z80_reg_bc, memory_read8(z80_reg_hl));
+    z80_reg_hl.value++;
+    register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
+    register_set_or_unset_flag(FLAG_N, true);
+    return 16;
+}
+
+// OTIR
+int z80_op_otir(REG8 reg)
+{
+    return z80_repeat_block(z80_op_outi, reg, z80_repeat_io, NULL);
+}
+
+// LDD
+int z80_op_ldd(REG8 reg)
+{
+    memory_write8(z80_reg_de, memory_read8(z80_reg_hl));
+    z80_reg_de.value--;
+    z80_reg_hl.value--;
+    z80_reg_bc.value--;
+    register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
+    register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
+    return 16;
+}
+
+// LDDR
+int z80_op_lddr(REG8 reg)
+{
+    return z80_repeat_block(z80_op_ldd, reg, z80_repeat_ld, z80_kernel_lddr);
+}
+
+// CPD
+int z80_op_cpd(REG8 reg)
+{
+    z80_alu_cp(memory_read8(z80_reg_hl));
+    z80_reg_hl.value--;
+    z80_reg_bc.value--;
+    register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
+    return 16;
+}
+
+// CPDR
+int z80_op_cpdr(REG8 reg)
+{
+    return z80_repeat_block(z80_op_cpd, reg, z80_repeat_cp, z80_kernel_cpdr);
+}
+
+// IND
+int z80_op_ind(REG8 reg)
+{
+    memory_write8(z80_reg_hl, port_read8(z80_reg_bc));
+    z80_reg_bc.bytes.high.value--;
+    z80_reg_hl.value--;
+    register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
+    register_set_or_unset_flag(FLAG_N, true);
+    return 16;
+}
+
+// INDR
+int z80_op_indr(REG8 reg)
+{
+    return z80_repeat_block(z80_op_ind, reg, z80_repeat_io, NULL);
+}
+
+// OUTD
+int z80_op_outd(REG8 reg)
+{
+    z80_reg_bc.bytes.high.value--;
+    port_write8(z80_reg_bc, memory_read8(z80_reg_hl));
+    z80_reg_hl.value--;
+    register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
+    register_set_or_unset_flag(FLAG_N, true);
+    return 16;
+}
+
+// OTDR
+int z80_op_otdr(REG8 reg)
+{
+    return z80_repeat_block(z80_op_outd, reg, z80_repeat_io, NULL);
+}
+
+Z80OP z80_ops_ed[MAX8] = {
+    /* 0x00 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x08 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x10 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x18 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x20 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x28 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x30 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x38 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x40 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_sbc_hl_ss, z80_op_ld_at_nn_dd, z80_op_neg, z80_op_retn, z80_op_im0, z80_op_ld_i_a,
+    /* 0x48 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_adc_hl_ss, z80_op_ld_dd_at_nn, z80_op_neg, z80_op_reti, z80_op_im0, z80_op_ld_refresh_a,
+    /* 0x50 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_sbc_hl_ss, z80_op_ld_at_nn_dd, z80_op_neg, z80_op_retn, z80_op_im1, z80_op_ld_a_i,
+    /* 0x58 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_adc_hl_ss, z80_op_ld_dd_at_nn, z80_op_neg, z80_op_retn, z80_op_im2, z80_op_ld_a_refresh,
+    /* 0x60 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_sbc_hl_ss, z80_op_ld_at_nn_dd, z80_op_neg, z80_op_retn, z80_op_im0, z80_op_rrd,
+    /* 0x68 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_adc_hl_ss, z80_op_ld_dd_at_nn, z80_op_neg, z80_op_retn, z80_op_im0, z80_op_rld,
+    /* 0x70 */ z80_op_in_c, z80_op_out_c_0, z80_op_sbc_hl_ss, z80_op_ld_at_nn_dd, z80_op_neg, z80_op_retn, z80_op_im1, z80_op_nopd,
+    /* 0x78 */ z80_op_in_r_c, z80_op_out_c_r, z80_op_adc_hl_ss, z80_op_ld_dd_at_nn, z80_op_neg, z80_op_retn, z80_op_im2, z80_op_nopd,
+    /* 0x80 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x88 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x90 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0x98 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xA0 */ z80_op_ldi, z80_op_cpi, z80_op_ini, z80_op_outi, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xA8 */ z80_op_ldd, z80_op_cpd, z80_op_ind, z80_op_outd, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xB0 */ z80_op_ldir, z80_op_cpir, z80_op_inir, z80_op_otir, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xB8 */ z80_op_lddr, z80_op_cpdr, z80_op_indr, z80_op_otdr, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xC0 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xC8 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xD0 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xD8 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xE0 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xE8 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xF0 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail,
+    /* 0xF8 */ z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail, z80_op_fail};
+
+int z80_execute_ed(REG8 reg)
+{
+    return Z80_STATS(STATS_ED, reg, z80_ops_ed[reg.byte_value](reg));
+}
+
+// ---DD/FD----------------------------------------------
+
+int z80_execute_simple(REG8 reg);
+
+int z80_op_index_simple(REG8 reg, REG16 *other)
+{
+    return z80_execute_simple(reg);
+}
+
+int z80_op_index_fail(REG8 reg, REG16 *other)
+{
+    return 0; // fail
+}
+
+// ADD IX,pp
+int z80_op_add_ix_pp(REG8 reg, REG16 *other)
+{
+    register_add16_with_flags(other, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], MASK_HNC);
+    return 15;
+}
+
+// ADD IX,IX
+int z80_op_add_ix_ix(REG8 reg, REG16 *other)
+{
+    register_add16_with_flags(other, *other, MASK_HNC);
+    return 15;
+}
+
+// LD IX,nn
+int z80_op_ld_ix_nn(REG8 reg, REG16 *other)
+{
+    *other = z80_next16();
+    return 14;
+}
+
+// LD (nn),IX
+int z80_op_ld_at_nn_ix(REG8 reg, REG16 *other)
+{
+    memory_write16(z80_next16(), *other);
+    return 20;
+}
+
+// INC IX
+int z80_op_inc_ix(REG8 reg, REG16 *other)
+{
+    register_add16_with_flags(other, REG16_ONE, MASK_NONE);
+    return 10;
+}
+
+// INC IXH
+int z80_op_inc_ixh(REG8 reg, REG16 *other)
+{
+    register_inc8_with_flags(&other->bytes.high);
+    return 8;
+}
+
+// DEC IXH
+int z80_op_dec_ixh(REG8 reg, REG16 *other)
+{
+    register_dec8_with_flags(&other->bytes.high);
+    return 8;
+}
+
+// LD IXH,n
+int z80_op_ld_ixh_n(REG8 reg, REG16 *other)
+{
+    other->bytes.high = z80_next8();
+    return 11;
+}
+
+// LD IX,(nn)
+int z80_op_ld_ix_at_nn(REG8 reg, REG16 *other)
+{
+    *other = memory_read16(z80_next16());
+    return 20;
+}
+
+// DEC IX
+int z80_op_dec_ix(REG8 reg, REG16 *other)
+{
+    register_sub16_with_flags(other, REG16_ONE, MASK_NONE);
+    return 10;
+}
+
+// INC IXL
+int z80_op_inc_ixl(REG8 reg, REG16 *other)
+{
+    register_inc8_with_flags(&other->bytes.low);
+    return 8;
+}
+
+// DEC IXL
+int z80_op_dec_ixl(REG8 reg, REG16 *other)
+{
+    register_dec8_with_flags(&other->bytes.low);
+    return 8;
+}
+
+// LD IXL,n
+int z80_op_ld_ixl_n(REG8 reg, REG16 *other)
+{
+    other->bytes.low = z80_next8();
+    return 11;
+}
+
+// INC (IX+d)
+int z80_op_inc_at_ix(REG8 reg, REG16 *other)
+{
+    register_inc8_with_flags(memory_ref8_indexed(*other, z80_next8()));
+    return 23;
+}
+
+// DEC (IX+d)
+int z80_op_dec_at_ix(REG8 reg, REG16 *other)
+{
+    register_dec8_with_flags(memory_ref8_indexed(*other, z80_next8()));
+    return 23;
+}
+
+// LD (IX+d),n
+int z80_op_ld_at_ix_n(REG8 reg, REG16 *other)
+{
+    REG8 d = z80_next8();
+    memory_write8_indexed(*other, d, z80_next8());
+    return 19;
+}
+
+// LD r,IXH
+int z80_op_ld_r_ixh(REG8 reg, REG16 *other)
+{
+    *z80_all8[reg.byte_value >> 3 & 0x07] = other->bytes.high;
+    return 8;
+}
+
+// LD r,IXL
+int z80_op_ld_r_ixl(REG8 reg, REG16 *other)
+{
+    *z80_all8[reg.byte_value >> 3 & 0x07] = other->bytes.low;
+    return 8;
+}
+
+// LD r,(IX+d)
+int z80_op_ld_r_at_ix(REG8 reg, REG16 *other)
+{
+    *z80_all8[reg.byte_value >> 3 & 0x07] = memory_read8_indexed(*other, z80_next8());
+    return 19;
+}
+
+// LD IXH,r
+int z80_op_ld_ixh_r(REG8 reg, REG16 *other)
+{
+    other->bytes.high = *z80_all8[reg.byte_value & 0x07];
+    return 8;
+}
+
+// LD IXH,IXH
+int z80_op_ld_ixh_ixh(REG8 reg, REG16 *other)
+{
+    return 8;
+}
+
+// LD IXH,IXL
+int z80_op_ld_ixh_ixl(REG8 reg, REG16 *other)
+{
+    other->bytes.high = other->bytes.low;
+    return 8;
+}
+
+// LD IXL,r
+int z80_op_ld_ixl_r(REG8 reg, REG16 *other)
+{
+    other->bytes.low = *z80_all8[reg.byte_value & 0x07];
+    return 8;
+}
+
+// LD IXL,IXH
+int z80_op_ld_ixl_ixh(REG8 reg, REG16 *other)
+{
+    other->bytes.low = other->bytes.high;
+    return 8;
+}
+
+// LD IXL,IXL
+int z80_op_ld_ixl_ixl(REG8 reg, REG16 *other)
+{
+    return 8;
+}
+
+// LD (IX+d),r
+int z80_op_ld_at_ix_r(REG8 reg, REG16 *other)
+{
+    memory_write8_indexed(*other, z80_next8(), *z80_all8[reg.byte_value & 0x07]);
+    return 19;
+}
+
+// ADD A,IXH
+int z80_op_add_a_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_add(other->bytes.high);
+    return 8;
+}
+
+// ADD A,IXL
+int z80_op_add_a_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_add(other->bytes.low);
+    return 8;
+}
+
+// ADD A,(IX+d)
+int z80_op_add_a_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_add(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// ADC A,IXH
+int z80_op_adc_a_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_adc(other->bytes.high);
+    return 8;
+}
+
+// ADC A,IXL
+int z80_op_adc_a_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_adc(other->bytes.low);
+    return 8;
+}
+
+// ADC A,(IX+d)
+int z80_op_adc_a_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_adc(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// SUB A,IXH
+int z80_op_sub_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_sub(other->bytes.high);
+    return 8;
+}
+
+// SUB A,IXL
+int z80_op_sub_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_sub(other->bytes.low);
+    return 8;
+}
+
+// SUB (IX+d)
+int z80_op_sub_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_sub(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// SBC A,IXH
+int z80_op_sbc_a_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_sbc(other->bytes.high);
+    return 8;
+}
+
+// SBC A,IXL
+int z80_op_sbc_a_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_sbc(other->bytes.low);
+    return 8;
+}
+
+// SBC (IX+d)
+int z80_op_sbc_a_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_sbc(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// AND IXH
+int z80_op_and_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_and(other->bytes.high);
+    return 8;
+}
+
+// AND IXL
+int z80_op_and_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_and(other->bytes.low);
+    return 8;
+}
+
+// AND (IX+d)
+int z80_op_and_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_and(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// XOR IXH
+int z80_op_xor_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_xor(other->bytes.high);
+    return 8;
+}
+
+// XOR IXL
+int z80_op_xor_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_xor(other->bytes.low);
+    return 8;
+}
+
+// XOR (IX+d)
+int z80_op_xor_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_xor(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// OR IXH
+int z80_op_or_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_or(other->bytes.high);
+    return 8;
+}
+
+// OR IXL
+int z80_op_or_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_or(other->bytes.low);
+    return 8;
+}
+
+// OR (IX+d)
+int z80_op_or_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_or(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// CP IXH
+int z80_op_cp_ixh(REG8 reg, REG16 *other)
+{
+    z80_alu_cp(other->bytes.high);
+    return 8;
+}
+
+// CP IXL
+int z80_op_cp_ixl(REG8 reg, REG16 *other)
+{
+    z80_alu_cp(other->bytes.low);
+    return 8;
+}
+
+// CP (IX+d)
+int z80_op_cp_at_ix(REG8 reg, REG16 *other)
+{
+    z80_alu_cp(memory_read8_indexed(*other, z80_next8()));
+    return 19;
+}
+
+// POP IX
+int z80_op_pop_ix(REG8 reg, REG16 *other)
+{
+    *other = z80_pop16();
+    return 14;
+}
+
+// EX (SP),IX
+int z80_op_ex_sp_ix(REG8 reg, REG16 *other)
+{
+    memory_exchange16(z80_reg_sp, other);
+    return 23;
+}
+
+// PUSH IX
+int z80_op_push_ix(REG8 reg, REG16 *other)
+{
+    z80_push16(*other);
+    return 15;
+}
+
+// JP (IX)
+int z80_op_jp_ix(REG8 reg, REG16 *other)
+{
+    z80_reg_pc = *other;
+    return 8;
+}
+
+// LD SP,IX
+int z80_op_ld_sp_ix(REG8 reg, REG16 *other)
+{
+    z80_reg_sp = *other;
+    return 10;
+}
+
+int z80_op_index_cb_fail(REG8 reg, REG8 *alt)
+{
+    return 0; // fail
+}
+
+// RLC (IX+d)
+int z80_op_rlc_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rlc(alt);
+    return 23;
+}
+
+// LD r,RLC (IX+d)
+int z80_op_ld_r_rlc_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rlc(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// RRC (IX+d)
+int z80_op_rrc_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rrc(alt);
+    return 23;
+}
+
+// LD r,RRC (IX+d)
+int z80_op_ld_r_rrc_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rrc(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// RL (IX+d)
+int z80_op_rl_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rl(alt);
+    return 23;
+}
+
+// LD r,RL (IX+d)
+int z80_op_ld_r_rl_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rl(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// RR (IX+d)
+int z80_op_rr_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rr(alt);
+    return 23;
+}
+
+// LD r,RR (IX+d)
+int z80_op_ld_r_rr_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_rr(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// SLA (IX+d)
+int z80_op_sla_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sla(alt);
+    return 23;
+}
+
+// LD r,SLA (IX+d)
+int z80_op_ld_r_sla_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sla(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// SRA (IX+d)
+int z80_op_sra_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sra(alt);
+    return 23;
+}
+
+// LD r,SRA (IX+d)
+int z80_op_ld_r_sra_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sra(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// SLL (IX+d)
+int z80_op_sll_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sll(alt);
+    return 23;
+}
+
+// LD r,SLL (IX+d)
+int z80_op_ld_r_sll_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_sll(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// SRL (IX+d)
+int z80_op_srl_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_srl(alt);
+    return 23;
+}
+
+// LD r,SRL (IX+d)
+int z80_op_ld_r_srl_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_srl(alt);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// BIT b,(IX+d)
+int z80_op_bit_at_ix(REG8 reg, REG8 *alt)
+{
+    z80_alu_bit(reg, *alt);
+    return 20;
+}
+
+// RES b,(IX+d)
+int z80_op_res_at_ix(REG8 reg, REG8 *alt)
+{
+    register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), false);
+    return 23;
+}
+
+// LD r,RES b,(IX+d)
+int z80_op_ld_r_res_at_ix(REG8 reg, REG8 *alt)
+{
+    register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), false);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+// SET b,(IX+d)
+int z80_op_set_at_ix(REG8 reg, REG8 *alt)
+{
+    register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), true);
+    return 23;
+}
+
+// LD r,SET b,(IX+d)
+int z80_op_ld_r_set_at_ix(REG8 reg, REG8 *alt)
+{
+    register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), true);
+    *z80_all8[reg.byte_value & 0x07] = *alt;
+    return 23;
+}
+
+Z80OP_INDEX_CB z80_ops_dd_fd_cb[MAX8] = {
+    /* 0x00 */ z80_op_ld_r_rlc_at_ix, z80_op_ld_r_rlc_at_ix, z80_op_ld_r_rlc_at_ix, z80_op_ld_r_rlc_at_ix, z80_op_ld_r_rlc_at_ix, z80_op_ld_r_rlc_at_ix, z80_op_rlc_at_ix, z80_op_ld_r_rlc_at_ix,
+    /* 0x08 */ z80_op_ld_r_rrc_at_ix, z80_op_ld_r_rrc_at_ix, z80_op_ld_r_rrc_at_ix, z80_op_ld_r_rrc_at_ix, z80_op_ld_r_rrc_at_ix, z80_op_ld_r_rrc_at_ix, z80_op_rrc_at_ix, z80_op_ld_r_rrc_at_ix,
+    /* 0x10 */ z80_op_ld_r_rl_at_ix, z80_op_ld_r_rl_at_ix, z80_op_ld_r_rl_at_ix, z80_op_ld_r_rl_at_ix, z80_op_ld_r_rl_at_ix, z80_op_ld_r_rl_at_ix, z80_op_rl_at_ix, z80_op_ld_r_rl_at_ix,
+    /* 0x18 */ z80_op_ld_r_rr_at_ix, z80_op_ld_r_rr_at_ix, z80_op_ld_r_rr_at_ix, z80_op_ld_r_rr_at_ix, z80_op_ld_r_rr_at_ix, z80_op_ld_r_rr_at_ix, z80_op_rr_at_ix, z80_op_ld_r_rr_at_ix,
+    /* 0x20 */ z80_op_ld_r_sla_at_ix, z80_op_ld_r_sla_at_ix, z80_op_ld_r_sla_at_ix, z80_op_ld_r_sla_at_ix, z80_op_ld_r_sla_at_ix, z80_op_ld_r_sla_at_ix, z80_op_sla_at_ix, z80_op_ld_r_sla_at_ix,
+    /* 0x28 */ z80_op_ld_r_sra_at_ix, z80_op_ld_r_sra_at_ix, z80_op_ld_r_sra_at_ix, z80_op_ld_r_sra_at_ix, z80_op_ld_r_sra_at_ix, z80_op_ld_r_sra_at_ix, z80_op_sra_at_ix, z80_op_ld_r_sra_at_ix,
+    /* 0x30 */ z80_op_ld_r_sll_at_ix, z80_op_ld_r_sll_at_ix, z80_op_ld_r_sll_at_ix, z80_op_ld_r_sll_at_ix, z80_op_ld_r_sll_at_ix, z80_op_ld_r_sll_at_ix, z80_op_sll_at_ix, z80_op_ld_r_sll_at_ix,
+    /* 0x38 */ z80_op_ld_r_srl_at_ix, z80_op_ld_r_srl_at_ix, z80_op_ld_r_srl_at_ix, z80_op_ld_r_srl_at_ix, z80_op_ld_r_srl_at_ix, z80_op_ld_r_srl_at_ix, z80_op_srl_at_ix, z80_op_ld_r_srl_at_ix,
+    /* 0x40 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x48 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x50 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x58 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x60 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x68 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x70 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x78 */ z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_index_cb_fail, z80_op_bit_at_ix, z80_op_index_cb_fail,
+    /* 0x80 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0x88 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0x90 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0x98 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0xA0 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0xA8 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0xB0 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0xB8 */ z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_ld_r_res_at_ix, z80_op_res_at_ix, z80_op_ld_r_res_at_ix,
+    /* 0xC0 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xC8 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xD0 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xD8 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xE0 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xE8 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xF0 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix,
+    /* 0xF8 */ z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_ld_r_set_at_ix, z80_op_set_at_ix, z80_op_ld_r_set_at_ix};
+
+// DDCB
+int z80_op_prefix_index_cb(REG8 reg, REG16 *other)
+{
+    REG8 *alt = memory_ref8_indexed(*other, z80_next8());
+    reg = z80_next8();
+    return z80_ops_dd_fd_cb[reg.byte_value](reg, alt);
+}
+
+int z80_op_prefix_index(REG8 reg, REG16 *other);
+
+Z80OP_INDEX z80_ops_dd_fd[MAX8] = {
+    /* 0x00 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0x08 */ z80_op_index_simple, z80_op_add_ix_pp, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0x10 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0x18 */ z80_op_index_simple, z80_op_add_ix_pp, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0x20 */ z80_op_index_simple, z80_op_ld_ix_nn, z80_op_ld_at_nn_ix, z80_op_inc_ix, z80_op_inc_ixh, z80_op_dec_ixh, z80_op_ld_ixh_n, z80_op_index_simple,
+    /* 0x28 */ z80_op_index_simple, z80_op_add_ix_ix, z80_op_ld_ix_at_nn, z80_op_dec_ix, z80_op_inc_ixl, z80_op_dec_ixl, z80_op_ld_ixl_n, z80_op_index_simple,
+    /* 0x30 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_inc_at_ix, z80_op_dec_at_ix, z80_op_ld_at_ix_n, z80_op_index_simple,
+    /* 0x38 */ z80_op_index_simple, z80_op_add_ix_pp, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0x40 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_ld_r_ixh, z80_op_ld_r_ixl, z80_op_ld_r_at_ix, z80_op_index_simple,
+    /* 0x48 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_ld_r_ixh, z80_op_ld_r_ixl, z80_op_ld_r_at_ix, z80_op_index_simple,
+    /* 0x50 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_ld_r_ixh, z80_op_ld_r_ixl, z80_op_ld_r_at_ix, z80_op_index_simple,
+    /* 0x58 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_ld_r_ixh, z80_op_ld_r_ixl, z80_op_ld_r_at_ix, z80_op_index_simple,
+    /* 0x60 */ z80_op_ld_ixh_r, z80_op_ld_ixh_r, z80_op_ld_ixh_r, z80_op_ld_ixh_r, z80_op_ld_ixh_ixh, z80_op_ld_ixh_ixl, z80_op_ld_r_at_ix, z80_op_ld_ixh_r,
+    /* 0x68 */ z80_op_ld_ixl_r, z80_op_ld_ixl_r, z80_op_ld_ixl_r, z80_op_ld_ixl_r, z80_op_ld_ixl_ixh, z80_op_ld_ixl_ixl, z80_op_ld_r_at_ix, z80_op_ld_ixl_r,
+    /* 0x70 */ z80_op_ld_at_ix_r, z80_op_ld_at_ix_r, z80_op_ld_at_ix_r, z80_op_ld_at_ix_r, z80_op_ld_at_ix_r, z80_op_ld_at_ix_r, z80_op_index_simple, z80_op_ld_at_ix_r,
+    /* 0x78 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_ld_r_ixh, z80_op_ld_r_ixl, z80_op_ld_r_at_ix, z80_op_index_simple,
+    /* 0x80 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_add_a_ixh, z80_op_add_a_ixl, z80_op_add_a_at_ix, z80_op_index_simple,
+    /* 0x88 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_adc_a_ixh, z80_op_adc_a_ixl, z80_op_adc_a_at_ix, z80_op_index_simple,
+    /* 0x90 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_sub_ixh, z80_op_sub_ixl, z80_op_sub_at_ix, z80_op_index_simple,
+    /* 0x98 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_sbc_a_ixh, z80_op_sbc_a_ixl, z80_op_sbc_a_at_ix, z80_op_index_simple,
+    /* 0xA0 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_and_ixh, z80_op_and_ixl, z80_op_and_at_ix, z80_op_index_simple,
+    /* 0xA8 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_xor_ixh, z80_op_xor_ixl, z80_op_xor_at_ix, z80_op_index_simple,
+    /* 0xB0 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_or_ixh, z80_op_or_ixl, z80_op_or_at_ix, z80_op_index_simple,
+    /* 0xB8 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_cp_ixh, z80_op_cp_ixl, z80_op_cp_at_ix, z80_op_index_simple,
+    /* 0xC0 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0xC8 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_prefix_index_cb, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0xD0 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0xD8 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_prefix_index, z80_op_index_simple, z80_op_index_simple,
+    /* 0xE0 */ z80_op_index_simple, z80_op_pop_ix, z80_op_index_simple, z80_op_ex_sp_ix, z80_op_index_simple, z80_op_push_ix, z80_op_index_simple, z80_op_index_simple,
+    /* 0xE8 */ z80_op_index_simple, z80_op_jp_ix, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_fail, z80_op_index_simple, z80_op_index_simple,
+    /* 0xF0 */ z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple,
+    /* 0xF8 */ z80_op_index_simple, z80_op_ld_sp_ix, z80_op_index_simple, z80_op_index_simple, z80_op_index_simple, z80_op_prefix_index, z80_op_index_simple, z80_op_index_simple};
+
+int z80_execute_dd_fd(REG8 reg, REG16 *other)
+{
+    return Z80_STATS(STATS_DD_FD, reg, z80_ops_dd_fd[reg.byte_value](reg, other));
+}
+
+// DD & FD
+int z80_op_prefix_index(REG8 reg, REG16 *other)
+{
+    return z80_execute_dd_fd(z80_fetch_opcode(), other);
+}
+
+// ---unprefixed-----------------------------------------
+
+// NOP
+int z80_op_nop(REG8 reg)
+{
+    return 4;
+}
+
+// LD dd,nn
+int z80_op_ld_dd_nn(REG8 reg)
+{
+    *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03] = z80_next16();
+    return 10;
+}
+
+// LD (BC),A
+int z80_op_ld_at_bc_a(REG8 reg)
+{
+    memory_write8(z80_reg_bc, z80_reg_af.bytes.high);
+    return 7;
+}
+
+// INC ss
+int z80_op_inc_ss(REG8 reg)
+{
+    register_add16_with_flags(z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], REG16_ONE, MASK_NONE);
+    return 6;
+}
+
+// INC r
+#define Z80_OP_INC_R(r, alt) \
+    int z80_op_inc_##r(REG8 reg) \
+    { \
+        register_inc8_with_flags(&alt); \
+        return 4; \
+    }
+Z80_REGISTERS(Z80_OP_INC_R)
+
+// INC (HL)
+int z80_op_inc_at_hl(REG8 reg)
+{
+    register_inc8_with_flags(memory_ref8(z80_reg_hl));
+    return 11;
+}
+
+// DEC r
+#define Z80_OP_DEC_R(r, alt) \
+    int z80_op_dec_##r(REG8 reg) \
+    { \
+        register_dec8_with_flags(&alt); \
+        return 4; \
+    }
+Z80_REGISTERS(Z80_OP_DEC_R)
+
+// DEC (HL)
+int z80_op_dec_at_hl(REG8 reg)
+{
+    register_dec8_with_flags(memory_ref8(z80_reg_hl));
+    return 11;
+}
+
+// LD r,n
+#define Z80_OP_LD_R_N(r, alt) \
+    int z80_op_ld_##r##_n(REG8 reg) \
+    { \
+        alt = z80_next8(); \
+        return 7; \
+    }
+Z80_REGISTERS(Z80_OP_LD_R_N)
+
+// LD (HL),n
+int z80_op_ld_at_hl_n(REG8 reg)
+{
+    memory_write8(z80_reg_hl, z80_next8());
+    return 10;
+}
+
+// RLCA
+int z80_op_rlca(REG8 reg)
+{
+    register_left8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_bit(z80_reg_af.bytes.high, MAX7));
+    return 4;
+}
+
+// EX AF,AF’
+int z80_op_ex_af_af(REG8 reg)
+{
+    register_flags_materialize();
+    register_exchange16(&z80_reg_af, &z80_reg_af_2);
+    return 4;
+}
+
+// ADD HL,ss
+int z80_op_add_hl_ss(REG8 reg)
+{
+    register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], MASK_HNC);
+    return 11;
+}
+
+// LD A,(BC)
+int z80_op_ld_a_at_bc(REG8 reg)
+{
+    z80_reg_af.bytes.high = memory_read8(z80_reg_bc);
+    return 7;
+}
+
+// DEC ss
+int z80_op_dec_ss(REG8 reg)
+{
+    register_sub16_with_flags(z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], REG16_ONE, MASK_NONE);
+    return 6;
+}
+
+// RRCA
+int z80_op_rrca(REG8 reg)
+{
+    register_right8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_bit(z80_reg_af.bytes.high, MAX0));
+    return 4;
+}
+
+// DJNZ $ counts B down in place for every iteration that starts before the next task is due
+int z80_djnz_self()
+{
+    int b = z80_reg_bc.bytes.high.byte_value;
+    unsigned long long n = (z80_deadline > z80_t_states_all ? (z80_deadline - z80_t_states_all - 1) / 13 : 0);
+    if (n >= b)
+    {
+        z80_reg_bc.bytes.high.byte_value = 0;
+        z80_reg_pc.byte_value += 2;
+        z80_memory_refresh_by(b);
+        z80_instructions += b;
+        return 13 * b + 8;
+    }
+    else
+    {
+        z80_reg_bc.bytes.high.byte_value -= n;
+        z80_memory_refresh_by(n);
+        z80_instructions += n;
+        return 13 * (n + 1);
+    }
+}
+
+// DJNZ e
+int z80_op_djnz(REG8 reg)
+{
+    REG8 alt = z80_next8();
+    z80_reg_bc.bytes.high.byte_value--;
+    if (register_is_zero(z80_reg_bc.bytes.high))
+    {
+        return 8;
+    }
+    else
+    {
+        z80_reg_pc.byte_value += alt.value;
+        return alt.value == -2 ? z80_djnz_self() : 13;
+    }
+}
+
+// LD (DE),A
+int z80_op_ld_at_de_a(REG8 reg)
+{
+    memory_write8(z80_reg_de, z80_reg_af.bytes.high);
+    return 7;
+}
+
+// RLA
+int z80_op_rla(REG8 reg)
+{
+    register_left8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_flag(FLAG_C));
+    return 4;
+}
+
+// JR e
+int z80_op_jr(REG8 reg)
+{
+    return z80_jump_rel_with_condition(true);
+}
+
+// LD A,(DE)
+int z80_op_ld_a_at_de(REG8 reg)
+{
+    z80_reg_af.bytes.high = memory_read8(z80_reg_de);
+    return 7;
+}
+
+// RRA
+int z80_op_rra(REG8 reg)
+{
+    register_right8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_flag(FLAG_C));
+    return 4;
+}
+
+// JR NZ,e
+int z80_op_jr_nz(REG8 reg)
+{
+    return z80_jump_rel_with_condition(!register_is_flag(FLAG_Z));
+}
+
+// JR Z,e
+int z80_op_jr_z(REG8 reg)
+{
+    return z80_jump_rel_with_condition(register_is_flag(FLAG_Z));
+}
+
+// JR NC,e
+int z80_op_jr_nc(REG8 reg)
+{
+    return z80_jump_rel_with_condition(!register_is_flag(FLAG_C));
+}
+
+// JR C,e
+int z80_op_jr_c(REG8 reg)
+{
+    return z80_jump_rel_with_condition(register_is_flag(FLAG_C));
+}
+
+// LD (nn),HL
+int z80_op_ld_at_nn_hl(REG8 reg)
+{
+    memory_write16(z80_next16(), z80_reg_hl);
+    return 16;
+}
+
+// DAA
+int z80_op_daa(REG8 reg)
+{
+    register_daa_with_flags(&z80_reg_af.bytes.high);
+    return 4;
+}
+
+// LD HL,(nn)
+int z80_op_ld_hl_at_nn(REG8 reg)
+{
+    z80_reg_hl = memory_read16(z80_next16());
+    return 16;
+}
+
+// CPL
+int z80_op_cpl(REG8 reg)
+{
+    z80_reg_af.bytes.high.byte_value = ~z80_reg_af.bytes.high.byte_value;
+    register_set_or_unset_flag(FLAG_N | FLAG_HC, true);
+    return 4;
+}
+
+// LD (nn),A
+int z80_op_ld_at_nn_a(REG8 reg)
+{
+    memory_write8(z80_next16(), z80_reg_af.bytes.high);
+    return 13;
+}
+
+// SCF
+int z80_op_scf(REG8 reg)
+{
+    register_set_or_unset_flag(FLAG_C, true);
+    register_set_or_unset_flag(FLAG_N | FLAG_HC, false);
+    return 4;
+}
+
+// LD A,(nn)
+int z80_op_ld_a_at_nn(REG8 reg)
+{
+    z80_reg_af.bytes.high = memory_read8(z80_next16());
+    return 13;
+}
+
+// CCF
+int z80_op_ccf(REG8 reg)
+{
+    bool c = register_is_flag(FLAG_C);
+    register_set_or_unset_flag(FLAG_HC, c);
+    register_set_or_unset_flag(FLAG_C, !c);
+    register_set_or_unset_flag(FLAG_N, false);
+    return 4;
+}
+
+// LD r,s
+#define Z80_OP_LD_R_S(s, alt_s, r, alt_r) \
+    int z80_op_ld_##r##_##s(REG8 reg) \
+    { \
+        alt_r = alt_s; \
+        return 4; \
+    }
+#define Z80_OP_LD_R(r, alt) Z80_REGISTERS_SOURCE(Z80_OP_LD_R_S, r, alt)
+Z80_REGISTERS(Z80_OP_LD_R)
+
+// LD r,(HL)
+#define Z80_OP_LD_R_AT_HL(r, alt) \
+    int z80_op_ld_##r##_at_hl(REG8 reg) \
+    { \
+        alt = memory_read8(z80_reg_hl); \
+        return 7; \
+    }
+Z80_REGISTERS(Z80_OP_LD_R_AT_HL)
+
+// LD (HL),r
+#define Z80_OP_LD_AT_HL_R(r, alt) \
+    int z80_op_ld_at_hl_##r(REG8 reg) \
+    { \
+        memory_write8(z80_reg_hl, alt); \
+        return 7; \
+    }
+Z80_REGISTERS(Z80_OP_LD_AT_HL_R)
+
+// HALT
+int z80_op_halt(REG8 reg)
+{
+    z80_halt = true;
+    return 4;
+}
+
+// ADD A,r
+#define Z80_OP_ALU_R(r, alt, name, alu) \
+    int z80_op_##name##_##r(REG8 reg) \
+    { \
+        z80_alu_##alu(alt); \
+        return 4; \
+    }
+Z80_REGISTERS(Z80_OP_ALU_R, add_a, add)
+
+// ADD A,(HL)
+int z80_op_add_a_at_hl(REG8 reg)
+{
+    z80_alu_add(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// ADC A,r
+Z80_REGISTERS(Z80_OP_ALU_R, adc_a, adc)
+
+// ADC A,(HL)
+int z80_op_adc_a_at_hl(REG8 reg)
+{
+    z80_alu_adc(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// SUB A,r
+Z80_REGISTERS(Z80_OP_ALU_R, sub, sub)
+
+// SUB A,(HL)
+int z80_op_sub_at_hl(REG8 reg)
+{
+    z80_alu_sub(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// SBC A,r
+Z80_REGISTERS(Z80_OP_ALU_R, sbc_a, sbc)
+
+// SBC A,(HL)
+int z80_op_sbc_a_at_hl(REG8 reg)
+{
+    z80_alu_sbc(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// AND r
+Z80_REGISTERS(Z80_OP_ALU_R, and, and)
+
+// AND (HL)
+int z80_op_and_at_hl(REG8 reg)
+{
+    z80_alu_and(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// XOR r
+Z80_REGISTERS(Z80_OP_ALU_R, xor, xor)
+
+// XOR (HL)
+int z80_op_xor_at_hl(REG8 reg)
+{
+    z80_alu_xor(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// OR r
+Z80_REGISTERS(Z80_OP_ALU_R, or, or)
+
+// OR (HL)
+int z80_op_or_at_hl(REG8 reg)
+{
+    z80_alu_or(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// CP r
+Z80_REGISTERS(Z80_OP_ALU_R, cp, cp)
+
+// CP (HL)
+int z80_op_cp_at_hl(REG8 reg)
+{
+    z80_alu_cp(memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// RET CC
+int z80_op_ret_cc(REG8 reg)
+{
+    return z80_ret_with_condition(z80_decode_condition(reg));
+}
+
+// POP qq
+int z80_op_pop_qq(REG8 reg)
+{
+    register_flags_materialize();
+    *z80_bc_de_hl_af[reg.byte_value >> 4 & 0x03] = z80_pop16();
+    return 10;
+}
+
+// JP CC,nn
+int z80_op_jp_cc(REG8 reg)
+{
+    return z80_jump_with_condition(z80_decode_condition(reg));
+}
+
+// JP nn
+int z80_op_jp(REG8 reg)
+{
+    return z80_jump_with_condition(true);
+}
+
+// CALL CC,nn
+int z80_op_call_cc(REG8 reg)
+{
+    return z80_call_with_condition(z80_decode_condition(reg));
+}
+
+// PUSH qq
+int z80_op_push_qq(REG8 reg)
+{
+    register_flags_materialize();
+    z80_push16(*z80_bc_de_hl_af[reg.byte_value >> 4 & 0x03]);
+    return 11;
+}
+
+// ADD A,n
+int z80_op_add_a_n(REG8 reg)
+{
+    z80_alu_add(z80_next8());
+    return 7;
+}
+
+// RST p
+int z80_op_rst(REG8 reg)
+{
+    z80_push_call((REG16){.byte_value = z80_reg_pc.byte_value - 1});
+    z80_reg_pc.value = z80_rst_addr[reg.byte_value >> 3 & 0x07];
+    return 11;
+}
+
+// RET
+int z80_op_ret(REG8 reg)
+{
+    z80_ret_with_condition(true);
+    return 10;
+}
+
+// CB
+int z80_op_prefix_cb(REG8 reg)
+{
+    return z80_execute_cb(z80_fetch_opcode());
+}
+
+// CALL nn
+int z80_op_call(REG8 reg)
+{
+    return z80_call_with_condition(true);
+}
+
+// ADC A,n
+int z80_op_adc_a_n(REG8 reg)
+{
+    z80_alu_adc(z80_next8());
+    return 7;
+}
+
+// OUT (n),A
+int z80_op_out_n_a(REG8 reg)
+{
+    port_write8((REG16){.bytes.high = z80_reg_af.bytes.high, .bytes.low = z80_next8()}, z80_reg_af.bytes.high);
+    return 11;
+}
+
+// SUB n
+int z80_op_sub_n(REG8 reg)
+{
+    z80_alu_sub(z80_next8());
+    return 7;
+}
+
+// EXX
+int z80_op_exx(REG8 reg)
+{
+    register_exchange16(&z80_reg_bc, &z80_reg_bc_2);
+    register_exchange16(&z80_reg_de, &z80_reg_de_2);
+    register_exchange16(&z80_reg_hl, &z80_reg_hl_2);
+    return 4;
+}
+
+// IN A,(n)
+int z80_op_in_a_n(REG8 reg)
+{
+    z80_reg_af.bytes.high = port_read8((REG16){.bytes.high = z80_reg_af.bytes.high, .bytes.low = z80_next8()});
+    return 11;
+}
+
+// DD
+int z80_op_prefix_dd(REG8 reg)
+{
+    return z80_execute_dd_fd(z80_fetch_opcode(), &z80_reg_ix);
+}
+
+// SBC A,n
+int z80_op_sbc_a_n(REG8 reg)
+{
+    z80_alu_sbc(z80_next8());
+    return 7;
+}
+
+// EX (SP),HL
+int z80_op_ex_sp_hl(REG8 reg)
+{
+    memory_exchange16(z80_reg_sp, &z80_reg_hl);
+    return 19;
+}
+
+// AND n
+int z80_op_and_n(REG8 reg)
+{
+    z80_alu_and(z80_next8());
+    return 7;
+}
+
+// JP HL
+int z80_op_jp_hl(REG8 reg)
+{
+    z80_reg_pc = z80_reg_hl;
+    return 4;
+}
+
+// EX DE,HL
+int z80_op_ex_de_hl(REG8 reg)
+{
+    register_exchange16(&z80_reg_de, &z80_reg_hl);
+    return 4;
+}
+
+// ED
+int z80_op_prefix_ed(REG8 reg)
+{
+    return z80_execute_ed(z80_fetch_opcode());
+}
+
+// XOR n
+int z80_op_xor_n(REG8 reg)
+{
+    z80_alu_xor(z80_next8());
+    return 7;
+}
+
+// DI
+int z80_op_di(REG8 reg)
+{
+    z80_iff1 = z80_iff2 = false;
+    return 4;
+}
+
+// OR n
+int z80_op_or_n(REG8 reg)
+{
+    z80_alu_or(z80_next8());
+    return 7;
+}
+
+// LD SP,HL
+int z80_op_ld_sp_hl(REG8 reg)
+{
+    z80_reg_sp = z80_reg_hl;
+    return 6;
+}
+
+// EI
+int z80_op_ei(REG8 reg)
+{
+    z80_iff1 = z80_iff2 = true;
+    return 4;
+}
+
+// FD
+int z80_op_prefix_fd(REG8 reg)
+{
+    return z80_execute_dd_fd(z80_fetch_opcode(), &z80_reg_iy);
+}
+
+// CP n
+int z80_op_cp_n(REG8 reg)
+{
+    z80_alu_cp(z80_next8());
+    return 7;
+}
+
+Z80OP z80_ops[MAX8] = {
+    /* 0x00 */ z80_op_nop, z80_op_ld_dd_nn, z80_op_ld_at_bc_a, z80_op_inc_ss, z80_op_inc_b, z80_op_dec_b, z80_op_ld_b_n, z80_op_rlca,
+    /* 0x08 */ z80_op_ex_af_af, z80_op_add_hl_ss, z80_op_ld_a_at_bc, z80_op_dec_ss, z80_op_inc_c, z80_op_dec_c, z80_op_ld_c_n, z80_op_rrca,
+    /* 0x10 */ z80_op_djnz, z80_op_ld_dd_nn, z80_op_ld_at_de_a, z80_op_inc_ss, z80_op_inc_d, z80_op_dec_d, z80_op_ld_d_n, z80_op_rla,
+    /* 0x18 */ z80_op_jr, z80_op_add_hl_ss, z80_op_ld_a_at_de, z80_op_dec_ss, z80_op_inc_e, z80_op_dec_e, z80_op_ld_e_n, z80_op_rra,
+    /* 0x20 */ z80_op_jr_nz, z80_op_ld_dd_nn, z80_op_ld_at_nn_hl, z80_op_inc_ss, z80_op_inc_h, z80_op_dec_h, z80_op_ld_h_n, z80_op_daa,
+    /* 0x28 */ z80_op_jr_z, z80_op_add_hl_ss, z80_op_ld_hl_at_nn, z80_op_dec_ss, z80_op_inc_l, z80_op_dec_l, z80_op_ld_l_n, z80_op_cpl,
+    /* 0x30 */ z80_op_jr_nc, z80_op_ld_dd_nn, z80_op_ld_at_nn_a, z80_op_inc_ss, z80_op_inc_at_hl, z80_op_dec_at_hl, z80_op_ld_at_hl_n, z80_op_scf,
+    /* 0x38 */ z80_op_jr_c, z80_op_add_hl_ss, z80_op_ld_a_at_nn, z80_op_dec_ss, z80_op_inc_a, z80_op_dec_a, z80_op_ld_a_n, z80_op_ccf,
+    /* 0x40 */ Z80_ROW(ld_b, z80_op_ld_b_at_hl),
+    /* 0x48 */ Z80_ROW(ld_c, z80_op_ld_c_at_hl),
+    /* 0x50 */ Z80_ROW(ld_d, z80_op_ld_d_at_hl),
+    /* 0x58 */ Z80_ROW(ld_e, z80_op_ld_e_at_hl),
+    /* 0x60 */ Z80_ROW(ld_h, z80_op_ld_h_at_hl),
+    /* 0x68 */ Z80_ROW(ld_l, z80_op_ld_l_at_hl),
+    /* 0x70 */ Z80_ROW(ld_at_hl, z80_op_halt),
+    /* 0x78 */ Z80_ROW(ld_a, z80_op_ld_a_at_hl),
+    /* 0x80 */ Z80_ROW(add_a, z80_op_add_a_at_hl),
+    /* 0x88 */ Z80_ROW(adc_a, z80_op_adc_a_at_hl),
+    /* 0x90 */ Z80_ROW(sub, z80_op_sub_at_hl),
+    /* 0x98 */ Z80_ROW(sbc_a, z80_op_sbc_a_at_hl),
+    /* 0xA0 */ Z80_ROW(and, z80_op_and_at_hl),
+    /* 0xA8 */ Z80_ROW(xor, z80_op_xor_at_hl),
+    /* 0xB0 */ Z80_ROW(or, z80_op_or_at_hl),
+    /* 0xB8 */ Z80_ROW(cp, z80_op_cp_at_hl),
+    /* 0xC0 */ z80_op_ret_cc, z80_op_pop_qq, z80_op_jp_cc, z80_op_jp, z80_op_call_cc, z80_op_push_qq, z80_op_add_a_n, z80_op_rst,
+    /* 0xC8 */ z80_op_ret_cc, z80_op_ret, z80_op_jp_cc, z80_op_prefix_cb, z80_op_call_cc, z80_op_call, z80_op_adc_a_n, z80_op_rst,
+    /* 0xD0 */ z80_op_ret_cc, z80_op_pop_qq, z80_op_jp_cc, z80_op_out_n_a, z80_op_call_cc, z80_op_push_qq, z80_op_sub_n, z80_op_rst,
+    /* 0xD8 */ z80_op_ret_cc, z80_op_exx, z80_op_jp_cc, z80_op_in_a_n, z80_op_call_cc, z80_op_prefix_dd, z80_op_sbc_a_n, z80_op_rst,
+    /* 0xE0 */ z80_op_ret_cc, z80_op_pop_qq, z80_op_jp_cc, z80_op_ex_sp_hl, z80_op_call_cc, z80_op_push_qq, z80_op_and_n, z80_op_rst,
+    /* 0xE8 */ z80_op_ret_cc, z80_op_jp_hl, z80_op_jp_cc, z80_op_ex_de_hl, z80_op_call_cc, z80_op_prefix_ed, z80_op_xor_n, z80_op_rst,
+    /* 0xF0 */ z80_op_ret_cc, z80_op_pop_qq, z80_op_jp_cc, z80_op_di, z80_op_call_cc, z80_op_push_qq, z80_op_or_n, z80_op_rst,
+    /* 0xF8 */ z80_op_ret_cc, z80_op_ld_sp_hl, z80_op_jp_cc, z80_op_ei, z80_op_call_cc, z80_op_prefix_fd, z80_op_cp_n, z80_op_rst};
+
+int z80_execute_simple(REG8 reg)
+{
+    return Z80_STATS(STATS_NONE, reg, z80_ops[reg.byte_value](reg));
+}
+
+int z80_execute(REG8 reg)
+{
+    if (z80_halt)
+    {
+        reg.byte_value = 0x00;
+        z80_reg_pc.byte_value--;
+    }
+    return z80_execute_simple(reg);
+}
+
+// z80_instructions counts the retired instructions, a prefixed one counts once and the NOPs of a halted CPU not at all
+int z80_execute_next()
+{
+    z80_instructions += !z80_halt;
+    return z80_execute(z80_fetch_opcode());
+}
+
+// instruction length, 0 for CB/DD/ED/FD which are decoded in z80_instruction_length
+unsigned char z80_lengths[MAX8] = {
+    /* 0x00 */ 1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    /* 0x10 */ 2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    /* 0x20 */ 2, 3, 3, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    /* 0x30 */ 2, 3, 3, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    /* 0x40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x80 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x90 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0xA0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0xB0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0xC0 */ 1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 0, 3, 3, 2, 1,
+    /* 0xD0 */ 1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 0, 2, 1,
+    /* 0xE0 */ 1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 0, 2, 1,
+    /* 0xF0 */ 1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 0, 2, 1};
+
+// (HL) operands become (IX+d) and take a displacement byte
+bool z80_is_indexed(REG8 reg)
+{
+    int i = reg.byte_value;
+    return i != 0x76 && ((i >= 0x34 && i <= 0x36) || (i & 0xC7) == 0x46 || (i & 0xF8) == 0x70 || (i & 0xC7) == 0x86);
+}
+
+int z80_instruction_length(REG16 reg)
+{
+    REG8 op = memory_read8(reg);
+    reg.byte_value++;
+    REG8 alt = memory_read8(reg);
+    switch (op.byte_value)
+    {
+    case 0xCB:
+        return 2;
+    case 0xED:
+        return (alt.byte_value & 0xC7) == 0x43 ? 4 : 2;
+    case 0xDD:
+    case 0xFD:
+        if (alt.byte_value == 0xCB)
+        {
+            return 4;
+        }
+        else if (z80_lengths[alt.byte_value] == 0)
+        {
+            return 0; // fail
+        }
+        else
+        {
+            return 1 + z80_lengths[alt.byte_value] + z80_is_indexed(alt);
+        }
+    default:
+        return z80_lengths[op.byte_value];
+    }
+}
+
+// jumps, calls, returns, HALT, EI/DI and repeating block instructions end a basic block
+bool z80_ends_block(REG16 reg)
+{
+    REG8 op = memory_read8(reg);
+    reg.byte_value++;
+    REG8 alt = memory_read8(reg);
+    switch (op.byte_value)
+    {
+    case 0x10:
+    case 0x18:
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+    case 0x76:
+    case 0xC3:
+    case 0xC9:
+    case 0xCD:
+    case 0xE9:
+    case 0xF3:
+    case 0xFB:
+        return true;
+    case 0xED:
+        return (alt.byte_value & 0xC7) == 0x45 || alt.byte_value >= 0xB0;
+    case 0xDD:
+    case 0xFD:
+        return alt.byte_value == 0xE9 || z80_ends_block(reg);
+    default:
+        return (op.byte_value & 0xC0) == 0xC0 && ((op.byte_value & 0x07) == 0x00 || (op.byte_value & 0x07) == 0x02 ||
+                                                   (op.byte_value & 0x07) == 0x04 || (op.byte_value & 0x07) == 0x07);
+    }
+}
+
+void z80_get_state(Z80STATE *state)
+{
+    register_flags_materialize();
+    memset(state, 0, sizeof(Z80STATE));
+    state->bc = z80_reg_bc;
+    state->de = z80_reg_de;
+    state->hl = z80_reg_hl;
+    state->af = z80_reg_af;
+    state->pc = z80_reg_pc;
+    state->sp = z80_reg_sp;
+    state->ix = z80_reg_ix;
+    state->iy = z80_reg_iy;
+    state->bc_2 = z80_reg_bc_2;
+    state->de_2 = z80_reg_de_2;
+    state->hl_2 = z80_reg_hl_2;
+    state->af_2 = z80_reg_af_2;
+    state->i = z80_reg_i;
+    state->r = z80_reg_r;
+    state->iff1 = z80_iff1;
+    state->iff2 = z80_iff2;
+    state->halt = z80_halt;
+    state->imode = z80_imode;
+}
+
+void z80_set_state(const Z80STATE *state)
+{
+    register_lazy_op = LAZY_NONE;
+    z80_reg_bc = state->bc;
+    z80_reg_de = state->de;
+    z80_reg_hl = state->hl;
+    z80_reg_af = state->af;
+    z80_reg_pc = state->pc;
+    z80_reg_sp = state->sp;
+    z80_reg_ix = state->ix;
+    z80_reg_iy = state->iy;
+    z80_reg_bc_2 = state->bc_2;
+    z80_reg_de_2 = state->de_2;
+    z80_reg_hl_2 = state->hl_2;
+    z80_reg_af_2 = state->af_2;
+    z80_reg_i = state->i;
+    z80_reg_r = state->r;
+    z80_iff1 = state->iff1;
+    z80_iff2 = state->iff2;
+    z80_halt = state->halt;
+    z80_imode = state->imode;
+}
+
+// ---CACHED---------------------------------------------
+
+// the cached handlers take their operands from the decoded entry instead of fetching and decoding them,
+// the other instructions go through the handler tables like in the interpreter
+void z80_cached_fetch(int length)
+{
+    z80_memory_refresh();
+    z80_reg_pc.byte_value += length;
+}
+
+int z80_cached_uncached(Z80DECODED *decoded)
+{
+    return z80_execute(z80_fetch_opcode());
+}
+
+int z80_cached_op(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    return z80_ops[decoded->op.byte_value](decoded->op);
+}
+
+// CB and ED prefixed instructions, and the DD and FD ones that ignore the prefix
+int z80_cached_op_cb(Z80DECODED *decoded)
+{
+    z80_memory_refresh_by(2);
+    z80_reg_pc.byte_value += 2;
+    return z80_ops_cb[decoded->op.byte_value](decoded->op);
+}
+
+int z80_cached_op_ed(Z80DECODED *decoded)
+{
+    z80_memory_refresh_by(2);
+    z80_reg_pc.byte_value += 2;
+    return z80_ops_ed[decoded->op.byte_value](decoded->op);
+}
+
+int z80_cached_op_prefixed(Z80DECODED *decoded)
+{
+    z80_memory_refresh_by(2);
+    z80_reg_pc.byte_value += 2;
+    return z80_ops[decoded->op.byte_value](decoded->op);
+}
+
+REG16 *z80_cached_index_register(Z80DECODED *decoded)
+{
+    return decoded->rr ? &z80_reg_iy : &z80_reg_ix;
+}
+
+int z80_cached_index(Z80DECODED *decoded)
+{
+    z80_memory_refresh_by(2);
+    z80_reg_pc.byte_value += 2;
+    return z80_ops_dd_fd[decoded->op.byte_value](decoded->op, z80_cached_index_register(decoded));
+}
+
+int z80_cached_index_cb(Z80DECODED *decoded)
+{
+    z80_memory_refresh_by(2);
+    z80_reg_pc.byte_value += 4;
+    return z80_ops_dd_fd_cb[decoded->op.byte_value](
+        decoded->op, memory_ref8_indexed(*z80_cached_index_register(decoded), decoded->d));
+}
+
+// LD r,r'
+int z80_cached_ld_r_r(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    *z80_all8[decoded->r] = *z80_all8[decoded->s];
+    return 4;
+}
+
+// LD r,n
+int z80_cached_ld_r_n(Z80DECODED *decoded)
+{
+    z80_cached_fetch(2);
+    *z80_all8[decoded->r] = decoded->n;
+    return 7;
+}
+
+// LD r,(HL)
+int z80_cached_ld_r_at_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    *z80_all8[decoded->r] = memory_read8(z80_reg_hl);
+    return 7;
+}
+
+// LD (HL),r
+int z80_cached_ld_at_hl_r(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    memory_write8(z80_reg_hl, *z80_all8[decoded->s]);
+    return 7;
+}
+
+// LD (HL),n
+int z80_cached_ld_at_hl_n(Z80DECODED *decoded)
+{
+    z80_cached_fetch(2);
+    memory_write8(z80_reg_hl, decoded->n);
+    return 10;
+}
+
+// LD A,(BC) and LD A,(DE)
+int z80_cached_ld_a_at_rr(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    z80_reg_af.bytes.high = memory_read8(*z80_bc_de_hl_sp[decoded->rr]);
+    return 7;
+}
+
+// LD (BC),A and LD (DE),A
+int z80_cached_ld_at_rr_a(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    memory_write8(*z80_bc_de_hl_sp[decoded->rr], z80_reg_af.bytes.high);
+    return 7;
+}
+
+// LD A,(nn)
+int z80_cached_ld_a_at_nn(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    z80_reg_af.bytes.high = memory_read8(decoded->nn);
+    return 13;
+}
+
+// LD (nn),A
+int z80_cached_ld_at_nn_a(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    memory_write8(decoded->nn, z80_reg_af.bytes.high);
+    return 13;
+}
+
+// LD HL,(nn)
+int z80_cached_ld_hl_at_nn(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    z80_reg_hl = memory_read16(decoded->nn);
+    return 16;
+}
+
+// LD (nn),HL
+int z80_cached_ld_at_nn_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    memory_write16(decoded->nn, z80_reg_hl);
+    return 16;
+}
+
+// LD dd,nn
+int z80_cached_ld_dd_nn(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    *z80_bc_de_hl_sp[decoded->rr] = decoded->nn;
+    return 10;
+}
+
+// INC r
+int z80_cached_inc_r(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_inc8_with_flags(z80_all8[decoded->r]);
+    return 4;
+}
+
+// DEC r
+int z80_cached_dec_r(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_dec8_with_flags(z80_all8[decoded->r]);
+    return 4;
+}
+
+// INC ss
+int z80_cached_inc_ss(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_add16_with_flags(z80_bc_de_hl_sp[decoded->rr], REG16_ONE, MASK_NONE);
+    return 6;
+}
+
+// DEC ss
+int z80_cached_dec_ss(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_sub16_with_flags(z80_bc_de_hl_sp[decoded->rr], REG16_ONE, MASK_NONE);
+    return 6;
+}
+
+// ADD HL,ss
+int z80_cached_add_hl_ss(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[decoded->rr], MASK_HNC);
+    return 11;
+}
+
+void (*z80_cached_alus[8])(REG8 alt) = {z80_alu_add, z80_alu_adc, z80_alu_sub, z80_alu_sbc,
+                                         z80_alu_and, z80_alu_xor, z80_alu_or, z80_alu_cp};
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR and CP with r
+int z80_cached_alu_r(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    z80_cached_alus[decoded->r](*z80_all8[decoded->s]);
+    return 4;
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR and CP with n
+int z80_cached_alu_n(Z80DECODED *decoded)
+{
+    z80_cached_fetch(2);
+    z80_cached_alus[decoded->r](decoded->n);
+    return 7;
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR and CP with (HL)
+int z80_cached_alu_at_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    z80_cached_alus[decoded->r](memory_read8(z80_reg_hl));
+    return 7;
+}
+
+// JR e
+int z80_cached_jr(Z80DECODED *decoded)
+{
+    z80_memory_refresh();
+    z80_reg_pc = decoded->nn;
+    return 12;
+}
+
+// JR cc,e, the condition is one of NZ, Z, NC and C like the first four of JP cc
+int z80_cached_jr_cc(Z80DECODED *decoded)
+{
+    z80_cached_fetch(2);
+    if (z80_decode_condition((REG8){.byte_value = decoded->op.byte_value & 0x18}))
     {
-    case 0x00: // NOP
-        return 4;
-    case 0x01: // LD dd,nn
-    case 0x11:
-    case 0x21:
-    case 0x31:
-        *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03] = z80_next16();
-        return 10;
-    case 0x02: // LD (BC),A
-        memory_write8(z80_reg_bc, z80_reg_af.bytes.high);
-        return 7;
-    case 0x03: // INC ss
-    case 0x13:
-    case 0x23:
-    case 0x33:
-        register_add16_with_flags(z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], REG16_ONE, MASK_NONE);
-        return 6;
-    case 0x04: // INC r
-    case 0x0C:
-    case 0x14:
-    case 0x1C:
-    case 0x24:
-    case 0x2C:
-    case 0x34:
-    case 0x3C:
-        register_add8_with_flags(z80_decode_reg8(reg, 3, &hl), REG8_ONE, MASK_SZHVN);
-        return hl ? 11 : 4;
-    case 0x05: // DEC r
-    case 0x0D:
-    case 0x15:
-    case 0x1D:
-    case 0x25:
-    case 0x2D:
-    case 0x35:
-    case 0x3D:
-        register_sub8_with_flags(z80_decode_reg8(reg, 3, &hl), REG8_ONE, MASK_SZHVN);
-        return hl ? 11 : 4;
-    case 0x06: // LD r,n
-    case 0x0E:
-    case 0x16:
-    case 0x1E:
-    case 0x26:
-    case 0x2E:
-    case 0x36:
-    case 0x3E:
-        *z80_decode_reg8(reg, 3, &hl) = z80_next8();
-        return hl ? 10 : 7;
-    case 0x07: // RLCA
-        register_left8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_bit(z80_reg_af.bytes.high, MAX7));
-        return 4;
-    case 0x08: // EX AF,AF’
-        register_exchange16(&z80_reg_af, &z80_reg_af_2);
-        return 4;
-    case 0x09: // ADD HL,ss
-    case 0x19:
-    case 0x29:
-    case 0x39:
-        register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], MASK_HNC);
+        z80_reg_pc = decoded->nn;
+        return 12;
+    }
+    return 7;
+}
+
+// DJNZ e, DJNZ $ is left to its handler
+int z80_cached_djnz(Z80DECODED *decoded)
+{
+    z80_cached_fetch(2);
+    z80_reg_bc.bytes.high.byte_value--;
+    if (register_is_zero(z80_reg_bc.bytes.high))
+    {
+        return 8;
+    }
+    z80_reg_pc = decoded->nn;
+    return 13;
+}
+
+// JP nn
+int z80_cached_jp(Z80DECODED *decoded)
+{
+    z80_memory_refresh();
+    z80_reg_pc = decoded->nn;
+    return 10;
+}
+
+// JP cc,nn
+int z80_cached_jp_cc(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    if (z80_decode_condition(decoded->op))
+    {
+        z80_reg_pc = decoded->nn;
+    }
+    return 10;
+}
+
+// CALL nn
+int z80_cached_call(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    z80_push_call((REG16){.byte_value = z80_reg_pc.byte_value - 3});
+    z80_reg_pc = decoded->nn;
+    return 17;
+}
+
+// CALL cc,nn
+int z80_cached_call_cc(Z80DECODED *decoded)
+{
+    z80_cached_fetch(3);
+    if (z80_decode_condition(decoded->op))
+    {
+        z80_push_call((REG16){.byte_value = z80_reg_pc.byte_value - 3});
+        z80_reg_pc = decoded->nn;
+        return 17;
+    }
+    return 10;
+}
+
+// RET
+int z80_cached_ret(Z80DECODED *decoded)
+{
+    z80_memory_refresh();
+    z80_reg_pc = z80_pop16();
+    return 10;
+}
+
+// RET cc
+int z80_cached_ret_cc(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    if (z80_decode_condition(decoded->op))
+    {
+        z80_reg_pc = z80_pop16();
         return 11;
-    case 0x0A: // LD A,(BC)
-        z80_reg_af.bytes.high = memory_read8(z80_reg_bc);
-        return 7;
-    case 0x0B: // DEC ss
-    case 0x1B:
-    case 0x2B:
-    case 0x3B:
-        register_sub16_with_flags(z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], REG16_ONE, MASK_NONE);
-        return 6;
-    case 0x0F: // RRCA
-        register_right8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_bit(z80_reg_af.bytes.high, MAX0));
-        return 4;
-    case 0x10: // DJNZ e
-        alt = &(REG8){.value = z80_next8().value};
-        z80_reg_bc.bytes.high.byte_value--;
-        if (register_is_zero(z80_reg_bc.bytes.high))
+    }
+    return 5;
+}
+
+// PUSH qq
+int z80_cached_push_qq(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_flags_materialize();
+    z80_push16(*z80_bc_de_hl_af[decoded->rr]);
+    return 11;
+}
+
+// POP qq
+int z80_cached_pop_qq(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_flags_materialize();
+    *z80_bc_de_hl_af[decoded->rr] = z80_pop16();
+    return 10;
+}
+
+// EX DE,HL
+int z80_cached_ex_de_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_exchange16(&z80_reg_de, &z80_reg_hl);
+    return 4;
+}
+
+// picks the cached handler of an unprefixed opcode, the rest use z80_cached_op
+void z80_decode_operands(REG16 reg, Z80DECODED *decoded)
+{
+    int op = decoded->op.byte_value, x = op >> 3 & 0x07, y = op & 0x07;
+    decoded->n = memory_read8((REG16){.byte_value = reg.byte_value + 1});
+    decoded->nn = memory_read16((REG16){.byte_value = reg.byte_value + 1});
+    decoded->r = x;
+    decoded->s = y;
+    decoded->rr = op >> 4 & 0x03;
+    if (op >= 0x40 && op < 0x80 && op != 0x76)
+    {
+        decoded->exec = (y == 6 ? z80_cached_ld_r_at_hl : x == 6 ? z80_cached_ld_at_hl_r : z80_cached_ld_r_r);
+    }
+    else if (op >= 0x80 && op < 0xC0)
+    {
+        decoded->exec = (y == 6 ? z80_cached_alu_at_hl : z80_cached_alu_r);
+    }
+    else if (op == 0x18 || (op & 0xE7) == 0x20 || (op == 0x10 && decoded->n.value != -2))
+    {
+        decoded->nn.byte_value = reg.byte_value + 2 + decoded->n.value;
+        decoded->exec = (op == 0x18 ? z80_cached_jr : op == 0x10 ? z80_cached_djnz : z80_cached_jr_cc);
+    }
+    else
+    {
+        switch (op & 0xC7)
         {
-            return 8;
+        case 0x04:
+            decoded->exec = (x == 6 ? z80_cached_op : z80_cached_inc_r);
+            return;
+        case 0x05:
+            decoded->exec = (x == 6 ? z80_cached_op : z80_cached_dec_r);
+            return;
+        case 0x06:
+            decoded->exec = (x == 6 ? z80_cached_ld_at_hl_n : z80_cached_ld_r_n);
+            return;
+        case 0xC0:
+            decoded->exec = z80_cached_ret_cc;
+            return;
+        case 0xC2:
+            decoded->exec = z80_cached_jp_cc;
+            return;
+        case 0xC4:
+            decoded->exec = z80_cached_call_cc;
+            return;
+        case 0xC6:
+            decoded->exec = z80_cached_alu_n;
+            return;
         }
-        else
+        switch (op & 0xCF)
+        {
+        case 0x01:
+            decoded->exec = z80_cached_ld_dd_nn;
+            return;
+        case 0x03:
+            decoded->exec = z80_cached_inc_ss;
+            return;
+        case 0x09:
+            decoded->exec = z80_cached_add_hl_ss;
+            return;
+        case 0x0B:
+            decoded->exec = z80_cached_dec_ss;
+            return;
+        case 0xC1:
+            decoded->exec = z80_cached_pop_qq;
+            return;
+        case 0xC5:
+            decoded->exec = z80_cached_push_qq;
+            return;
+        }
+        switch (op)
         {
-            z80_reg_pc.byte_value += alt->value;
-            return 13;
+        case 0x02:
+        case 0x12:
+            decoded->exec = z80_cached_ld_at_rr_a;
+            break;
+        case 0x0A:
+        case 0x1A:
+            decoded->exec = z80_cached_ld_a_at_rr;
+            break;
+        case 0x22:
+            decoded->exec = z80_cached_ld_at_nn_hl;
+            break;
+        case 0x2A:
+            decoded->exec = z80_cached_ld_hl_at_nn;
+            break;
+        case 0x32:
+            decoded->exec = z80_cached_ld_at_nn_a;
+            break;
+        case 0x3A:
+            decoded->exec = z80_cached_ld_a_at_nn;
+            break;
+        case 0xC3:
+            decoded->exec = z80_cached_jp;
+            break;
+        case 0xC9:
+            decoded->exec = z80_cached_ret;
+            break;
+        case 0xCD:
+            decoded->exec = z80_cached_call;
+            break;
+        case 0xEB:
+            decoded->exec = z80_cached_ex_de_hl;
+            break;
         }
-    case 0x12: // LD (DE),A
-        memory_write8(z80_reg_de, z80_reg_af.bytes.high);
+    }
+}
+
+// ---FUSED----------------------------------------------
+
+// a fused handler runs an opcode sequence as one step with the T states and refreshes of its parts,
+// it stops between two parts where the batch would have stopped or when a part wrote over the sequence
+bool z80_fused_stop(Z80DECODED *decoded, int t)
+{
+    return z80_t_states_all + t >= z80_deadline || decoded->exec == NULL;
+}
+
+// the parts after the first are further instructions of the same step
+void z80_fused_fetch(int length)
+{
+    z80_instructions++;
+    z80_cached_fetch(length);
+}
+
+// LD A,(HL); INC HL
+int z80_fused_ld_a_at_hl_inc_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    z80_reg_af.bytes.high = memory_read8(z80_reg_hl);
+    if (z80_fused_stop(decoded, 7))
+    {
         return 7;
-    case 0x17: // RLA
-        register_left8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_flag(FLAG_C));
-        return 4;
-    case 0x18: // JR e
-        return z80_jump_rel_with_condition(true);
-    case 0x1A: // LD A,(DE)
-        z80_reg_af.bytes.high = memory_read8(z80_reg_de);
+    }
+    z80_fused_fetch(1);
+    register_add16_with_flags(&z80_reg_hl, REG16_ONE, MASK_NONE);
+    return 13;
+}
+
+// LD A,(HL); INC HL; LD (DE),A
+int z80_fused_ld_a_at_hl_inc_hl_ld_at_de_a(Z80DECODED *decoded)
+{
+    int t = z80_fused_ld_a_at_hl_inc_hl(decoded);
+    if (t != 13 || z80_fused_stop(decoded, 13))
+    {
+        return t;
+    }
+    z80_fused_fetch(1);
+    memory_write8(z80_reg_de, z80_reg_af.bytes.high);
+    return 20;
+}
+
+// LD A,(DE); INC DE
+int z80_fused_ld_a_at_de_inc_de(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    z80_reg_af.bytes.high = memory_read8(z80_reg_de);
+    if (z80_fused_stop(decoded, 7))
+    {
+        return 7;
+    }
+    z80_fused_fetch(1);
+    register_add16_with_flags(&z80_reg_de, REG16_ONE, MASK_NONE);
+    return 13;
+}
+
+// LD (DE),A; INC DE
+int z80_fused_ld_at_de_a_inc_de(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    memory_write8(z80_reg_de, z80_reg_af.bytes.high);
+    if (z80_fused_stop(decoded, 7))
+    {
+        return 7;
+    }
+    z80_fused_fetch(1);
+    register_add16_with_flags(&z80_reg_de, REG16_ONE, MASK_NONE);
+    return 13;
+}
+
+// LD (HL),A; INC HL
+int z80_fused_ld_at_hl_a_inc_hl(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    memory_write8(z80_reg_hl, z80_reg_af.bytes.high);
+    if (z80_fused_stop(decoded, 7))
+    {
         return 7;
-    case 0x1F: // RRA
-        register_right8_with_flags(&z80_reg_af.bytes.high, MASK_HNC, register_is_flag(FLAG_C));
+    }
+    z80_fused_fetch(1);
+    register_add16_with_flags(&z80_reg_hl, REG16_ONE, MASK_NONE);
+    return 13;
+}
+
+// DEC B; JR NZ,e, B is zero exactly when DEC B sets Z
+int z80_fused_dec_b_jr_nz(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_dec8_with_flags(&z80_reg_bc.bytes.high);
+    if (z80_fused_stop(decoded, 4))
+    {
         return 4;
-    case 0x20: // JR NZ,e
-        return z80_jump_rel_with_condition(!register_is_flag(FLAG_Z));
-    case 0x28: // JR Z,e
-        return z80_jump_rel_with_condition(register_is_flag(FLAG_Z));
-    case 0x30: // JR NC,e
-        return z80_jump_rel_with_condition(!register_is_flag(FLAG_C));
-    case 0x38: // JR C,e
-        return z80_jump_rel_with_condition(register_is_flag(FLAG_C));
-    case 0x22: // LD (nn),HL
-        memory_write16(z80_next16(), z80_reg_hl);
+    }
+    z80_fused_fetch(2);
+    if (!register_is_zero(z80_reg_bc.bytes.high))
+    {
+        z80_reg_pc = decoded->nn;
         return 16;
-    case 0x27: // DAA
-        qr = register_split_8_to_4(z80_reg_af.bytes.high);
-        c = register_is_flag(FLAG_C);
-        hc = register_is_flag(FLAG_HC);
-        if (c == false && hc == false && qr.quot <= 0x09 && qr.rem <= 0x09)
-        {
-        }
-        else if (c == false && hc == false && qr.quot <= 0x08 && qr.rem >= 0x0A && qr.rem <= 0x0F)
-        {
-            z80_reg_af.bytes.high.byte_value += 0x06;
-        }
-        else if (c == false && hc == true && qr.quot <= 0x09 && qr.rem <= 0x03)
+    }
+    return 11;
+}
+
+// EX DE,HL; ADD HL,ss
+int z80_fused_ex_de_hl_add_hl_ss(Z80DECODED *decoded)
+{
+    z80_cached_fetch(1);
+    register_exchange16(&z80_reg_de, &z80_reg_hl);
+    if (z80_fused_stop(decoded, 4))
+    {
+        return 4;
+    }
+    z80_fused_fetch(1);
+    register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[decoded->rr], MASK_HNC);
+    return 15;
+}
+
+// the sequences with a fused handler, longest first so a triple wins over its leading pair;
+// at most 4 bytes each so a write to any of them clears the entry of the first (see z80_decode_invalidate)
+Z80FUSION z80_fusions[] = {
+    {3, {0x7E, 0x23, 0x12}, z80_fused_ld_a_at_hl_inc_hl_ld_at_de_a, true},
+    {2, {0x7E, 0x23}, z80_fused_ld_a_at_hl_inc_hl, true},
+    {2, {0x1A, 0x13}, z80_fused_ld_a_at_de_inc_de, true},
+    {2, {0x12, 0x13}, z80_fused_ld_at_de_a_inc_de, true},
+    {2, {0x77, 0x23}, z80_fused_ld_at_hl_a_inc_hl, true},
+    {2, {0x05, 0x20}, z80_fused_dec_b_jr_nz, true},
+    {2, {0xEB, 0x09}, z80_fused_ex_de_hl_add_hl_ss, true},
+    {2, {0xEB, 0x19}, z80_fused_ex_de_hl_add_hl_ss, true},
+    {2, {0xEB, 0x29}, z80_fused_ex_de_hl_add_hl_ss, true},
+    {2, {0xEB, 0x39}, z80_fused_ex_de_hl_add_hl_ss, true}};
+
+// the fused handler of the enabled sequence at reg takes the operands of the last instruction,
+// none while profiling so the profile counts the instructions the interpreter sees
+void z80_fusion_decode(REG16 reg, Z80DECODED *decoded)
+{
+    int i, j, size = sizeof(z80_fusions) / sizeof(Z80FUSION);
+    REG16 alt;
+    Z80DECODED last;
+    for (i = 0; i < size && !z80_fusion_profile; i++)
+    {
+        alt = reg;
+        for (j = 0; j < z80_fusions[i].length && memory_read8(alt).byte_value == z80_fusions[i].ops[j]; j++)
         {
-            z80_reg_af.bytes.high.byte_value += 0x06;
+            alt.byte_value += (j < z80_fusions[i].length - 1 ? z80_lengths[z80_fusions[i].ops[j]] : 0);
         }
-        else if (c == false && hc == false && qr.quot >= 0x0A && qr.quot <= 0x0F && qr.rem <= 0x09)
+        if (j == z80_fusions[i].length && z80_fusions[i].enabled)
         {
-            z80_reg_af.bytes.high.byte_value += 0x60;
-            register_set_or_unset_flag(FLAG_C, true);
+            last.op = memory_read8(alt);
+            z80_decode_operands(alt, &last);
+            decoded->exec = z80_fusions[i].exec;
+            decoded->nn = last.nn;
+            decoded->rr = last.rr;
+            return;
         }
-        else if (c == false && hc == false && qr.quot >= 0x09 && qr.quot <= 0x0F && qr.rem >= 0x0A && qr.rem <= 0x0F)
+    }
+}
+
+// counts the unprefixed opcode at reg with the one and two before it when they are adjacent in memory
+void z80_fusion_count(REG16 reg)
+{
+    int i;
+    unsigned int key;
+    REG8 op = memory_read8(reg);
+    if (z80_lengths[op.byte_value] == 0 || reg.byte_value != z80_fusion_next.byte_value)
+    {
+        z80_fusion_run = 0;
+    }
+    if (z80_fusion_run >= 1)
+    {
+        z80_pair_counts[z80_fusion_ops[1].byte_value][op.byte_value]++;
+    }
+    if (z80_fusion_run >= 2)
+    {
+        // open addressing on the three opcodes, the triples after the table fills up are not counted
+        key = 1 << 24 | z80_fusion_ops[0].byte_value << 16 | z80_fusion_ops[1].byte_value << 8 | op.byte_value;
+        for (i = key % FUSION_TRIPLES; z80_triple_counts[i].key != 0 && z80_triple_counts[i].key != key;
+             i = (i + 1) % FUSION_TRIPLES)
         {
-            z80_reg_af.bytes.high.byte_value += 0x66;
-            register_set_or_unset_flag(FLAG_C, true);
         }
-        else if (c == false && hc == true && qr.quot >= 0x0A && qr.quot <= 0x0F && qr.rem <= 0x03)
+        if (z80_triple_counts[i].key == 0 && z80_triples_size < FUSION_TRIPLES - 1)
         {
-            z80_reg_af.bytes.high.byte_value += 0x66;
-            register_set_or_unset_flag(FLAG_C, true);
+            z80_triple_counts[i].key = key;
+            z80_triples_size++;
         }
-        else if (c == true && hc == false && qr.quot <= 0x02 && qr.rem <= 0x09)
+        if (z80_triple_counts[i].key == key)
         {
-            z80_reg_af.bytes.high.byte_value += 0x60;
+            z80_triple_counts[i].count++;
         }
-        else if (c == true && hc == false && qr.quot <= 0x02 && qr.rem >= 0x0A && qr.rem <= 0x0F)
+    }
+    if (z80_lengths[op.byte_value] != 0)
+    {
+        z80_fusion_ops[0] = z80_fusion_ops[1];
+        z80_fusion_ops[1] = op;
+        z80_fusion_run = (z80_fusion_run < 2 ? z80_fusion_run + 1 : 2);
+        z80_fusion_next.byte_value = reg.byte_value + z80_lengths[op.byte_value];
+    }
+}
+
+int z80_fusion_compare_counts(const void *a, const void *b)
+{
+    unsigned int x = ((const Z80FUSIONCOUNT *)a)->count, y = ((const Z80FUSIONCOUNT *)b)->count;
+    return (x < y) - (x > y);
+}
+
+// writes the most frequent pairs and triples as count and opcodes in hex, the format -fusions reads
+void z80_fusion_save(const char *filename)
+{
+    int i, j, n = 0;
+    Z80FUSIONCOUNT *counts = malloc((MAX8 * MAX8 + FUSION_TRIPLES) * sizeof(Z80FUSIONCOUNT));
+    FILE *f = fopen(filename, "w");
+    for (i = 0; i < MAX8; i++)
+    {
+        for (j = 0; j < MAX8; j++)
         {
-            z80_reg_af.bytes.high.byte_value += 0x66;
+            if (z80_pair_counts[i][j] > 0)
+            {
+                counts[n++] = (Z80FUSIONCOUNT){.key = i << 8 | j, .count = z80_pair_counts[i][j]};
+            }
         }
-        else if (c == true && hc == true && qr.quot <= 0x03 && qr.rem <= 0x03)
+    }
+    for (i = 0; i < FUSION_TRIPLES; i++)
+    {
+        if (z80_triple_counts[i].key != 0)
         {
-            z80_reg_af.bytes.high.byte_value += 0x66;
+            counts[n++] = z80_triple_counts[i];
         }
-        else if (c == false && hc == true && qr.quot <= 0x08 && qr.rem >= 0x06 && qr.rem <= 0x0F)
+    }
+    qsort(counts, n, sizeof(Z80FUSIONCOUNT), z80_fusion_compare_counts);
+    for (i = 0; i < n && i < FUSION_PROFILE_TOP; i++)
+    {
+        fprintf(f, "%u", counts[i].count);
+        for (j = (counts[i].key >> 24 ? 16 : 8); j >= 0; j -= 8)
         {
-            z80_reg_af.bytes.high.byte_value += 0xFA;
+            fprintf(f, " %02X", counts[i].key >> j & 0xFF);
         }
-        else if (c == true && hc == false && qr.quot >= 0x07 && qr.quot <= 0x0F && qr.rem <= 0x09)
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    free(counts);
+}
+
+// enables only the fused handlers of the sequences listed in a -fusion-profile file
+bool z80_fusion_load(const char *filename)
+{
+    char line[256];
+    unsigned int ops[FUSION_MAX];
+    int i, j, n, size = sizeof(z80_fusions) / sizeof(Z80FUSION);
+    bool found;
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    for (i = 0; i < size; i++)
+    {
+        z80_fusions[i].enabled = false;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        n = sscanf(line, "%*u %x %x %x", &ops[0], &ops[1], &ops[2]);
+        found = false;
+        for (i = 0; i < size && n >= 2; i++)
         {
-            z80_reg_af.bytes.high.byte_value += 0xA0;
+            for (j = 0; j < n && j < z80_fusions[i].length && z80_fusions[i].ops[j] == ops[j]; j++)
+            {
+            }
+            if (j == n && j == z80_fusions[i].length)
+            {
+                z80_fusions[i].enabled = found = true;
+            }
         }
-        else if (c == true && hc == true && qr.quot >= 0x06 && qr.quot <= 0x07 && qr.rem >= 0x06 && qr.rem <= 0x0F)
+        if (n >= 2 && !found)
         {
-            z80_reg_af.bytes.high.byte_value += 0x9A;
+            printf("No fused handler for");
+            for (j = 0; j < n; j++)
+            {
+                printf(" %02X", ops[j]);
+            }
+            printf("\n");
         }
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        return 4;
-    case 0x2A: // LD HL,(nn)
-        z80_reg_hl = memory_read16(z80_next16());
-        return 16;
-    case 0x2F: // CPL
-        z80_reg_af.bytes.high.byte_value = ~z80_reg_af.bytes.high.byte_value;
-        register_set_or_unset_flag(FLAG_N | FLAG_HC, true);
-        return 4;
-    case 0x32: // LD (nn),A
-        memory_write8(z80_next16(), z80_reg_af.bytes.high);
-        return 13;
-    case 0x37: // SCF
-        register_set_or_unset_flag(FLAG_C, true);
-        register_set_or_unset_flag(FLAG_N | FLAG_HC, false);
-        return 4;
-    case 0x3A: // LD A,(nn)
-        z80_reg_af.bytes.high = memory_read8(z80_next16());
-        return 13;
-    case 0x3F: // CCF
-        c = register_is_flag(FLAG_C);
-        register_set_or_unset_flag(FLAG_HC, c);
-        register_set_or_unset_flag(FLAG_C, !c);
-        register_set_or_unset_flag(FLAG_N, false);
-        return 4;
-    case 0x40: // LD r,r
-    case 0x41:
-    case 0x42:
-    case 0x43:
-    case 0x44:
-    case 0x45:
-    case 0x46:
-    case 0x47:
-    case 0x48:
-    case 0x49:
-    case 0x4A:
-    case 0x4B:
-    case 0x4C:
-    case 0x4D:
-    case 0x4E:
-    case 0x4F:
-    case 0x50:
-    case 0x51:
-    case 0x52:
-    case 0x53:
-    case 0x54:
-    case 0x55:
-    case 0x56:
-    case 0x57:
-    case 0x58:
-    case 0x59:
-    case 0x5A:
-    case 0x5B:
-    case 0x5C:
-    case 0x5D:
-    case 0x5E:
-    case 0x5F:
-    case 0x60:
-    case 0x61:
-    case 0x62:
-    case 0x63:
-    case 0x64:
-    case 0x65:
-    case 0x66:
-    case 0x67:
-    case 0x68:
-    case 0x69:
-    case 0x6A:
-    case 0x6B:
-    case 0x6C:
-    case 0x6D:
-    case 0x6E:
-    case 0x6F:
-    case 0x70:
-    case 0x71:
-    case 0x72:
-    case 0x73:
-    case 0x74:
-    case 0x75:
-    case 0x77:
-    case 0x78:
-    case 0x79:
-    case 0x7A:
-    case 0x7B:
-    case 0x7C:
-    case 0x7D:
-    case 0x7E:
-    case 0x7F:
-        alt = z80_decode_reg8(reg, 0, &hl);
-        *z80_decode_reg8(reg, 3, &hl) = *alt;
-        return hl ? 7 : 4;
-    case 0x76: // HALT
-        z80_halt = true;
-        return 4;
-    case 0x80: // ADD A,r
-    case 0x81:
-    case 0x82:
-    case 0x83:
-    case 0x84:
-    case 0x85:
-    case 0x86:
-    case 0x87:
-        register_add8_with_flags(&z80_reg_af.bytes.high, *z80_decode_reg8(reg, 0, &hl), MASK_ALL);
-        return hl ? 7 : 4;
-    case 0x88: // ADC A,r
-    case 0x89:
-    case 0x8A:
-    case 0x8B:
-    case 0x8C:
-    case 0x8D:
-    case 0x8E:
-    case 0x8F:
-        c = register_is_flag(FLAG_C);
-        register_add8_with_flags(&z80_reg_af.bytes.high, *z80_decode_reg8(reg, 0, &hl), mask);
-        if (c)
-        {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
-        }
-        return hl ? 7 : 4;
-    case 0x90: // SUB A,r
-    case 0x91:
-    case 0x92:
-    case 0x93:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0x97:
-        register_sub8_with_flags(&z80_reg_af.bytes.high, *z80_decode_reg8(reg, 0, &hl), MASK_ALL);
-        return hl ? 7 : 4;
-    case 0x98: // SBC A,r
-    case 0x99:
-    case 0x9A:
-    case 0x9B:
-    case 0x9C:
-    case 0x9D:
-    case 0x9E:
-    case 0x9F:
-        c = register_is_flag(FLAG_C);
-        register_sub8_with_flags(&z80_reg_af.bytes.high, *z80_decode_reg8(reg, 0, &hl), mask);
-        if (c)
-        {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
-        }
-        return hl ? 7 : 4;
-    case 0xA0: // AND r
-    case 0xA1:
-    case 0xA2:
-    case 0xA3:
-    case 0xA4:
-    case 0xA5:
-    case 0xA6:
-    case 0xA7:
-        z80_reg_af.bytes.high.byte_value &= z80_decode_reg8(reg, 0, &hl)->byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_N | FLAG_C, false);
-        register_set_or_unset_flag(FLAG_HC, true);
-        return hl ? 7 : 4;
-    case 0xA8: // XOR r
-    case 0xA9:
-    case 0xAA:
-    case 0xAB:
-    case 0xAC:
-    case 0xAD:
-    case 0xAE:
-    case 0xAF:
-        z80_reg_af.bytes.high.byte_value ^= z80_decode_reg8(reg, 0, &hl)->byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_C | FLAG_N | FLAG_HC, false);
-        return hl ? 7 : 4;
-    case 0xB0: // OR r
-    case 0xB1:
-    case 0xB2:
-    case 0xB3:
-    case 0xB4:
-    case 0xB5:
-    case 0xB6:
-    case 0xB7:
-        z80_reg_af.bytes.high.byte_value |= z80_decode_reg8(reg, 0, &hl)->byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_C | FLAG_N | FLAG_HC, false);
-        return hl ? 7 : 4;
-    case 0xB8: // CP r
-    case 0xB9:
-    case 0xBA:
-    case 0xBB:
-    case 0xBC:
-    case 0xBD:
-    case 0xBE:
-    case 0xBF:
-        register_sub8_with_flags(&duplicate_a, *z80_decode_reg8(reg, 0, &hl), MASK_ALL);
-        return hl ? 7 : 4;
-    case 0xC0: // RET CC
-    case 0xC8:
-    case 0xD0:
-    case 0xD8:
-    case 0xE0:
-    case 0xE8:
-    case 0xF0:
-    case 0xF8:
-        return z80_ret_with_condition(z80_decode_condition(reg));
-    case 0xC1: // POP qq
-    case 0xD1:
-    case 0xE1:
-    case 0xF1:
-        *z80_bc_de_hl_af[reg.byte_value >> 4 & 0x03] = z80_pop16();
-        return 10;
-    case 0xC2: // JP CC,nn
-    case 0xCA:
-    case 0xD2:
-    case 0xDA:
-    case 0xE2:
-    case 0xEA:
-    case 0xF2:
-    case 0xFA:
-        return z80_jump_with_condition(z80_decode_condition(reg));
-    case 0xC3: // JP nn
-        return z80_jump_with_condition(true);
-    case 0xC4: // CALL CC,nn
-    case 0xCC:
-    case 0xD4:
-    case 0xDC:
-    case 0xE4:
-    case 0xEC:
-    case 0xF4:
-    case 0xFC:
-        return z80_call_with_condition(z80_decode_condition(reg));
-    case 0xC5: // PUSH qq
-    case 0xD5:
-    case 0xE5:
-    case 0xF5:
-        z80_push16(*z80_bc_de_hl_af[reg.byte_value >> 4 & 0x03]);
-        return 11;
-    case 0xC6: // ADD A,n
-        register_add8_with_flags(&z80_reg_af.bytes.high, z80_next8(), MASK_ALL);
-        return 7;
-    case 0xC7: // RST p
-    case 0xD7:
-    case 0xCF:
-    case 0xDF:
-    case 0xE7:
-    case 0xEF:
-    case 0xF7:
-    case 0xFF:
-        z80_push16(z80_reg_pc);
-        z80_reg_pc.value = z80_rst_addr[reg.byte_value >> 3 & 0x07];
-        return 11;
-    case 0xC9: // RET
-        z80_ret_with_condition(true);
-        return 10;
-    case 0xCD: // CALL nn
-        return z80_call_with_condition(true);
-    case 0xCE: // ADC A,n
-        c = register_is_flag(FLAG_C);
-        register_add8_with_flags(&z80_reg_af.bytes.high, z80_next8(), mask);
-        if (c)
+    }
+    fclose(f);
+    return true;
+}
+
+// resolves the prefixes of the instruction at reg down to the handler that executes it,
+// chained prefixes like DD DD are left to the interpreter
+void z80_decode(REG16 reg, Z80DECODED *decoded)
+{
+    REG16 next = {.byte_value = reg.byte_value + 1};
+    REG8 op = memory_read8(reg);
+    REG8 alt = memory_read8(next);
+    memset(decoded, 0, sizeof(Z80DECODED));
+    decoded->op = alt;
+    if (z80_instruction_length(reg) == 0)
+    {
+        decoded->exec = z80_cached_uncached;
+        return;
+    }
+    switch (op.byte_value)
+    {
+    case 0xCB:
+        decoded->exec = z80_cached_op_cb;
+        break;
+    case 0xED:
+        decoded->exec = z80_cached_op_ed;
+        break;
+    case 0xDD:
+    case 0xFD:
+        decoded->rr = (op.byte_value == 0xFD);
+        if (alt.byte_value == 0xCB)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            next.byte_value++;
+            decoded->d = memory_read8(next);
+            next.byte_value++;
+            decoded->op = memory_read8(next);
+            decoded->exec = z80_cached_index_cb;
         }
-        return 7;
-    case 0xD3: // OUT (n),A
-        port_write8((REG16){.bytes.high = z80_reg_af.bytes.high, .bytes.low = z80_next8()}, z80_reg_af.bytes.high);
-        return 11;
-    case 0xD6: // SUB n
-        register_sub8_with_flags(&z80_reg_af.bytes.high, z80_next8(), MASK_ALL);
-        return 7;
-    case 0xD9: // EXX
-        register_exchange16(&z80_reg_bc, &z80_reg_bc_2);
-        register_exchange16(&z80_reg_de, &z80_reg_de_2);
-        register_exchange16(&z80_reg_hl, &z80_reg_hl_2);
-        return 4;
-    case 0xDB: // IN A,(n)
-        z80_reg_af.bytes.high = port_read8((REG16){.bytes.high = z80_reg_af.bytes.high, .bytes.low = z80_next8()});
-        return 11;
-    case 0xDE: // SBC A,n
-        c = register_is_flag(FLAG_C);
-        register_sub8_with_flags(&z80_reg_af.bytes.high, z80_next8(), mask);
-        if (c)
+        else
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            decoded->exec =
+                (z80_ops_dd_fd[alt.byte_value] == z80_op_index_simple ? z80_cached_op_prefixed : z80_cached_index);
         }
-        return 7;
-    case 0xE3: // EX (SP),HL
-        register_exchange16(memory_ref16(z80_reg_sp), &z80_reg_hl);
+        break;
+    default:
+        decoded->op = op;
+        decoded->exec = z80_cached_op;
+        z80_decode_operands(reg, decoded);
+        z80_fusion_decode(reg, decoded);
+    }
+}
+
+void z80_decode_invalidate(int address)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        z80_decoded[(address - i) & 0xFFFF].exec = NULL;
+    }
+}
+
+void z80_decode_page(int page)
+{
+    for (int i = page * MAX8; i < page * MAX8 + MAX8; i++)
+    {
+        z80_decode((REG16){.byte_value = i}, &z80_decoded[i]);
+    }
+    memory_code_pages[page] |= CODE_DECODED;
+    if (page < MAX8 - 1)
+    {
+        memory_code_pages[page + 1] |= CODE_DECODED;
+    }
+}
+
+// the ROM is decoded once, the RAM pages the first time they are executed
+void z80_decode_rom()
+{
+    for (int i = 0; i < MAX14 / MAX8; i++)
+    {
+        z80_decode_page(i);
+    }
+}
+
+Z80DECODED *z80_decoded_at(REG16 reg)
+{
+    Z80DECODED *decoded = &z80_decoded[reg.byte_value];
+    if (decoded->exec == NULL)
+    {
+        z80_decode(reg, decoded);
+        // the instruction can reach 3 bytes further into the next page
+        memory_code_pages[reg.bytes.high.byte_value] |= CODE_DECODED;
+        memory_code_pages[(reg.byte_value + 3) >> 8 & 0xFF] |= CODE_DECODED;
+    }
+    return decoded;
+}
+
+int z80_execute_entry(Z80DECODED *decoded)
+{
+    if (z80_halt)
+    {
+        return z80_execute_next();
+    }
+    z80_instructions++;
+    return decoded->exec(decoded);
+}
+
+// runs decoded instructions until one jumps back, halts or reaches the deadline, so a loop is one step for
+// z80_idle_check; z80_t_states_all stays current for the handlers and is given back to the caller as it was,
+// the fusion profile counts opcode pairs per step so it gets one instruction at a time
+int z80_execute_decoded()
+{
+    unsigned long long start = z80_t_states_all;
+    REG16 pc;
+    int t = 0, step;
+    do
+    {
+        pc = z80_reg_pc;
+        z80_t_states_all = start + t;
+        step = z80_execute_entry(z80_decoded_at(pc));
+        t += step;
+    } while (step > 0 && z80_reg_pc.byte_value > pc.byte_value && !z80_halt && start + t < z80_deadline &&
+             !z80_fusion_profile);
+    z80_t_states_all = start;
+    return t;
+}
+
+int z80_nonmaskable_interrupt()
+{
+    z80_iff2 = z80_iff1;
+    z80_iff1 = false;
+    z80_push_call(z80_reg_pc);
+    z80_reg_pc.byte_value = 0x66;
+    return 11;
+}
+
+int z80_maskable_interrupt()
+{
+    z80_iff1 = false;
+    z80_iff2 = false;
+    z80_memory_refresh();
+    switch (z80_imode)
+    {
+    case 0:
+        // TODO: wait 2 cycles for interrupting device to write to data_bus
+        return z80_execute(z80_data_bus);
+    case 1:
+        z80_push_call(z80_reg_pc);
+        z80_reg_pc.byte_value = 0x38;
+        return 13;
+    case 2:
+        z80_memory_refresh();
+        z80_memory_refresh();
+        z80_push_call(z80_reg_pc);
+        z80_reg_pc = memory_read16((REG16){.bytes.high = z80_reg_i, .bytes.low = z80_data_bus});
         return 19;
-    case 0xE6: // AND n
-        z80_reg_af.bytes.high.byte_value &= z80_next8().byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_N | FLAG_C, false);
-        register_set_or_unset_flag(FLAG_HC, true);
-        return 7;
-    case 0xE9: // JP HL
-        z80_reg_pc = z80_reg_hl;
-        return 4;
-    case 0xEB: // EX DE,HL
-        register_exchange16(&z80_reg_de, &z80_reg_hl);
-        return 4;
-    case 0xEE: // XOR n
-        z80_reg_af.bytes.high.byte_value ^= z80_next8().byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_C | FLAG_N | FLAG_HC, false);
-        return 7;
-    case 0xF3: // DI
-        z80_iff1 = z80_iff2 = false;
-        return 4;
-    case 0xF6: // OR n
-        z80_reg_af.bytes.high.byte_value |= z80_next8().byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_C | FLAG_N | FLAG_HC, false);
-        return 7;
-    case 0xF9: // LD SP,HL
-        z80_reg_sp = z80_reg_hl;
-        return 6;
-    case 0xFB: // EI
-        z80_iff1 = z80_iff2 = true;
-        return 4;
-    case 0xFE: // CP n
-        register_sub8_with_flags(&duplicate_a, z80_next8(), MASK_ALL);
-        return 7;
     default:
         return 0; // fail
     }
 }
 
-int z80_execute_cb(REG8 reg)
+// a halted CPU executes NOPs until it is interrupted, all of them up to the next task are done at once
+int z80_halt_fast_forward()
+{
+    if (!z80_halt || z80_nonmaskable_interrupt_flag || z80_maskable_interrupt_flag || !z80_can_execute ||
+        z80_deadline <= z80_t_states_all)
+    {
+        return 0;
+    }
+    unsigned long long n = (z80_deadline - z80_t_states_all + 3) / 4;
+    z80_memory_refresh_by(n);
+    return 4 * n;
+}
+
+// a short loop that jumps back to its start with the same registers and no memory writes
+// will repeat identically until the next task, so all the iterations up to there are credited at once
+void z80_idle_check(REG16 pc)
+{
+    Z80STATE state;
+    unsigned long long t, n;
+    if (z80_idle_steps >= 0 && ++z80_idle_steps > IDLE_MAX_STEPS)
+    {
+        z80_idle_steps = -1;
+    }
+    if (z80_reg_pc.byte_value > pc.byte_value || pc.byte_value - z80_reg_pc.byte_value > IDLE_MAX_BYTES || z80_halt ||
+        z80_nonmaskable_interrupt_flag || z80_maskable_interrupt_flag)
+    {
+        return;
+    }
+    z80_get_state(&state);
+    state.r = z80_idle_state.r;
+    if (z80_idle_steps >= 0 && !z80_idle_r_read && memory_writes == z80_idle_writes &&
+        memcmp(&state, &z80_idle_state, sizeof(Z80STATE)) == 0 && z80_deadline > z80_t_states_all)
+    {
+        t = z80_t_states_all - z80_idle_t;
+        n = (z80_deadline - z80_t_states_all) / t;
+        z80_memory_refresh_by(n * ((z80_reg_r.byte_value - z80_idle_state.r.byte_value) & 0x7F));
+        z80_instructions += n * (z80_instructions - z80_idle_instructions);
+        z80_t_states_all += n * t;
+    }
+    z80_get_state(&z80_idle_state);
+    z80_idle_t = z80_t_states_all;
+    z80_idle_writes = memory_writes;
+    z80_idle_instructions = z80_instructions;
+    z80_idle_r_read = false;
+    z80_idle_steps = 0;
+}
+
+int z80_run_one()
+{
+    if (z80_nonmaskable_interrupt_flag)
+    {
+        z80_halt = false;
+        z80_nonmaskable_interrupt_flag = false;
+        return z80_nonmaskable_interrupt();
+    }
+    else if (z80_maskable_interrupt_flag)
+    {
+        z80_halt = false;
+        z80_maskable_interrupt_flag = false;
+        if (z80_iff1)
+        {
+            return z80_maskable_interrupt();
+        }
+    }
+    if (z80_can_execute)
+    {
+        // if (z80_reg_pc.byte_value == 0x87a3 && debug == 100)
+        // {
+        //    debug = 0;
+        // }
+        // if (debug < 100)
+        // {
+        //     z80_print();
+        //     debug++;
+        // }
+        if (z80_fusion_profile)
+        {
+            z80_fusion_count(z80_reg_pc);
+        }
+        return z80_decode_cache ? z80_execute_decoded() : z80_execute_next();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+// ===JIT================================================
+
+// the blocks run with RBX pointing at the machine, R12 holding z80_t_states_all and R13 z80_deadline,
+// refreshes of R are added up while translating and stored before a handler call and on every way out
+
+void jit_emit8(unsigned char **code, int v)
+{
+    *(*code)++ = v;
+}
+
+void jit_emit16(unsigned char **code, int v)
+{
+    jit_emit8(code, v & 0xFF);
+    jit_emit8(code, v >> 8 & 0xFF);
+}
+
+void jit_emit32(unsigned char **code, int v)
+{
+    memcpy(*code, &v, 4);
+    *code += 4;
+}
+
+void jit_emit64(unsigned char **code, unsigned long long v)
+{
+    memcpy(*code, &v, 8);
+    *code += 8;
+}
+
+// MOV RAX, imm64
+void jit_emit_mov_rax(unsigned char **code, const void *p)
+{
+    jit_emit8(code, 0x48);
+    jit_emit8(code, 0xB8);
+    jit_emit64(code, (unsigned long long)p);
+}
+
+// MOV RAX, imm64; CALL RAX
+void jit_emit_call(unsigned char **code, const void *p)
+{
+    jit_emit_mov_rax(code, p);
+    jit_emit8(code, 0xFF);
+    jit_emit8(code, 0xD0);
+}
+
+void jit_free_block(REG16 reg)
+{
+    free(jit_blocks[reg.byte_value]);
+    jit_blocks[reg.byte_value] = NULL;
+}
+
+void jit_flush()
+{
+    for (int i = 0; i < MAX16; i++)
+    {
+        jit_free_block((REG16){.byte_value = i});
+    }
+    for (int i = 0; i < MAX8; i++)
+    {
+        memory_code_pages[i] &= ~CODE_JIT;
+    }
+    jit_code_used = 0;
+}
+
+void jit_invalidate(int page)
+{
+    int end = page * MAX8 + MAX8;
+    for (int i = (page * MAX8 > JIT_MAX_BYTES ? page * MAX8 - JIT_MAX_BYTES : 0); i < end; i++)
+    {
+        if (jit_blocks[i] != NULL && i + jit_blocks[i]->size > page * MAX8)
+        {
+            jit_free_block((REG16){.byte_value = i});
+        }
+    }
+    memory_code_pages[page] &= ~CODE_JIT;
+    jit_invalidated = true;
+}
+
+// the buffer is never writable and executable at once, jit_compile opens the pages it writes to
+bool jit_init()
+{
+#ifdef __x86_64__
+    jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit_code == MAP_FAILED)
+    {
+        jit_code = NULL;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+int jit_offset(const void *p)
+{
+    return (const unsigned char *)p - (const unsigned char *)machine;
+}
+
+// ModRM and disp32 of [RBX + offset of p]
+void jit_emit_machine(unsigned char **code, int reg, const void *p)
+{
+    jit_emit8(code, 0x83 | reg << 3);
+    jit_emit32(code, jit_offset(p));
+}
+
+// ModRM, SIB and disp32 of [RBX + RAX + offset of memory]
+void jit_emit_memory(unsigned char **code, int reg)
+{
+    jit_emit8(code, 0x84 | reg << 3);
+    jit_emit8(code, 0x03);
+    jit_emit32(code, jit_offset(memory));
+}
+
+// MOVZX reg, BYTE [p]
+void jit_emit_load8(unsigned char **code, int reg, const void *p)
+{
+    jit_emit16(code, 0xB60F);
+    jit_emit_machine(code, reg, p);
+}
+
+// MOVZX reg, WORD [p]
+void jit_emit_load16(unsigned char **code, int reg, const void *p)
+{
+    jit_emit16(code, 0xB70F);
+    jit_emit_machine(code, reg, p);
+}
+
+// MOV [p], reg8
+void jit_emit_store8(unsigned char **code, int reg, const void *p)
+{
+    jit_emit8(code, 0x88);
+    jit_emit_machine(code, reg, p);
+}
+
+// MOV [p], reg16
+void jit_emit_store16(unsigned char **code, int reg, const void *p)
+{
+    jit_emit16(code, 0x8966);
+    jit_emit_machine(code, reg, p);
+}
+
+// MOV BYTE [p], imm8
+void jit_emit_store8_imm(unsigned char **code, const void *p, int v)
+{
+    jit_emit8(code, 0xC6);
+    jit_emit_machine(code, 0, p);
+    jit_emit8(code, v);
+}
+
+// MOV WORD [p], imm16
+void jit_emit_store16_imm(unsigned char **code, const void *p, int v)
+{
+    jit_emit16(code, 0xC766);
+    jit_emit_machine(code, 0, p);
+    jit_emit16(code, v);
+}
+
+// MOV reg, imm32
+void jit_emit_mov_imm(unsigned char **code, int reg, int v)
+{
+    jit_emit8(code, 0xB8 | reg);
+    jit_emit32(code, v);
+}
+
+// MOVZX reg, BYTE [memory + RAX]
+void jit_emit_read8(unsigned char **code, int reg)
+{
+    jit_emit16(code, 0xB60F);
+    jit_emit_memory(code, reg);
+}
+
+// MOV RDX, imm64; MOVZX EDX, BYTE [RDX + index]
+void jit_emit_lookup(unsigned char **code, const void *table, int index)
+{
+    jit_emit16(code, 0xBA48);
+    jit_emit64(code, (unsigned long long)table);
+    jit_emit16(code, 0xB60F);
+    jit_emit8(code, 0x14);
+    jit_emit8(code, index << 3 | 0x02);
+}
+
+// Jcc rel32 or JMP rel32, returns the displacement for jit_patch
+unsigned char *jit_emit_jump(unsigned char **code, int cc)
+{
+    if (cc == JIT_JMP)
+    {
+        jit_emit8(code, JIT_JMP);
+    }
+    else
+    {
+        jit_emit8(code, 0x0F);
+        jit_emit8(code, cc);
+    }
+    unsigned char *p = *code;
+    jit_emit32(code, 0);
+    return p;
+}
+
+void jit_patch(unsigned char *p, const unsigned char *target)
+{
+    int rel = target - (p + 4);
+    memcpy(p, &rel, 4);
+}
+
+void jit_emit_exit(unsigned char **code, int cc)
+{
+    jit_patch(jit_emit_jump(code, cc), jit_code + JIT_EXIT);
+}
+
+// ADD R12, imm8
+void jit_emit_t_states(unsigned char **code, int t)
+{
+    if (t > 0)
+    {
+        jit_emit16(code, 0x8349);
+        jit_emit8(code, 0xC4);
+        jit_emit8(code, t);
+    }
+}
+
+// CMP R12, R13
+void jit_emit_deadline(unsigned char **code)
+{
+    jit_emit8(code, 0x4D);
+    jit_emit16(code, 0xEC39);
+}
+
+// CMP BYTE [jit_invalidated], 0
+void jit_emit_invalidated(unsigned char **code)
+{
+    jit_emit8(code, 0x80);
+    jit_emit_machine(code, 7, &jit_invalidated);
+    jit_emit8(code, 0x00);
+}
+
+// INC DWORD [jit_count], only -jit-check needs the number of instructions
+void jit_emit_count(unsigned char **code)
+{
+    if (jit_check)
+    {
+        jit_emit8(code, 0xFF);
+        jit_emit_machine(code, 0, &jit_count);
+    }
+}
+
+// z80_memory_refresh_by(n), every translated instruction refreshes once before the handler of a prefix
+// does its own refreshes, so n is also the number of instructions retired
+void jit_emit_refresh(unsigned char **code, int n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    jit_emit_load8(code, 0, &z80_reg_r);
+    // LEA ECX, [RAX + n]; AND ECX, 0x7F; AND EAX, 0x80; OR EAX, ECX
+    jit_emit16(code, 0x888D);
+    jit_emit32(code, n);
+    jit_emit8(code, 0x83);
+    jit_emit16(code, 0x7FE1);
+    jit_emit8(code, 0x25);
+    jit_emit32(code, MAX7);
+    jit_emit16(code, 0xC809);
+    jit_emit_store8(code, 0, &z80_reg_r);
+    // ADD QWORD [z80_instructions], n
+    jit_emit16(code, 0x8148);
+    jit_emit_machine(code, 0, &z80_instructions);
+    jit_emit32(code, n);
+}
+
+// register_store_flags(EDX, mask)
+void jit_emit_flags(unsigned char **code, int mask)
+{
+    // AND EDX, mask
+    jit_emit16(code, 0xE281);
+    jit_emit32(code, mask);
+    jit_emit_load8(code, 6, &z80_reg_af.bytes.low);
+    // AND ESI, ~mask; OR EDX, ESI
+    jit_emit16(code, 0xE681);
+    jit_emit32(code, ~(mask & MASK_FLAGS) & 0xFF);
+    jit_emit16(code, 0xF209);
+    jit_emit_store8(code, 2, &z80_reg_af.bytes.low);
+}
+
+// the slow side of a translated write, the page holds decoded or translated code
+void jit_write8(int address, int value)
 {
-    bool hl;
-    REG8 *alt = z80_decode_reg8(reg, 0, &hl);
-    switch (reg.byte_value)
-    {
-    case 0x00: // RLC r
-    case 0x01:
-    case 0x02:
-    case 0x03:
-    case 0x04:
-    case 0x05:
-    case 0x06:
-    case 0x07:
-        register_left8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-        return hl ? 15 : 8;
-    case 0x08: // RRC r
-    case 0x09:
-    case 0x0A:
-    case 0x0B:
-    case 0x0C:
-    case 0x0D:
-    case 0x0E:
-    case 0x0F:
-        register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX0));
-        return hl ? 15 : 8;
-    case 0x10: // RL r
-    case 0x11:
-    case 0x12:
-    case 0x13:
-    case 0x14:
-    case 0x15:
-    case 0x16:
-    case 0x17:
-        register_left8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-        return hl ? 15 : 8;
-    case 0x18: // RR r
-    case 0x19:
-    case 0x1A:
-    case 0x1B:
-    case 0x1C:
-    case 0x1D:
-    case 0x1E:
-    case 0x1F:
-        register_right8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-        return hl ? 15 : 8;
-    case 0x20: // SLA r
-    case 0x21:
-    case 0x22:
-    case 0x23:
-    case 0x24:
-    case 0x25:
-    case 0x26:
-    case 0x27:
-        register_left8_with_flags(alt, MASK_ALL, false);
-        return hl ? 15 : 8;
-    case 0x28: // SRA r
-    case 0x29:
-    case 0x2A:
-    case 0x2B:
-    case 0x2C:
-    case 0x2D:
-    case 0x2E:
-    case 0x2F:
-        register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-        return hl ? 15 : 8;
-    case 0x30: // SLL r
-    case 0x31:
-    case 0x32:
-    case 0x33:
-    case 0x34:
-    case 0x35:
-    case 0x36:
-    case 0x37:
-        register_left8_with_flags(alt, MASK_ALL, true);
-        return hl ? 15 : 8;
-    case 0x38: // SRL r
-    case 0x39:
-    case 0x3A:
-    case 0x3B:
-    case 0x3C:
-    case 0x3D:
-    case 0x3E:
-    case 0x3F:
-        register_right8_with_flags(alt, MASK_ALL, false);
-        return hl ? 15 : 8;
-    case 0x40: // BIT b,r
-    case 0x41:
-    case 0x42:
-    case 0x43:
-    case 0x44:
-    case 0x45:
-    case 0x46:
-    case 0x47:
-    case 0x48:
-    case 0x49:
-    case 0x4A:
-    case 0x4B:
-    case 0x4C:
-    case 0x4D:
-    case 0x4E:
-    case 0x4F:
-    case 0x50:
-    case 0x51:
-    case 0x52:
-    case 0x53:
-    case 0x54:
-    case 0x55:
-    case 0x56:
-    case 0x57:
-    case 0x58:
-    case 0x59:
-    case 0x5A:
-    case 0x5B:
-    case 0x5C:
-    case 0x5D:
-    case 0x5E:
-    case 0x5F:
-    case 0x60:
-    case 0x61:
-    case 0x62:
-    case 0x63:
-    case 0x64:
-    case 0x65:
-    case 0x66:
-    case 0x67:
-    case 0x68:
-    case 0x69:
-    case 0x6A:
-    case 0x6B:
-    case 0x6C:
-    case 0x6D:
-    case 0x6E:
-    case 0x6F:
-    case 0x70:
-    case 0x71:
-    case 0x72:
-    case 0x73:
-    case 0x74:
-    case 0x75:
-    case 0x76:
-    case 0x77:
-    case 0x78:
-    case 0x79:
-    case 0x7A:
-    case 0x7B:
-    case 0x7C:
-    case 0x7D:
-    case 0x7E:
-    case 0x7F:
-        register_set_or_unset_flag(FLAG_Z, !register_is_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07)));
-        register_set_or_unset_flag(FLAG_HC, true);
-        register_set_or_unset_flag(FLAG_N, false);
-        return hl ? 12 : 8;
-    case 0x80: // RES b,r
-    case 0x81:
-    case 0x82:
-    case 0x83:
-    case 0x84:
-    case 0x85:
-    case 0x86:
-    case 0x87:
-    case 0x88:
-    case 0x89:
-    case 0x8A:
-    case 0x8B:
-    case 0x8C:
-    case 0x8D:
-    case 0x8E:
-    case 0x8F:
-    case 0x90:
-    case 0x91:
-    case 0x92:
-    case 0x93:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0x97:
-    case 0x98:
-    case 0x99:
-    case 0x9A:
-    case 0x9B:
-    case 0x9C:
-    case 0x9D:
-    case 0x9E:
-    case 0x9F:
-    case 0xA0:
-    case 0xA1:
-    case 0xA2:
-    case 0xA3:
-    case 0xA4:
-    case 0xA5:
-    case 0xA6:
-    case 0xA7:
-    case 0xA8:
-    case 0xA9:
-    case 0xAA:
-    case 0xAB:
-    case 0xAC:
-    case 0xAD:
-    case 0xAE:
-    case 0xAF:
-    case 0xB0:
-    case 0xB1:
-    case 0xB2:
-    case 0xB3:
-    case 0xB4:
-    case 0xB5:
-    case 0xB6:
-    case 0xB7:
-    case 0xB8:
-    case 0xB9:
-    case 0xBA:
-    case 0xBB:
-    case 0xBC:
-    case 0xBD:
-    case 0xBE:
-    case 0xBF:
-        register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), false);
-        return hl ? 15 : 8;
-    case 0xC0: // SET b,r
-    case 0xC1:
-    case 0xC2:
-    case 0xC3:
-    case 0xC4:
-    case 0xC5:
-    case 0xC6:
-    case 0xC7:
-    case 0xC8:
-    case 0xC9:
-    case 0xCA:
-    case 0xCB:
-    case 0xCC:
-    case 0xCD:
-    case 0xCE:
-    case 0xCF:
-    case 0xD0:
-    case 0xD1:
-    case 0xD2:
-    case 0xD3:
-    case 0xD4:
-    case 0xD5:
-    case 0xD6:
-    case 0xD7:
-    case 0xD8:
-    case 0xD9:
-    case 0xDA:
-    case 0xDB:
-    case 0xDC:
-    case 0xDD:
-    case 0xDE:
-    case 0xDF:
-    case 0xE0:
-    case 0xE1:
-    case 0xE2:
-    case 0xE3:
-    case 0xE4:
-    case 0xE5:
-    case 0xE6:
-    case 0xE7:
-    case 0xE8:
-    case 0xE9:
-    case 0xEA:
-    case 0xEB:
-    case 0xEC:
-    case 0xED:
-    case 0xEE:
-    case 0xEF:
-    case 0xF0:
-    case 0xF1:
-    case 0xF2:
-    case 0xF3:
-    case 0xF4:
-    case 0xF5:
-    case 0xF6:
-    case 0xF7:
-    case 0xF8:
-    case 0xF9:
-    case 0xFA:
-    case 0xFB:
-    case 0xFC:
-    case 0xFD:
-    case 0xFE:
-    case 0xFF:
-        register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), true);
-        return hl ? 15 : 8;
-    default:
-        return 0; // fail
+    memory_invalidate(address);
+    memory[address].byte_value = value;
+}
+
+// memory_write8 with the address in EAX and the value in CL
+void jit_emit_write8(unsigned char **code)
+{
+    unsigned char *slow, *done;
+    // INC QWORD [memory_writes]
+    jit_emit16(code, 0xFF48);
+    jit_emit_machine(code, 0, &memory_writes);
+    // MOV EDX, EAX; SHR EDX, 8; CMP BYTE [RBX + RDX + memory_code_pages], 0
+    jit_emit16(code, 0xC289);
+    jit_emit8(code, 0xC1);
+    jit_emit16(code, 0x08EA);
+    jit_emit16(code, 0xBC80);
+    jit_emit8(code, 0x13);
+    jit_emit32(code, jit_offset(memory_code_pages));
+    jit_emit8(code, 0x00);
+    slow = jit_emit_jump(code, JIT_JNE);
+    // MOV [memory + RAX], CL
+    jit_emit8(code, 0x88);
+    jit_emit_memory(code, 1);
+    done = jit_emit_jump(code, JIT_JMP);
+    jit_patch(slow, *code);
+    // MOV EDI, EAX; MOVZX ESI, CL
+    jit_emit16(code, 0xC789);
+    jit_emit8(code, 0x0F);
+    jit_emit16(code, 0xF1B6);
+    jit_emit_call(code, jit_write8);
+    jit_patch(done, *code);
+}
+
+// INC EAX; AND EAX, 0xFFFF
+void jit_emit_next_address(unsigned char **code)
+{
+    jit_emit16(code, 0xC0FF);
+    jit_emit8(code, 0x25);
+    jit_emit32(code, 0xFFFF);
+}
+
+// loads register r of z80_all8 into reg, (HL) for 6
+void jit_emit_operand(unsigned char **code, int reg, int r)
+{
+    if (r == 6)
+    {
+        jit_emit_load16(code, 0, &z80_reg_hl);
+        jit_emit_read8(code, reg);
+    }
+    else
+    {
+        jit_emit_load8(code, reg, z80_all8[r]);
     }
 }
 
-int z80_execute_ed(REG8 reg)
+// z80_push16 of the register at reg, or of the value when reg is NULL
+void jit_emit_push(unsigned char **code, REG16 *reg, int value)
 {
-    bool c, hl;
-    div_t qr, qr_alt;
-    int mask = MASK_ALL;
-    REG8 *alt = NULL;
-    REG8 duplicate_a = z80_reg_af.bytes.high;
-    switch (reg.byte_value)
-    {
-    case 0x40: // IN r,(C)
-    case 0x48:
-    case 0x50:
-    case 0x58:
-    case 0x60:
-    case 0x68:
-    case 0x78:
-        alt = z80_decode_reg8(reg, 3, &hl);
-        *alt = port_read8(z80_reg_bc);
-        register_set_flag_s_z_p(*alt, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 12;
-    case 0x41: // OUT (C),r
-    case 0x49:
-    case 0x51:
-    case 0x59:
-    case 0x61:
-    case 0x69:
-    case 0x79:
-        port_write8(z80_reg_bc, *z80_decode_reg8(reg, 3, &hl));
-        return 12;
-    case 0x42: // SBC HL,ss
-    case 0x52:
-    case 0x62:
-    case 0x72:
-        c = register_is_flag(FLAG_C);
-        register_sub16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], mask);
-        if (c)
-        {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub16_with_flags(&z80_reg_hl, REG16_ONE, mask);
-        }
-        return 15;
-    case 0x43: // LD (nn),dd
-    case 0x53:
-    case 0x63:
-    case 0x73:
-        memory_write16(z80_next16(), *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03]);
-        return 20;
-    case 0x44: // NEG
-    case 0x4C:
-    case 0x54:
-    case 0x5C:
-    case 0x64:
-    case 0x6C:
-    case 0x74:
-    case 0x7C:
-        z80_reg_af.bytes.high.value = 0;
-        register_sub8_with_flags(&z80_reg_af.bytes.high, duplicate_a, MASK_ALL);
-        return 8;
-    case 0x45: // RETN
-    case 0x55:
-    case 0x5D:
-    case 0x65:
-    case 0x6D:
-    case 0x75:
-    case 0x7D:
-        z80_reg_pc = z80_pop16();
-        z80_iff1 = z80_iff2;
-        return 14;
-    case 0x46: // IM 0
-    case 0x4E:
-    case 0x66:
-    case 0x6E:
-        z80_imode = 0;
-        return 8;
-    case 0x47: // LD I,A
-        z80_reg_i = z80_reg_af.bytes.high;
-        return 9;
-    case 0x4A: // ADC HL,ss
-    case 0x5A:
-    case 0x6A:
-    case 0x7A:
-        c = register_is_flag(FLAG_C);
-        register_add16_with_flags(&z80_reg_hl, *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03], mask);
-        if (c)
-        {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add16_with_flags(&z80_reg_hl, REG16_ONE, mask);
-        }
-        return 15;
-    case 0x4B: // LD dd,(nn)
-    case 0x5B:
-    case 0x6B:
-    case 0x7B:
-        *z80_bc_de_hl_sp[reg.byte_value >> 4 & 0x03] = memory_read16(z80_next16());
-        return 20;
-    case 0x4D: // RETI
-        z80_reg_pc = z80_pop16();
-        return 14;
-    case 0x4F: // LD R,A
-        z80_reg_r = z80_reg_af.bytes.high;
-        return 9;
-    case 0x56: // IM 1
-    case 0x76:
-        z80_imode = 1;
-        return 8;
-    case 0x57: // LD A,I
-        z80_reg_af.bytes.high = z80_reg_i;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_PV, z80_iff2);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 9;
-    case 0x5E: // IM 2
-    case 0x7E:
-        z80_imode = 2;
-        return 8;
-    case 0x5F: // LD A,R
-        z80_reg_af.bytes.high = z80_reg_r;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_PV, z80_iff2);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 9;
-    case 0x67: // RRD
-        alt = memory_ref8(z80_reg_hl);
-        qr = register_split_8_to_4(*alt);
-        qr_alt = register_split_8_to_4(z80_reg_af.bytes.high);
-        register_set_8_from_4(&z80_reg_af.bytes.high, (div_t){.quot = qr_alt.quot, .rem = qr.rem});
-        register_set_8_from_4(alt, (div_t){.quot = qr_alt.rem, .rem = qr.quot});
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 18;
-    case 0x6F: // RLD
-        alt = memory_ref8(z80_reg_hl);
-        qr = register_split_8_to_4(*alt);
-        qr_alt = register_split_8_to_4(z80_reg_af.bytes.high);
-        register_set_8_from_4(&z80_reg_af.bytes.high, (div_t){.quot = qr_alt.quot, .rem = qr.quot});
-        register_set_8_from_4(alt, (div_t){.quot = qr.rem, .rem = qr_alt.rem});
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 18;
-    case 0x70: // IN 0,(C)
-        register_set_flag_s_z_p(*alt, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        return 12;
-    case 0x71: // OUT (C),0
-        port_write8(z80_reg_bc, (REG8){.value=0});
-        return 12;
-    case 0x77: // NOPD
-    case 0x7F:
-        return 8;
-    case 0xA0: // LDI & LDIR
-    case 0xB0:
-        memory_write8(z80_reg_de, memory_read8(z80_reg_hl));
-        z80_reg_de.value++;
-        z80_reg_hl.value++;
-        z80_reg_bc.value--;
-        register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        if (reg.byte_value == 0xB0 && register_is_flag(FLAG_PV))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xA1: // CPI & CPIR
-    case 0xB1:
-        register_sub8_with_flags(&duplicate_a, memory_read8(z80_reg_hl), MASK_ALL);
-        z80_reg_hl.value++;
-        z80_reg_bc.value--;
-        register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
-        if (reg.byte_value == 0xB1 && register_is_flag(FLAG_PV) && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xA2: // INI & INIR
-    case 0xB2:
-        memory_write8(z80_reg_hl, port_read8(z80_reg_bc));
-        z80_reg_bc.bytes.high.value--;
-        z80_reg_hl.value++;
-        register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
-        register_set_or_unset_flag(FLAG_N, true);
-        if (reg.byte_value == 0xB2 && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xA3: // OUTI & OTIR
-    case 0xB3:
-        z80_reg_bc.bytes.high.value--;
-        port_write8(z80_reg_bc, memory_read8(z80_reg_hl));
-        z80_reg_hl.value++;
-        register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
-        register_set_or_unset_flag(FLAG_N, true);
-        if (reg.byte_value == 0xB3 && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xA8: // LDD & LDDR
-    case 0xB8:
-        memory_write8(z80_reg_de, memory_read8(z80_reg_hl));
-        z80_reg_de.value--;
-        z80_reg_hl.value--;
-        z80_reg_bc.value--;
-        register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N, false);
-        if (reg.byte_value == 0xB8 && register_is_flag(FLAG_PV))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xA9: // CPD & CPDR
-    case 0xB9:
-        register_sub8_with_flags(&duplicate_a, memory_read8(z80_reg_hl), MASK_ALL);
-        z80_reg_hl.value--;
-        z80_reg_bc.value--;
-        register_set_or_unset_flag(FLAG_PV, z80_reg_bc.value != 0);
-        if (reg.byte_value == 0xB9 && register_is_flag(FLAG_PV) && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xAA: // IND & INDR
-    case 0xBA:
-        memory_write8(z80_reg_hl, port_read8(z80_reg_bc));
-        z80_reg_bc.bytes.high.value--;
-        z80_reg_hl.value--;
-        register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
-        register_set_or_unset_flag(FLAG_N, true);
-        if (reg.byte_value == 0xBA && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xAB: // OUTD & OTDR
-    case 0xBB:
-        z80_reg_bc.bytes.high.value--;
-        port_write8(z80_reg_bc, memory_read8(z80_reg_hl));
-        z80_reg_hl.value--;
-        register_set_or_unset_flag(FLAG_Z, register_is_zero(z80_reg_bc.bytes.high));
-        register_set_or_unset_flag(FLAG_N, true);
-        if (reg.byte_value == 0xBB && !register_is_flag(FLAG_Z))
-        {
-            z80_reg_pc.value -= 2;
-            return 21;
-        }
-        else
-        {
-            return 16;
-        }
-    case 0xCB:
-    case 0xDD:
-    case 0xED:
-    case 0xFD:
-    default:
-        return 0; // fail
+    // SUB WORD [SP], 2
+    jit_emit16(code, 0x8366);
+    jit_emit_machine(code, 5, &z80_reg_sp);
+    jit_emit8(code, 2);
+    jit_emit_load16(code, 0, &z80_reg_sp);
+    if (reg != NULL)
+    {
+        jit_emit_load8(code, 1, &reg->bytes.low);
+    }
+    else
+    {
+        jit_emit_mov_imm(code, 1, value & 0xFF);
     }
+    jit_emit_write8(code);
+    jit_emit_load16(code, 0, &z80_reg_sp);
+    jit_emit_next_address(code);
+    if (reg != NULL)
+    {
+        jit_emit_load8(code, 1, &reg->bytes.high);
+    }
+    else
+    {
+        jit_emit_mov_imm(code, 1, value >> 8 & 0xFF);
+    }
+    jit_emit_write8(code);
 }
 
-int z80_execute_dd_fd(REG8 reg, REG16 *other)
+// z80_pop16 into the register at reg
+void jit_emit_pop(unsigned char **code, REG16 *reg)
 {
-    bool c, hl;
-    int mask = MASK_ALL;
-    REG8 *alt;
-    REG8 duplicate_a = z80_reg_af.bytes.high;
-    REG16 *z80_bc_de___sp[] = {&z80_reg_bc, &z80_reg_de, other, &z80_reg_sp};
-    while (reg.byte_value == 0xDD || reg.byte_value == 0xFD)
-    {
-        reg = z80_fetch_opcode();
-    }
-    switch (reg.byte_value)
-    {
-    case 0x09: // ADD IX,pp
-    case 0x19:
-    case 0x29:
-    case 0x39:
-        register_add16_with_flags(other, *z80_bc_de___sp[reg.byte_value >> 4 & 0x03], MASK_HNC);
-        return 15;
-    case 0x21: // LD IX,nn
-        *other = z80_next16();
-        return 14;
-    case 0x22: // LD (nn),IX
-        memory_write16(z80_next16(), *other);
-        return 20;
-    case 0x23: // INC IX
-        register_add16_with_flags(other, REG16_ONE, MASK_NONE);
-        return 10;
-    case 0x24: // INC IXH
-        register_add8_with_flags(&other->bytes.high, REG8_ONE, MASK_SZHVN);
-        return 8;
-    case 0x25: // DEC IXH
-        register_sub8_with_flags(&other->bytes.high, REG8_ONE, MASK_SZHVN);
-        return 8;
-    case 0x26: // LD IXH,nn
-        other->bytes.high = z80_next8();
-        return 11;
-    case 0x2A: // LD IX,(nn)
-        *other = memory_read16(z80_next16());
-        return 20;
-    case 0x2B: // DEC IX
-        register_sub16_with_flags(other, REG16_ONE, MASK_NONE);
-        return 10;
-    case 0x2C: // INC IXL
-        register_add8_with_flags(&other->bytes.low, REG8_ONE, MASK_SZHVN);
-        return 8;
-    case 0x2D: // DEC IXL
-        register_sub8_with_flags(&other->bytes.low, REG8_ONE, MASK_SZHVN);
-        return 8;
-    case 0x2E: // LD IXL,nn
-        other->bytes.low = z80_next8();
-        return 11;
-    case 0x34: // INC (IX+d)
-        register_add8_with_flags(memory_ref8_indexed(*other, z80_next8()), REG8_ONE, MASK_SZHVN);
-        return 23;
-    case 0x35: // DEC (IX+d)
-        register_sub8_with_flags(memory_ref8_indexed(*other, z80_next8()), REG8_ONE, MASK_SZHVN);
-        return 23;
-    case 0x36: // LD (IX+d),n
-        duplicate_a = z80_next8();
-        memory_write8_indexed(*other, duplicate_a, z80_next8());
-        return 19;
-    case 0x44: // LD r,IXH
-    case 0x4C:
-    case 0x54:
-    case 0x5C:
-    case 0x7C:
-        *z80_decode_reg8(reg, 3, &hl) = other->bytes.high;
-        return 8;
-    case 0x45: //LD r,IXL
-    case 0x4D:
-    case 0x55:
-    case 0x5D:
-    case 0x7D:
-        *z80_decode_reg8(reg, 3, &hl) = other->bytes.low;
-        return 8;
-    case 0x46: // LD r,(IX+d)
-    case 0x4E:
-    case 0x56:
-    case 0x5E:
-    case 0x66:
-    case 0x6E:
-    case 0x7E:
-        *z80_decode_reg8(reg, 3, &hl) = memory_read8_indexed(*other, z80_next8());
-        return 19;
-    case 0x60: // LD IXH,r
-    case 0x61:
-    case 0x62:
-    case 0x63:
-    case 0x67:
-        other->bytes.high = *z80_decode_reg8(reg, 0, &hl);
-        return 8;
-    case 0x64: // LD IXH,IXH
-        return 8;
-    case 0x65: // LD IXH,IXL
-        other->bytes.high = other->bytes.low;
-        return 8;
-    case 0x68: //LD IXL,r
-    case 0x69:
-    case 0x6A:
-    case 0x6B:
-    case 0x6F:
-        other->bytes.low = *z80_decode_reg8(reg, 0, &hl);
-        return 8;
-    case 0x6C: //LD IXL,IXH
-        other->bytes.low = other->bytes.high;
-        return 8;
-    case 0x6D: //LD IXL,IXL
-        return 8;
-    case 0x70: // LD (IX+d),r
-    case 0x71:
-    case 0x72:
-    case 0x73:
-    case 0x74:
-    case 0x75:
-    case 0x77:
-        alt = z80_decode_reg8(reg, 0, &hl);
-        memory_write8_indexed(*other, z80_next8(), *alt);
-        return 19;
-    case 0x84: // ADD A,IXH
-        register_add8_with_flags(&z80_reg_af.bytes.high, other->bytes.high, MASK_ALL);
-        return 8;
-    case 0x85: // ADD A,IXL
-        register_add8_with_flags(&z80_reg_af.bytes.high, other->bytes.low, MASK_ALL);
-        return 8;
-    case 0x86: // ADD A,(IX+d)
-        register_add8_with_flags(&z80_reg_af.bytes.high, memory_read8_indexed(*other, z80_next8()), MASK_ALL);
-        return 19;
-    case 0x8C: // ADC A,IXH
-        c = register_is_flag(FLAG_C);
-        register_add8_with_flags(&z80_reg_af.bytes.high, other->bytes.high, mask);
-        if (c)
+    jit_emit_load16(code, 0, &z80_reg_sp);
+    jit_emit_read8(code, 1);
+    jit_emit_store8(code, 1, &reg->bytes.low);
+    jit_emit_next_address(code);
+    jit_emit_read8(code, 1);
+    jit_emit_store8(code, 1, &reg->bytes.high);
+    // ADD WORD [SP], 2
+    jit_emit16(code, 0x8366);
+    jit_emit_machine(code, 0, &z80_reg_sp);
+    jit_emit8(code, 2);
+}
+
+void jit_emit_exchange16(unsigned char **code, REG16 *reg, REG16 *alt)
+{
+    jit_emit_load16(code, 0, reg);
+    jit_emit_load16(code, 1, alt);
+    jit_emit_store16(code, 0, alt);
+    jit_emit_store16(code, 1, reg);
+}
+
+// ADD ADC SUB SBC AND XOR OR CP of A and ECX, the flags come from the same tables as the interpreter's
+void jit_emit_alu(unsigned char **code, int k)
+{
+    bool c = (k == 1 || k == 3);
+    jit_emit_load8(code, 0, &z80_reg_af.bytes.high);
+    if (k >= 4 && k <= 6)
+    {
+        // AND EAX, ECX / XOR EAX, ECX / OR EAX, ECX
+        jit_emit16(code, k == 4 ? 0xC821 : k == 5 ? 0xC831 : 0xC809);
+        jit_emit_store8(code, 0, &z80_reg_af.bytes.high);
+        jit_emit_lookup(code, register_szp_flags, 0);
+        if (k == 4)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            // OR EDX, FLAG_HC
+            jit_emit16(code, 0xCA83);
+            jit_emit8(code, FLAG_HC);
         }
-        return 8;
-    case 0x8D: // ADC A,IXL
-        c = register_is_flag(FLAG_C);
-        register_add8_with_flags(&z80_reg_af.bytes.high, other->bytes.low, mask);
+    }
+    else
+    {
         if (c)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            // EDI = carry
+            jit_emit_load8(code, 7, &z80_reg_af.bytes.low);
+            jit_emit16(code, 0xE783);
+            jit_emit8(code, FLAG_C);
         }
-        return 8;
-    case 0x8E: // ADC A,(IX+d)
-        c = register_is_flag(FLAG_C);
-        register_add8_with_flags(&z80_reg_af.bytes.high, memory_read8_indexed(*other, z80_next8()), mask);
+        // MOV ESI, EAX; SHL ESI, 8; OR ESI, ECX
+        jit_emit16(code, 0xC689);
+        jit_emit8(code, 0xC1);
+        jit_emit16(code, 0x08E6);
+        jit_emit16(code, 0xCE09);
         if (c)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_add8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            // MOV EDX, EDI; SHL EDX, 16; OR ESI, EDX
+            jit_emit16(code, 0xFA89);
+            jit_emit8(code, 0xC1);
+            jit_emit16(code, 0x10E2);
+            jit_emit16(code, 0xD609);
         }
-        return 19;
-    case 0x94: // SUB A,IXH
-        register_sub8_with_flags(&z80_reg_af.bytes.high, other->bytes.high, MASK_ALL);
-        return 8;
-    case 0x95: // SUB A,IXL
-        register_sub8_with_flags(&z80_reg_af.bytes.high, other->bytes.low, MASK_ALL);
-        return 8;
-    case 0x96: // SUB (IX+d)
-        register_sub8_with_flags(&z80_reg_af.bytes.high, memory_read8_indexed(*other, z80_next8()), MASK_ALL);
-        return 19;
-    case 0x9C: // SBC A,IXH
-        c = register_is_flag(FLAG_C);
-        register_sub8_with_flags(&z80_reg_af.bytes.high, other->bytes.high, mask);
-        if (c)
+        jit_emit_lookup(code, k <= 1 ? register_add8_flags : register_sub8_flags, 6);
+        if (k != 7)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            // ADD EAX, ECX / SUB EAX, ECX
+            jit_emit16(code, k <= 1 ? 0xC801 : 0xC829);
+            if (c)
+            {
+                // ADD EAX, EDI / SUB EAX, EDI
+                jit_emit16(code, k <= 1 ? 0xF801 : 0xF829);
+            }
+            jit_emit_store8(code, 0, &z80_reg_af.bytes.high);
         }
-        return 8;
-    case 0x9D: // SBC A,IXL
-        c = register_is_flag(FLAG_C);
-        register_sub8_with_flags(&z80_reg_af.bytes.high, other->bytes.low, mask);
-        if (c)
+    }
+    jit_emit_flags(code, MASK_ALL);
+}
+
+// INC r or DEC r, (HL) for 6
+void jit_emit_inc_dec(unsigned char **code, int r, bool dec)
+{
+    jit_emit_operand(code, 1, r);
+    jit_emit_lookup(code, dec ? register_dec8_flags : register_inc8_flags, 1);
+    // INC ECX / DEC ECX
+    jit_emit16(code, dec ? 0xC9FF : 0xC1FF);
+    jit_emit_flags(code, MASK_SZHVN);
+    if (r == 6)
+    {
+        jit_emit_write8(code);
+    }
+    else
+    {
+        jit_emit_store8(code, 1, z80_all8[r]);
+    }
+}
+
+// ADD HL,ss sets H from the carry out of bit 11 and C from the carry out of bit 15
+void jit_emit_add_hl(unsigned char **code, REG16 *reg)
+{
+    jit_emit_load16(code, 0, &z80_reg_hl);
+    jit_emit_load16(code, 1, reg);
+    // MOV EDX, EAX; AND EDX, 0xFFF; MOV ESI, ECX; AND ESI, 0xFFF
+    jit_emit16(code, 0xC289);
+    jit_emit16(code, 0xE281);
+    jit_emit32(code, 0xFFF);
+    jit_emit16(code, 0xCE89);
+    jit_emit16(code, 0xE681);
+    jit_emit32(code, 0xFFF);
+    // ADD EDX, ESI; SHR EDX, 8; AND EDX, FLAG_HC
+    jit_emit16(code, 0xF201);
+    jit_emit8(code, 0xC1);
+    jit_emit16(code, 0x08EA);
+    jit_emit16(code, 0xE283);
+    jit_emit8(code, FLAG_HC);
+    // ADD EAX, ECX; MOV ESI, EAX; SHR ESI, 16; OR EDX, ESI
+    jit_emit16(code, 0xC801);
+    jit_emit16(code, 0xC689);
+    jit_emit8(code, 0xC1);
+    jit_emit16(code, 0x10EE);
+    jit_emit16(code, 0xF209);
+    jit_emit_store16(code, 0, &z80_reg_hl);
+    jit_emit_flags(code, MASK_HNC);
+}
+
+// TEST BYTE [F], flag, then the jump taken when condition i does not hold
+unsigned char *jit_emit_unless(unsigned char **code, int i)
+{
+    jit_emit8(code, 0xF6);
+    jit_emit_machine(code, 0, &z80_reg_af.bytes.low);
+    jit_emit8(code, z80_condition_flags[i]);
+    return jit_emit_jump(code, (i & 0x01) ? JIT_JE : JIT_JNE);
+}
+
+void jit_flags_materialize()
+{
+    register_flags_materialize();
+}
+
+// ends an instruction that did not branch, an exit stub stores PC and R when
+// it wrote over translated code or reached the deadline
+void jit_emit_next(JITCOMPILER *jit, int t, int length, bool writes)
+{
+    JITEXIT *exit;
+    jit_emit_t_states(&jit->code, t);
+    jit_emit_count(&jit->code);
+    jit->pc.byte_value += length;
+    exit = &jit->exits[jit->exits_size++];
+    *exit = (JITEXIT){.pc = jit->pc, .refresh = jit->refresh};
+    if (writes)
+    {
+        jit_emit_invalidated(&jit->code);
+        exit->jumps[0] = jit_emit_jump(&jit->code, JIT_JNE);
+    }
+    jit_emit_deadline(&jit->code);
+    exit->jumps[1] = jit_emit_jump(&jit->code, JIT_JAE);
+}
+
+// continues in the block at PC, target -1 when it is only known at run time, or returns to z80_run when
+// the deadline has passed or there is no block there yet; -jit-check compares every block on its own
+void jit_emit_link(JITCOMPILER *jit, int target)
+{
+    unsigned char **code = &jit->code;
+    if (jit_check)
+    {
+        jit_emit_exit(code, JIT_JMP);
+        return;
+    }
+    jit_emit_deadline(code);
+    jit_emit_exit(code, JIT_JAE);
+    if (target == jit->block.byte_value)
+    {
+        jit_patch(jit_emit_jump(code, JIT_JMP), jit->start);
+        return;
+    }
+    if (target < 0)
+    {
+        // MOV RAX, [RBX + RAX * 8 + jit_blocks]
+        jit_emit_load16(code, 0, &z80_reg_pc);
+        jit_emit32(code, 0xC3848B48);
+        jit_emit32(code, jit_offset(jit_blocks));
+    }
+    else
+    {
+        // MOV RAX, [jit_blocks + target]
+        jit_emit16(code, 0x8B48);
+        jit_emit_machine(code, 0, &jit_blocks[target]);
+    }
+    // TEST RAX, RAX; JZ exit; JMP [RAX]
+    jit_emit8(code, 0x48);
+    jit_emit16(code, 0xC085);
+    jit_emit_exit(code, JIT_JE);
+    jit_emit16(code, 0x20FF);
+}
+
+// the taken side of a branch to target, the code after it is the side not taken
+void jit_emit_branch(JITCOMPILER *jit, int t, int target, bool writes)
+{
+    jit_emit_t_states(&jit->code, t);
+    jit_emit_count(&jit->code);
+    jit_emit_refresh(&jit->code, jit->refresh);
+    if (target >= 0)
+    {
+        jit_emit_store16_imm(&jit->code, &z80_reg_pc, target);
+    }
+    if (writes)
+    {
+        jit_emit_invalidated(&jit->code);
+        jit_emit_exit(&jit->code, JIT_JNE);
+    }
+    jit_emit_link(jit, target);
+}
+
+// everything that is not translated runs through its interpreter handler, the handlers of the prefixes
+// fetch the rest of the instruction themselves
+bool jit_emit_handler(JITCOMPILER *jit, int op, int length)
+{
+    unsigned char **code = &jit->code;
+    jit_emit_refresh(code, jit->refresh);
+    jit->refresh = 0;
+    jit_emit_store16_imm(code, &z80_reg_pc, jit->pc.byte_value + 1);
+    // MOV [z80_t_states_all], R12
+    jit_emit16(code, 0x894C);
+    jit_emit_machine(code, 4, &z80_t_states_all);
+    jit_emit_mov_imm(code, 7, op);
+    jit_emit_call(code, z80_ops[op]);
+    // MOV EAX, EAX; ADD R12, RAX
+    jit_emit16(code, 0xC089);
+    jit_emit8(code, 0x49);
+    jit_emit16(code, 0xC401);
+    if (register_lazy)
+    {
+        jit_emit_call(code, jit_flags_materialize);
+    }
+    if (op == 0x76 || op == 0xF3 || op == 0xFB)
+    {
+        // HALT, DI and EI go back to z80_run for the interrupts
+        jit_emit_count(code);
+        jit_emit_exit(code, JIT_JMP);
+        return false;
+    }
+    if (z80_ends_block(jit->pc))
+    {
+        jit_emit_branch(jit, 0, -1, true);
+        return false;
+    }
+    jit_emit_next(jit, 0, length, true);
+    return true;
+}
+
+// translates the instruction at the PC of the block, returns false once the block has ended
+bool jit_emit_instruction(JITCOMPILER *jit, int length)
+{
+    unsigned char **code = &jit->code;
+    unsigned char *skip;
+    int op = memory_read8(jit->pc).byte_value;
+    int r = op >> 3 & 0x07, s = op & 0x07, rr = op >> 4 & 0x03;
+    REG8 n = memory_read8((REG16){.byte_value = jit->pc.byte_value + 1});
+    REG16 nn = memory_read16((REG16){.byte_value = jit->pc.byte_value + 1});
+    int next = (jit->pc.byte_value + length) & 0xFFFF;
+    int relative = (next + n.value) & 0xFFFF;
+    jit->refresh++;
+    if (op == 0x00)
+    {
+        // NOP
+        jit_emit_next(jit, 4, length, false);
+    }
+    else if ((op & 0xCF) == 0x01)
+    {
+        // LD dd,nn
+        jit_emit_store16_imm(code, z80_bc_de_hl_sp[rr], nn.byte_value);
+        jit_emit_next(jit, 10, length, false);
+    }
+    else if (op == 0x02 || op == 0x12)
+    {
+        // LD (BC),A / LD (DE),A
+        jit_emit_load8(code, 1, &z80_reg_af.bytes.high);
+        jit_emit_load16(code, 0, z80_bc_de_hl_sp[rr]);
+        jit_emit_write8(code);
+        jit_emit_next(jit, 7, length, true);
+    }
+    else if ((op & 0xC7) == 0x03)
+    {
+        // INC ss / DEC ss
+        jit_emit16(code, 0xFF66);
+        jit_emit_machine(code, (op & 0x08) ? 1 : 0, z80_bc_de_hl_sp[rr]);
+        jit_emit_next(jit, 6, length, false);
+    }
+    else if ((op & 0xC6) == 0x04)
+    {
+        // INC r / DEC r / INC (HL) / DEC (HL)
+        jit_emit_inc_dec(code, r, op & 0x01);
+        jit_emit_next(jit, r == 6 ? 11 : 4, length, r == 6);
+    }
+    else if ((op & 0xC7) == 0x06)
+    {
+        // LD r,n / LD (HL),n
+        if (r == 6)
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            jit_emit_mov_imm(code, 1, n.byte_value);
+            jit_emit_load16(code, 0, &z80_reg_hl);
+            jit_emit_write8(code);
         }
-        return 8;
-    case 0x9E: // SBC (IX+d)
-        c = register_is_flag(FLAG_C);
-        register_sub8_with_flags(&z80_reg_af.bytes.high, memory_read8_indexed(*other, z80_next8()), mask);
-        if (c)
+        else
         {
-            mask = MASK_ALL & ~(z80_reg_af.bytes.low.byte_value & MASK_HVNC);
-            register_sub8_with_flags(&z80_reg_af.bytes.high, REG8_ONE, mask);
+            jit_emit_store8_imm(code, z80_all8[r], n.byte_value);
         }
-        return 19;
-    case 0xA4: // AND IXH
-        z80_reg_af.bytes.high.byte_value &= other->bytes.high.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_N | FLAG_C, false);
-        register_set_or_unset_flag(FLAG_HC, true);
-        return 8;
-    case 0xA5: // AND IXL
-        z80_reg_af.bytes.high.byte_value &= other->bytes.low.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_N | FLAG_C, false);
-        register_set_or_unset_flag(FLAG_HC, true);
-        return 8;
-    case 0xA6: // AND (IX+d)
-        z80_reg_af.bytes.high.byte_value &= memory_read8_indexed(*other, z80_next8()).byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_N | FLAG_C, false);
-        register_set_or_unset_flag(FLAG_HC, true);
-        return 19;
-    case 0xAC: // XOR IXH
-        z80_reg_af.bytes.high.byte_value ^= other->bytes.high.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 8;
-    case 0xAD: // XOR IXL
-        z80_reg_af.bytes.high.byte_value ^= other->bytes.low.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 8;
-    case 0xAE: // XOR (IX+d)
-        z80_reg_af.bytes.high.byte_value ^= memory_read8_indexed(*other, z80_next8()).byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 19;
-    case 0xB4: // OR IXH
-        z80_reg_af.bytes.high.byte_value |= other->bytes.high.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 8;
-    case 0xB5: // OR IXL
-        z80_reg_af.bytes.high.byte_value |= other->bytes.low.byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 8;
-    case 0xB6: // OR (IX+d)
-        z80_reg_af.bytes.high.byte_value |= memory_read8_indexed(*other, z80_next8()).byte_value;
-        register_set_flag_s_z_p(z80_reg_af.bytes.high, MASK_ALL);
-        register_set_or_unset_flag(FLAG_HC | FLAG_N | FLAG_C, false);
-        return 19;
-    case 0xBC: // CP IXH
-        register_sub8_with_flags(&duplicate_a, other->bytes.high, MASK_ALL);
-        return 8;
-    case 0xBD: // CP IXL
-        register_sub8_with_flags(&duplicate_a, other->bytes.low, MASK_ALL);
-        return 8;
-    case 0xBE: // CP (IX+d)
-        register_sub8_with_flags(&duplicate_a, memory_read8_indexed(*other, z80_next8()), MASK_ALL);
-        return 19;
-    case 0xCB: // DDCB
-        alt = memory_ref8_indexed(*other, z80_next8());
-        reg = z80_next8();
-        switch (reg.byte_value)
+        jit_emit_next(jit, r == 6 ? 10 : 7, length, r == 6);
+    }
+    else if (op == 0x08)
+    {
+        // EX AF,AF'
+        jit_emit_exchange16(code, &z80_reg_af, &z80_reg_af_2);
+        jit_emit_next(jit, 4, length, false);
+    }
+    else if ((op & 0xCF) == 0x09)
+    {
+        // ADD HL,ss
+        jit_emit_add_hl(code, z80_bc_de_hl_sp[rr]);
+        jit_emit_next(jit, 11, length, false);
+    }
+    else if (op == 0x0A || op == 0x1A)
+    {
+        // LD A,(BC) / LD A,(DE)
+        jit_emit_load16(code, 0, z80_bc_de_hl_sp[rr]);
+        jit_emit_read8(code, 1);
+        jit_emit_store8(code, 1, &z80_reg_af.bytes.high);
+        jit_emit_next(jit, 7, length, false);
+    }
+    else if (op == 0x10 && n.value != -2)
+    {
+        // DJNZ e, DJNZ $ counts down in its handler
+        jit_emit8(code, 0xFE);
+        jit_emit_machine(code, 1, &z80_reg_bc.bytes.high);
+        skip = jit_emit_jump(code, JIT_JE);
+        jit_emit_branch(jit, 13, relative, false);
+        jit_patch(skip, *code);
+        jit_emit_next(jit, 8, length, false);
+    }
+    else if (op == 0x18)
+    {
+        // JR e
+        jit_emit_branch(jit, 12, relative, false);
+        return false;
+    }
+    else if ((op & 0xE7) == 0x20)
+    {
+        // JR cc,e
+        skip = jit_emit_unless(code, r & 0x03);
+        jit_emit_branch(jit, 12, relative, false);
+        jit_patch(skip, *code);
+        jit_emit_next(jit, 7, length, false);
+    }
+    else if (op == 0x22)
+    {
+        // LD (nn),HL
+        jit_emit_load8(code, 1, &z80_reg_hl.bytes.low);
+        jit_emit_mov_imm(code, 0, nn.byte_value);
+        jit_emit_write8(code);
+        jit_emit_load8(code, 1, &z80_reg_hl.bytes.high);
+        jit_emit_mov_imm(code, 0, (nn.byte_value + 1) & 0xFFFF);
+        jit_emit_write8(code);
+        jit_emit_next(jit, 16, length, true);
+    }
+    else if (op == 0x2A)
+    {
+        // LD HL,(nn)
+        jit_emit_mov_imm(code, 0, nn.byte_value);
+        jit_emit_read8(code, 1);
+        jit_emit_store8(code, 1, &z80_reg_hl.bytes.low);
+        jit_emit_mov_imm(code, 0, (nn.byte_value + 1) & 0xFFFF);
+        jit_emit_read8(code, 1);
+        jit_emit_store8(code, 1, &z80_reg_hl.bytes.high);
+        jit_emit_next(jit, 16, length, false);
+    }
+    else if (op == 0x32)
+    {
+        // LD (nn),A
+        jit_emit_load8(code, 1, &z80_reg_af.bytes.high);
+        jit_emit_mov_imm(code, 0, nn.byte_value);
+        jit_emit_write8(code);
+        jit_emit_next(jit, 13, length, true);
+    }
+    else if (op == 0x3A)
+    {
+        // LD A,(nn)
+        jit_emit_mov_imm(code, 0, nn.byte_value);
+        jit_emit_read8(code, 1);
+        jit_emit_store8(code, 1, &z80_reg_af.bytes.high);
+        jit_emit_next(jit, 13, length, false);
+    }
+    else if ((op & 0xC0) == 0x40 && op != 0x76)
+    {
+        // LD r,r / LD r,(HL) / LD (HL),r
+        jit_emit_operand(code, 1, s);
+        if (r == 6)
         {
-        case 0x00: // LD r,RLC (IX+d)
-        case 0x01:
-        case 0x02:
-        case 0x03:
-        case 0x04:
-        case 0x05:
-        case 0x07:
-            register_left8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x06: // RLC (IX+d)
-            register_left8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-            return 23;
-        case 0x08: // LD r,RRC (IX+d)
-        case 0x09:
-        case 0x0A:
-        case 0x0B:
-        case 0x0C:
-        case 0x0D:
-        case 0x0F:
-            register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX0));
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x0E: // RRC (IX+d)
-            register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX0));
-            return 23;
-        case 0x10: // LD r,RL (IX+d)
-        case 0x11:
-        case 0x12:
-        case 0x13:
-        case 0x14:
-        case 0x15:
-        case 0x17:
-            register_left8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x16: // RL (IX+d)
-            register_left8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-            return 23;
-        case 0x18: // LD r,RR (IX+d)
-        case 0x19:
-        case 0x1A:
-        case 0x1B:
-        case 0x1C:
-        case 0x1D:
-        case 0x1F:
-            register_right8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x1E: // RR (IX+d)
-            register_right8_with_flags(alt, MASK_ALL, register_is_flag(FLAG_C));
-            return 23;
-        case 0x20: // LD r,SLA (IX+d)
-        case 0x21:
-        case 0x22:
-        case 0x23:
-        case 0x24:
-        case 0x25:
-        case 0x27:
-            register_left8_with_flags(alt, MASK_ALL, false);
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x26: // SLA (IX+d)
-            register_left8_with_flags(alt, MASK_ALL, false);
-            return 23;
-        case 0x28: // LD r,SRA (IX+d)
-        case 0x29:
-        case 0x2A:
-        case 0x2B:
-        case 0x2C:
-        case 0x2D:
-        case 0x2F:
-            register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x2E: // SRA (IX+d)
-            register_right8_with_flags(alt, MASK_ALL, register_is_bit(*alt, MAX7));
-            return 23;
-        case 0x30: // LD r,SLL (IX+d)
-        case 0x31:
-        case 0x32:
-        case 0x33:
-        case 0x34:
-        case 0x35:
-        case 0x37:
-            register_left8_with_flags(alt, MASK_ALL, true);
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x36: // SLL (IX+d)
-            register_left8_with_flags(alt, MASK_ALL, true);
-            return 23;
-        case 0x38: // LD r,SRL (IX+d)
-        case 0x39:
-        case 0x3A:
-        case 0x3B:
-        case 0x3C:
-        case 0x3D:
-        case 0x3F:
-            register_right8_with_flags(alt, MASK_ALL, false);
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x3E: // SRL (IX+d)
-            register_right8_with_flags(alt, MASK_ALL, false);
-            return 23;
-        case 0x46: // BIT b,(IX+d)
-        case 0x4E:
-        case 0x56:
-        case 0x5E:
-        case 0x66:
-        case 0x6E:
-        case 0x76:
-        case 0x7E:
-            register_set_or_unset_flag(FLAG_Z, !register_is_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07)));
-            register_set_or_unset_flag(FLAG_HC, true);
-            register_set_or_unset_flag(FLAG_N, false);
-            return 20;
-        case 0x80: // LD r,RES b,(IX+d)
-        case 0x81:
-        case 0x82:
-        case 0x83:
-        case 0x84:
-        case 0x85:
-        case 0x87:
-        case 0x88:
-        case 0x89:
-        case 0x8A:
-        case 0x8B:
-        case 0x8C:
-        case 0x8D:
-        case 0x8F:
-        case 0x90:
-        case 0x91:
-        case 0x92:
-        case 0x93:
-        case 0x94:
-        case 0x95:
-        case 0x97:
-        case 0x98:
-        case 0x99:
-        case 0x9A:
-        case 0x9B:
-        case 0x9C:
-        case 0x9D:
-        case 0x9F:
-        case 0xA0:
-        case 0xA1:
-        case 0xA2:
-        case 0xA3:
-        case 0xA4:
-        case 0xA5:
-        case 0xA7:
-        case 0xA8:
-        case 0xA9:
-        case 0xAA:
-        case 0xAB:
-        case 0xAC:
-        case 0xAD:
-        case 0xAF:
-        case 0xB0:
-        case 0xB1:
-        case 0xB2:
-        case 0xB3:
-        case 0xB4:
-        case 0xB5:
-        case 0xB7:
-        case 0xB8:
-        case 0xB9:
-        case 0xBA:
-        case 0xBB:
-        case 0xBC:
-        case 0xBD:
-        case 0xBF:
-            register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), false);
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0x86: // RES b,(IX+d)
-        case 0x8E:
-        case 0x96:
-        case 0x9E:
-        case 0xA6:
-        case 0xAE:
-        case 0xB6:
-        case 0xBE:
-            register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), false);
-            return 23;
-        case 0xC0: // LD r,SET b,(IX+d)
-        case 0xC1:
-        case 0xC2:
-        case 0xC3:
-        case 0xC4:
-        case 0xC5:
-        case 0xC7:
-        case 0xC8:
-        case 0xC9:
-        case 0xCA:
-        case 0xCB:
-        case 0xCC:
-        case 0xCD:
-        case 0xCF:
-        case 0xD0:
-        case 0xD1:
-        case 0xD2:
-        case 0xD3:
-        case 0xD4:
-        case 0xD5:
-        case 0xD7:
-        case 0xD8:
-        case 0xD9:
-        case 0xDA:
-        case 0xDB:
-        case 0xDC:
-        case 0xDD:
-        case 0xDF:
-        case 0xE0:
-        case 0xE1:
-        case 0xE2:
-        case 0xE3:
-        case 0xE4:
-        case 0xE5:
-        case 0xE7:
-        case 0xE8:
-        case 0xE9:
-        case 0xEA:
-        case 0xEB:
-        case 0xEC:
-        case 0xED:
-        case 0xEF:
-        case 0xF0:
-        case 0xF1:
-        case 0xF2:
-        case 0xF3:
-        case 0xF4:
-        case 0xF5:
-        case 0xF7:
-        case 0xF8:
-        case 0xF9:
-        case 0xFA:
-        case 0xFB:
-        case 0xFC:
-        case 0xFD:
-        case 0xFF:
-            register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), true);
-            *z80_decode_reg8(reg, 0, &hl) = *alt;
-            return 23;
-        case 0xC6: // SET b,(IX+d)
-        case 0xCE:
-        case 0xD6:
-        case 0xDE:
-        case 0xE6:
-        case 0xEE:
-        case 0xF6:
-        case 0xFE:
-            register_set_or_unset_bit(*alt, 0x01 << (reg.byte_value >> 3 & 0x07), true);
-            return 23;
-        default:
-            return 0; // fail
+            jit_emit_load16(code, 0, &z80_reg_hl);
+            jit_emit_write8(code);
         }
-    case 0xE1: // POP IX
-        *other = z80_pop16();
-        return 14;
-    case 0xE3: // EX (SP),IX
-        register_exchange16(other, memory_ref16(z80_reg_sp));
-        return 23;
-    case 0xE5: // PUSH IX
-        z80_push16(*other);
-        return 15;
-    case 0xE9: // JP (IX)
-        z80_reg_pc = *other;
-        return 8;
-    case 0xED:
-        return 0; // fail
-    case 0xF9: // LD SP,IX
-        z80_reg_sp = *other;
-        return 10;
-    default:
-        return z80_execute_simple(reg);
+        else
+        {
+            jit_emit_store8(code, 1, z80_all8[r]);
+        }
+        jit_emit_next(jit, (r == 6 || s == 6) ? 7 : 4, length, r == 6);
     }
-}
-
-int z80_execute(REG8 reg)
-{
-    if (z80_halt)
+    else if ((op & 0xC0) == 0x80 || (op & 0xC7) == 0xC6)
     {
-        reg.byte_value = 0x00;
-        z80_reg_pc.byte_value--;
+        // ALU A,r / ALU A,(HL) / ALU A,n
+        if ((op & 0xC0) == 0x80)
+        {
+            jit_emit_operand(code, 1, s);
+        }
+        else
+        {
+            jit_emit_mov_imm(code, 1, n.byte_value);
+        }
+        jit_emit_alu(code, r);
+        jit_emit_next(jit, ((op & 0xC0) == 0x80 && s != 6) ? 4 : 7, length, false);
     }
-    switch (reg.byte_value)
+    else if (op == 0xC9)
     {
-    case 0xCB: // CB
-        return z80_execute_cb(z80_fetch_opcode());
-    case 0xDD: // DD
-        return z80_execute_dd_fd(z80_fetch_opcode(), &z80_reg_ix);
-    case 0xFD: // FD
-        return z80_execute_dd_fd(z80_fetch_opcode(), &z80_reg_iy);
-    case 0xED: // ED
-        return z80_execute_ed(z80_fetch_opcode());
-    default:
-        return z80_execute_simple(reg);
+        // RET
+        jit_emit_pop(code, &z80_reg_pc);
+        jit_emit_branch(jit, 10, -1, false);
+        return false;
+    }
+    else if ((op & 0xC7) == 0xC0)
+    {
+        // RET cc
+        skip = jit_emit_unless(code, r);
+        jit_emit_pop(code, &z80_reg_pc);
+        jit_emit_branch(jit, 11, -1, false);
+        jit_patch(skip, *code);
+        jit_emit_next(jit, 5, length, false);
+    }
+    else if ((op & 0xCF) == 0xC1)
+    {
+        // POP qq
+        jit_emit_pop(code, z80_bc_de_hl_af[rr]);
+        jit_emit_next(jit, 10, length, false);
+    }
+    else if ((op & 0xCF) == 0xC5)
+    {
+        // PUSH qq
+        jit_emit_push(code, z80_bc_de_hl_af[rr], 0);
+        jit_emit_next(jit, 11, length, true);
+    }
+    else if (op == 0xC3)
+    {
+        // JP nn
+        jit_emit_branch(jit, 10, nn.byte_value, false);
+        return false;
+    }
+    else if ((op & 0xC7) == 0xC2)
+    {
+        // JP cc,nn
+        skip = jit_emit_unless(code, r);
+        jit_emit_branch(jit, 10, nn.byte_value, false);
+        jit_patch(skip, *code);
+        jit_emit_next(jit, 10, length, false);
+    }
+    else if (op == 0xCD && profile_period == 0)
+    {
+        // CALL nn, the profiler keeps its call stack in the handler
+        jit_emit_push(code, NULL, next);
+        jit_emit_branch(jit, 17, nn.byte_value, true);
+        return false;
+    }
+    else if ((op & 0xC7) == 0xC4 && profile_period == 0)
+    {
+        // CALL cc,nn
+        skip = jit_emit_unless(code, r);
+        jit_emit_push(code, NULL, next);
+        jit_emit_branch(jit, 17, nn.byte_value, true);
+        jit_patch(skip, *code);
+        jit_emit_next(jit, 10, length, false);
+    }
+    else if (op == 0xD9)
+    {
+        // EXX
+        jit_emit_exchange16(code, &z80_reg_bc, &z80_reg_bc_2);
+        jit_emit_exchange16(code, &z80_reg_de, &z80_reg_de_2);
+        jit_emit_exchange16(code, &z80_reg_hl, &z80_reg_hl_2);
+        jit_emit_next(jit, 4, length, false);
     }
+    else if (op == 0xE9)
+    {
+        // JP (HL)
+        jit_emit_load16(code, 0, &z80_reg_hl);
+        jit_emit_store16(code, 0, &z80_reg_pc);
+        jit_emit_branch(jit, 4, -1, false);
+        return false;
+    }
+    else if (op == 0xEB)
+    {
+        // EX DE,HL
+        jit_emit_exchange16(code, &z80_reg_de, &z80_reg_hl);
+        jit_emit_next(jit, 4, length, false);
+    }
+    else if (op == 0xF9)
+    {
+        // LD SP,HL
+        jit_emit_load16(code, 0, &z80_reg_hl);
+        jit_emit_store16(code, 0, &z80_reg_sp);
+        jit_emit_next(jit, 6, length, false);
+    }
+    else
+    {
+        return jit_emit_handler(jit, op, length);
+    }
+    return true;
 }
 
-int z80_nonmaskable_interrupt()
+// the entry saves RBX, R12 and R13 and jumps to the block in RDI, the exit at JIT_EXIT stores
+// the T states back and returns
+int jit_emit_entry(unsigned char *start)
 {
-    z80_iff2 = z80_iff1;
-    z80_iff1 = false;
-    z80_push16(z80_reg_pc);
-    z80_reg_pc.byte_value = 0x66;
-    return 11;
+    unsigned char *code = start;
+    // PUSH RBX; PUSH R12; PUSH R13; MOV RBX, machine
+    jit_emit8(&code, 0x53);
+    jit_emit16(&code, 0x5441);
+    jit_emit16(&code, 0x5541);
+    jit_emit16(&code, 0xBB48);
+    jit_emit64(&code, (unsigned long long)machine);
+    // MOV R12, [z80_t_states_all]; MOV R13, [z80_deadline]; JMP RDI
+    jit_emit16(&code, 0x8B4C);
+    jit_emit_machine(&code, 4, &z80_t_states_all);
+    jit_emit16(&code, 0x8B4C);
+    jit_emit_machine(&code, 5, &z80_deadline);
+    jit_emit16(&code, 0xE7FF);
+    code = start + JIT_EXIT;
+    // MOV [z80_t_states_all], R12; POP R13; POP R12; POP RBX; RET
+    jit_emit16(&code, 0x894C);
+    jit_emit_machine(&code, 4, &z80_t_states_all);
+    jit_emit16(&code, 0x5D41);
+    jit_emit16(&code, 0x5C41);
+    jit_emit8(&code, 0x5B);
+    jit_emit8(&code, 0xC3);
+    return code - start;
 }
 
-int z80_maskable_interrupt()
+void jit_enter(JITBLOCK *block)
 {
-    z80_iff1 = false;
-    z80_iff2 = false;
-    z80_memory_refresh();
-    switch (z80_imode)
+    ((void (*)(unsigned char *))jit_code)(block->code);
+}
+
+// straight line code from reg becomes x86-64, a taken conditional branch leaves the block and the
+// side not taken goes on; the pages are RW while the block is written and RX afterwards
+JITBLOCK *jit_compile(REG16 reg)
+{
+    JITCOMPILER jit = {.pc = reg, .block = reg};
+    unsigned char *first;
+    int i, j, n = 0, size = 0, len, length;
+    bool open = true;
+    if (jit_code_used == 0 || jit_code_used + JIT_MAX_CODE > JIT_CODE_SIZE)
     {
-    case 0:
-        // TODO: wait 2 cycles for interrupting device to write to data_bus
-        return z80_execute(z80_data_bus);
-    case 1:
-        z80_push16(z80_reg_pc);
-        z80_reg_pc.byte_value = 0x38;
-        return 13;
-    case 2:
-        z80_memory_refresh();
-        z80_memory_refresh();
-        z80_push16(z80_reg_pc);
-        z80_reg_pc = memory_read16((REG16){.bytes.high = z80_reg_i, .bytes.low = z80_data_bus});
-        return 19;
-    default:
-        return 0; // fail
+        jit_flush();
+    }
+    first = jit_code + (jit_code_used & ~(JIT_PAGE - 1));
+    length = ((jit_code_used + JIT_MAX_CODE + JIT_PAGE - 1) & ~(JIT_PAGE - 1)) - (jit_code_used & ~(JIT_PAGE - 1));
+    mprotect(first, length, PROT_READ | PROT_WRITE);
+    if (jit_code_used == 0)
+    {
+        jit_code_used = jit_emit_entry(jit_code);
+    }
+    jit.start = jit.code = jit_code + jit_code_used;
+    while (open && n < JIT_MAX_INSTRUCTIONS && jit.code - jit.start < JIT_MAX_CODE / 2)
+    {
+        len = z80_instruction_length(jit.pc);
+        if (len == 0 || size + len > JIT_MAX_BYTES || jit.pc.byte_value + len > MAX16 - 1)
+        {
+            break;
+        }
+        open = jit_emit_instruction(&jit, len);
+        size += len;
+        n++;
+    }
+    if (n > 0 && open)
+    {
+        jit_emit_refresh(&jit.code, jit.refresh);
+        jit_emit_store16_imm(&jit.code, &z80_reg_pc, jit.pc.byte_value);
+        jit_emit_link(&jit, jit.pc.byte_value);
+    }
+    for (i = 0; i < jit.exits_size; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            if (jit.exits[i].jumps[j] != NULL)
+            {
+                jit_patch(jit.exits[i].jumps[j], jit.code);
+            }
+        }
+        jit_emit_store16_imm(&jit.code, &z80_reg_pc, jit.exits[i].pc.byte_value);
+        jit_emit_refresh(&jit.code, jit.exits[i].refresh);
+        jit_emit_exit(&jit.code, JIT_JMP);
+    }
+    mprotect(first, length, PROT_READ | PROT_EXEC);
+    if (n == 0)
+    {
+        return NULL;
+    }
+    jit_code_used += jit.code - jit.start;
+    for (i = reg.byte_value >> 8; i <= (reg.byte_value + size - 1) >> 8; i++)
+    {
+        memory_code_pages[i] |= CODE_JIT;
     }
+    JITBLOCK *block = malloc(sizeof(JITBLOCK));
+    *block = (JITBLOCK){.code = jit.start, .start = reg, .size = size};
+    return block;
 }
 
-int z80_run_one()
+// runs the block, then the interpreter from the same state, keeping the interpreter's result
+int jit_run_checked(JITBLOCK *block)
 {
-    if (z80_nonmaskable_interrupt_flag)
+    Z80STATE before, after_jit, after;
+    unsigned long long t = z80_t_states_all;
+    int i, n, t_jit, t_int = 0;
+    z80_get_state(&before);
+    memcpy(jit_check_memory[0], memory, sizeof(memory));
+    jit_enter(block);
+    n = jit_count;
+    t_jit = z80_t_states_all - t;
+    z80_get_state(&after_jit);
+    memcpy(jit_check_memory[1], memory, sizeof(memory));
+    z80_set_state(&before);
+    memcpy(memory, jit_check_memory[0], sizeof(memory));
+    for (i = 0; i < n; i++)
     {
-        z80_halt = false;
-        z80_nonmaskable_interrupt_flag = false;
-        return z80_nonmaskable_interrupt();
+        z80_t_states_all = t + t_int;
+        t_int += z80_execute(z80_fetch_opcode());
     }
-    else if (z80_maskable_interrupt_flag)
+    z80_get_state(&after);
+    if (t_int != t_jit || memcmp(&after, &after_jit, sizeof(Z80STATE)) != 0 ||
+        memcmp(memory, jit_check_memory[1], sizeof(memory)) != 0)
     {
-        z80_halt = false;
-        z80_maskable_interrupt_flag = false;
-        if (z80_iff1)
+        fprintf(stderr, "JIT mismatch in block %04X: %d instructions, %d and %d T states\n",
+                before.pc.byte_value, n, t_jit, t_int);
+        if (jit_blocks[before.pc.byte_value] == block)
         {
-            return z80_maskable_interrupt();
+            jit_free_block(before.pc);
         }
     }
-    if (z80_can_execute)
+    z80_t_states_all = t;
+    return t_int;
+}
+
+// runs the translated blocks from PC up to the deadline, returns 0 to fall back to the interpreter
+int jit_run()
+{
+    int t;
+    if (jit_code == NULL || z80_nonmaskable_interrupt_flag || z80_maskable_interrupt_flag || z80_halt || !z80_can_execute)
     {
-        // if (z80_reg_pc.byte_value == 0x87a3 && debug == 100)
-        // {
-        //    debug = 0;
-        // }
-        // if (debug < 100)
-        // {
-        //     z80_print();
-        //     debug++;
-        // }
-        return z80_execute(z80_fetch_opcode());
+        return 0;
     }
-    else
+    JITBLOCK *block = jit_blocks[z80_reg_pc.byte_value];
+    if (block == NULL)
     {
-        return 0;
+        if (++jit_hits[z80_reg_pc.byte_value] < JIT_HOT)
+        {
+            return 0;
+        }
+        jit_hits[z80_reg_pc.byte_value] = 0;
+        block = jit_blocks[z80_reg_pc.byte_value] = jit_compile(z80_reg_pc);
+        if (block == NULL)
+        {
+            return 0;
+        }
+    }
+    jit_invalidated = false;
+    jit_count = 0;
+    register_flags_materialize();
+    if (jit_check)
+    {
+        return jit_run_checked(block);
     }
+    unsigned long long t_start = z80_t_states_all;
+    jit_enter(block);
+    t = z80_t_states_all - t_start;
+    z80_t_states_all = t_start;
+    return t;
 }
 
 // ===RT=================================================
 
-void rt_advance_head()
+// rt_timeline is a binary heap ordered by T state, tasks due at the same T state run in the order they were added
+bool rt_before(const TASK *a, const TASK *b)
 {
-    int i;
-    if (rt_size > 0)
+    return a->t_states < b->t_states || (a->t_states == b->t_states && a->id < b->id);
+}
+
+void rt_swap(int i, int j)
+{
+    TASK aux = rt_timeline[i];
+    rt_timeline[i] = rt_timeline[j];
+    rt_timeline[j] = aux;
+}
+
+void rt_sift_up(int i)
+{
+    while (i > 0 && rt_before(&rt_timeline[i], &rt_timeline[(i - 1) / 2]))
     {
-        for (i = 1; i < rt_size; i++)
-        {
-            rt_timeline[i - 1] = rt_timeline[i];
-        }
-        rt_size--;
+        rt_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
 }
 
-bool rt_add_pending_task(TASK task)
+void rt_sift_down(int i)
 {
-    if (rt_is_pending)
+    int child;
+    while ((child = 2 * i + 1) < rt_size)
     {
-        return false;
+        if (child + 1 < rt_size && rt_before(&rt_timeline[child + 1], &rt_timeline[child]))
+        {
+            child++;
+        }
+        if (!rt_before(&rt_timeline[child], &rt_timeline[i]))
+        {
+            break;
+        }
+        rt_swap(i, child);
+        i = child;
     }
-    else
+}
+
+void rt_remove(int i)
+{
+    rt_size--;
+    if (i < rt_size)
     {
-        rt_pending = task;
-        rt_is_pending = true;
-        return true;
+        rt_timeline[i] = rt_timeline[rt_size];
+        rt_sift_down(i);
+        rt_sift_up(i);
     }
 }
 
+// removes and returns the earliest task, the caller runs it
+TASK rt_pop_task()
+{
+    TASK task = rt_timeline[0];
+    rt_remove(0);
+    return task;
+}
+
+// the T state of the earliest task, the running task is already out of the timeline
 unsigned long long rt_next_t_states()
 {
     if (rt_size == 0)
     {
         return z80_t_states_all + 1;
     }
-    else if (rt_size == 1)
+    else
     {
-        return rt_timeline[0].t_states + 1;
+        return rt_timeline[0].t_states;
     }
-    else
+}
+
+// the timeline grows as needed, a task is never dropped; returns an id for rt_cancel_task
+unsigned long long rt_add_task(TASK task)
+{
+    if (rt_size == rt_capacity)
+    {
+        rt_capacity = (rt_capacity == 0 ? RT_CAPACITY : 2 * rt_capacity);
+        rt_timeline = realloc(rt_timeline, rt_capacity * sizeof(TASK));
+    }
+    task.id = ++rt_sequence;
+    rt_timeline[rt_size] = task;
+    rt_size++;
+    rt_sift_up(rt_size - 1);
+    return task.id;
+}
+
+bool rt_cancel_task(unsigned long long id)
+{
+    int i;
+    for (i = 0; i < rt_size; i++)
+    {
+        if (rt_timeline[i].id == id)
+        {
+            rt_remove(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// any thread can post a task, the real-time thread moves it to the timeline in rt_take_posted;
+// the inbox is a linked list where producers swap the head and the consumer follows the tail
+void rt_post_task(TASK task)
+{
+    RTEVENT *event = malloc(sizeof(RTEVENT)), *previous;
+    event->task = task;
+    atomic_init(&event->next, NULL);
+    previous = atomic_exchange_explicit(&rt_inbox_head, event, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, event, memory_order_release);
+}
+
+bool rt_has_posted()
+{
+    return atomic_load_explicit(&rt_inbox_head, memory_order_relaxed) != rt_inbox_tail;
+}
+
+// the last taken event stays as the tail until the next one arrives, a task posted in the past runs now
+void rt_take_posted()
+{
+    RTEVENT *next;
+    while ((next = atomic_load_explicit(&rt_inbox_tail->next, memory_order_acquire)) != NULL)
     {
-        return rt_timeline[1].t_states;
+        if (rt_inbox_tail != &rt_inbox_stub)
+        {
+            free(rt_inbox_tail);
+        }
+        rt_inbox_tail = next;
+        if (next->task.t_states < z80_t_states_all)
+        {
+            next->task.t_states = z80_t_states_all;
+        }
+        rt_add_task(next->task);
     }
 }
 
-bool rt_add_task(TASK task)
+void ula_run(void *context);
+void pcm_run(void *context);
+void z80_run(void *context);
+
+void rt_stats_print()
 {
     int i;
-    TASK aux;
-    if (rt_size < RT_MAX)
+    for (i = 0; i < RT_STATS_MAX; i++)
+    {
+        time_histogram_print(stderr, &rt_stats_histograms[i]);
+    }
+}
+
+// times the task by its kind, the tape and the other tasks count as tape
+void rt_stats_run(TASK task)
+{
+    unsigned long long start = time_in_ns();
+    task.task(task.context);
+    if (task.task == ula_run)
     {
-        rt_timeline[rt_size] = task;
-        rt_size++;
-        for (i = rt_size - 2; i >= 0; i--)
+        time_histogram_add(&rt_stats_histograms[RT_STATS_ULA], time_in_ns() - start);
+        if (ula_line == 0)
         {
-            if (rt_timeline[i].t_states > rt_timeline[i + 1].t_states)
+            if (rt_stats_frame_start > 0)
             {
-                aux = rt_timeline[i];
-                rt_timeline[i] = rt_timeline[i + 1];
-                rt_timeline[i + 1] = aux;
+                time_histogram_add(&rt_stats_histograms[RT_STATS_FRAME], start - rt_stats_frame_start);
             }
+            rt_stats_frame_start = start;
         }
-        return true;
     }
     else
     {
-        return false;
+        time_histogram_add(&rt_stats_histograms[task.task == pcm_run ? RT_STATS_PCM : task.task == z80_run ? RT_STATS_CPU : RT_STATS_TAPE],
+                           time_in_ns() - start);
     }
+    if (rt_stats_requested)
+    {
+        rt_stats_requested = false;
+        rt_stats_print();
+    }
+}
+
+void rt_stats_signal(int signal)
+{
+    rt_stats_requested = true;
 }
 
 void *rt_run(void *args)
 {
+    machine = args;
 	running = true;
-	time_start = time_in_seconds();
+	time_restart();
     while (running)
     {
 		z80_t_states_all = (rt_size == 0 ? z80_t_states_all : rt_timeline[0].t_states);
         time_sync();
-        if (rt_is_pending)
+        if (rt_has_posted())
         {
-            rt_add_task(rt_pending);
-            rt_is_pending = false;
+            rt_take_posted();
         }
         if (rt_size > 0 && z80_t_states_all >= rt_timeline[0].t_states)
         {
-            rt_timeline[0].task();
-            rt_advance_head();
+            TASK task = rt_pop_task();
+            if (rt_stats)
+            {
+                rt_stats_run(task);
+            }
+            else
+            {
+                task.task(task.context);
+            }
         }
     }
     return NULL;
 }
 
+// runs the tasks as fast as possible, without waiting for real time, until the given T state
+void rt_run_until(unsigned long long t_states)
+{
+    while (rt_size > 0 && rt_timeline[0].t_states < t_states)
+    {
+        TASK task = rt_pop_task();
+        z80_t_states_all = task.t_states;
+        task.task(task.context);
+    }
+}
+
 // ===ULA================================================
 
 void ula_point(const int x, const int y, const int c, const bool b)
 {
-    RGB color = (b ? ula_bright_colors[c] : ula_colors[c]);
-    ula_screen[y][x] = color;
+    ula_screen[y][x] = b ? c | 8 : c;
 }
 
 int ula_draw_line()
@@ -2675,38 +6403,91 @@ int ula_draw_line()
         ula_addr_bitmap.byte_value = 0x4000;
         ula_line = 0;
         ula_draw_counter = (ula_draw_counter + 1) % 16;
+        ula_frames++;
         return 8 * 224; // vertical retrace
     }
-    ula_line++;
-    return 224;
+    ula_line++;
+    return 224;
+}
+
+void ula_run(void *context)
+{
+    rt_add_task((TASK){.t_states = z80_t_states_all + ula_draw_line(), .task = ula_run});
+}
+
+// ===SOUND==============================================
+
+// what the device has no room for is dropped, the real-time thread does not wait for it
+void pcm_write_alsa(const unsigned char *frames, int size)
+{
+    int err;
+    while (size > 0)
+    {
+        err = snd_pcm_writei(pcm_handle, frames, size);
+        if (err > 0)
+        {
+            frames += err;
+            size -= err;
+        }
+        else if (err == -EPIPE)
+        {
+            snd_pcm_prepare(pcm_handle);
+        }
+        else if (err == -ESTRPIPE)
+        {
+            while ((err = snd_pcm_resume(pcm_handle)) == -EAGAIN)
+            {
+                time_sleep_in_ms(1000);
+            }
+            if (err < 0)
+            {
+                snd_pcm_prepare(pcm_handle);
+            }
+        }
+        else
+        {
+            return;
+        }
+    }
 }
 
-void ula_run()
+// keeps PCM_SYNC_FRAMES queued in the device: above that the emulation waits for the device to play the rest,
+// below it the emulation runs ahead, so it follows the sound clock without underruns or drift
+void pcm_wait_for_device()
 {
-    rt_add_task((TASK){.t_states = z80_t_states_all + ula_draw_line(), .task = ula_run});
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(pcm_handle, &delay) == 0 && delay > PCM_SYNC_FRAMES)
+    {
+        time_sleep_until_ns(time_in_ns() + (delay - PCM_SYNC_FRAMES) * TIME_NS_PER_SECOND / PCM_SAMPLE);
+    }
 }
 
-// ===SOUND==============================================
-
-void pcm_run()
+// without an ALSA device the samples go to pcm_file, or nowhere, at the same T states
+// above 1x the device gets every time_speed-th sample so it never falls behind, at max speed none;
+// the samples reach the device pcm_chunk at a time, a slice of them when the emulation runs in slices
+void pcm_run(void *context)
 {
 	unsigned char frame = sound_ear * 128;
-	int err = snd_pcm_writei(pcm_handle, &frame, 1);
-    if (err == -EPIPE)
-    {
-        snd_pcm_prepare(pcm_handle);
-    }
-    else if (err == -ESTRPIPE)
+    if (pcm_handle != NULL)
     {
-        while ((err = snd_pcm_resume(pcm_handle)) == -EAGAIN)
+        if (time_speed != TIME_SPEED_MAX && (z80_t_states_all / pcm_states) % time_speed == 0)
         {
-            time_sleep_in_seconds(1.0);
-		}
-        if (err < 0)
-        {
-            snd_pcm_prepare(pcm_handle);
+            pcm_buffer[pcm_buffered++] = frame;
+            if (pcm_buffered >= pcm_chunk)
+            {
+                pcm_write_alsa(pcm_buffer, pcm_buffered);
+                pcm_buffered = 0;
+                if (pcm_sync)
+                {
+                    pcm_wait_for_device();
+                }
+            }
         }
     }
+    else if (pcm_file != NULL)
+    {
+        fwrite(&frame, 1, 1, pcm_file);
+    }
     rt_add_task((TASK){.t_states = z80_t_states_all + pcm_states, .task = pcm_run});
 }
 
@@ -2783,7 +6564,7 @@ int tape_play_block()
                 if (!sound_ear)
                 {
                     sound_ear_on_off(true);
-                    return 1 / (1000 * state_duration);
+                    return Z80_FREQ / 1000;
                 }
             }
             s++;
@@ -2792,7 +6573,7 @@ int tape_play_block()
                 tape_load_state = 0;
                 sound_ear_on_off(false);
                 tape_block_last = tape_block_last->next;
-                return block->pause / (1000 * state_duration);
+                return block->pause * (Z80_FREQ / 1000);
             }
         }
         else if (block->pause == 0)
@@ -2848,7 +6629,7 @@ bool tape_read(int fd, void *buffer, int size, bool rec)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                time_sleep_in_seconds(0.1);
+                time_sleep_in_ms(100);
             }
             else
             {
@@ -3175,7 +6956,7 @@ void tape_load_tzx(int fd, int index)
     }
 }
 
-void tape_play_run()
+void tape_play_run(void *context)
 {
     sound_input = true;
     int s;
@@ -3292,7 +7073,7 @@ void tape_record(int counter, unsigned long long duration)
     tape_save_index = 0;
 }
 
-void tape_listen()
+void tape_listen(void *context)
 {
     unsigned long long duration;
     if (tape_save_state != -1)
@@ -3321,12 +7102,13 @@ void tape_listen()
 void *tape_run_save(void *args)
 {
     int fd;
+    machine = args;
     while (running)
     {
         fd = open("save", O_WRONLY | O_NONBLOCK);
         if (fd == -1)
         {
-            time_sleep_in_seconds(0.1);
+            time_sleep_in_ms(100);
         }
         else
         {
@@ -3338,13 +7120,13 @@ void *tape_run_save(void *args)
             tape_save_mic = false;
             tape_save_buffer_size = 19;
             tape_save_buffer = realloc(tape_save_buffer, tape_save_buffer_size);
-            rt_add_pending_task((TASK){.t_states = z80_t_states_all, .task = tape_listen});
+            rt_post_task((TASK){.t_states = z80_t_states_all, .task = tape_listen});
             write_tzx_header(fd);
             while (tape_wait(fd, TAPE_SAVE_EVENT))
             {
                 if (tape_save_state != 4)
                 {
-                    time_sleep_in_seconds(0.1);
+                    time_sleep_in_ms(100);
                 }
                 else
                 {
@@ -3365,6 +7147,7 @@ void *tape_run_save(void *args)
 void *tape_run_load(void *args)
 {
     int fd;
+    machine = args;
     while (running)
     {
         fd = open("load", O_RDONLY | O_NONBLOCK);
@@ -3376,7 +7159,7 @@ void *tape_run_load(void *args)
                 tape_load_tzx(fd, 1);
                 tape_block_last = tape_block_head;
                 tape_load_state = 0;
-                rt_add_pending_task((TASK){.t_states = z80_t_states_all, .task = tape_play_run});
+                rt_post_task((TASK){.t_states = z80_t_states_all, .task = tape_play_run});
             }
             close(fd);
         }
@@ -3391,26 +7174,83 @@ void *tape_run_load(void *args)
 
 // ======================================================
 
+// the palette lookup goes to a fresh pixel buffer, the texture is filled from it without waiting for the previous draw
 void draw_screen()
 {
-    glBegin(GL_POINTS);
-    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    unsigned char (*pixels)[4];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, screen_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, SCREEN_HEIGHT * SCREEN_WIDTH * 4, NULL, GL_STREAM_DRAW);
+    pixels = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (pixels != NULL)
     {
-        for (int x = 0; x < SCREEN_WIDTH; x++)
+        for (int y = 0; y < SCREEN_HEIGHT; y++)
         {
-            RGB color = ula_screen[y][x];
-            glColor3f(color.red, color.green, color.blue);
-            glVertex2i(x, y);
+            for (int x = 0; x < SCREEN_WIDTH; x++)
+            {
+                memcpy(pixels[y * SCREEN_WIDTH + x], ula_palette[ula_screen[y][x]], 4);
+            }
         }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBegin(GL_QUADS);
+    glTexCoord2i(0, 0);
+    glVertex2i(0, 0);
+    glTexCoord2i(1, 0);
+    glVertex2i(SCREEN_WIDTH, 0);
+    glTexCoord2i(1, 1);
+    glVertex2i(SCREEN_WIDTH, SCREEN_HEIGHT);
+    glTexCoord2i(0, 1);
+    glVertex2i(0, SCREEN_HEIGHT);
     glEnd();
     glFlush();
-    glutPostRedisplay();
 }
 
-void z80_run()
+// redraws only when the ULA has finished a new frame since the last redraw
+void screen_refresh(int value)
+{
+    unsigned int frames = ula_frames;
+    if (frames != screen_frame)
+    {
+        screen_frame = frames;
+        glutPostRedisplay();
+    }
+    glutTimerFunc(SCREEN_REFRESH_MS, screen_refresh, 0);
+}
+
+// runs instructions until the next task is due, a task added by another thread ends the batch early
+void z80_run(void *context)
 {
-    rt_add_task((TASK){.t_states = z80_t_states_all + z80_run_one(), z80_run});
+    int t;
+    REG16 pc;
+    z80_deadline = rt_next_t_states();
+#ifdef Z80_OPCODE_STATS
+    if (z80_stats_requested)
+    {
+        z80_stats_requested = false;
+        z80_stats_print();
+    }
+#endif
+    do
+    {
+        pc = z80_reg_pc;
+        t = jit_enabled ? jit_run() : 0;
+        if (t == 0)
+        {
+            t = z80_halt_fast_forward();
+        }
+        if (t == 0)
+        {
+            t = z80_run_one();
+        }
+        z80_t_states_all += t;
+        if (t > 0)
+        {
+            z80_idle_check(pc);
+        }
+    } while (t > 0 && z80_t_states_all < z80_deadline && !rt_has_posted());
+    rt_add_task((TASK){.t_states = z80_t_states_all, z80_run});
 }
 
 void window_show(int argc, char **argv)
@@ -3421,7 +7261,6 @@ void window_show(int argc, char **argv)
 
     // glutInitWindowPosition(200, 100);
     glutCreateWindow("Cristian Mocanu Z80");
-    glPointSize(SCREEN_ZOOM);
     glClearColor(0.8f, 0.8f, 0.8f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
     // glMatrixMode(GL_PROJECTION);
@@ -3430,19 +7269,469 @@ void window_show(int argc, char **argv)
     // glLoadIdentity();
     glTranslatef(-1.0, 1.0, 0.0);
     glScalef(2.0f / SCREEN_WIDTH, -2.0f / SCREEN_HEIGHT, 0.0f);
+    glGenTextures(1, &screen_texture);
+    glBindTexture(GL_TEXTURE_2D, screen_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glEnable(GL_TEXTURE_2D);
+    glGenBuffers(1, &screen_buffer);
     glutKeyboardFunc(keyboard_press_down);
     glutKeyboardUpFunc(keyboard_press_up);
+    glutSpecialFunc(keyboard_special_down);
+}
+
+// ===BATCH==============================================
+
+// FNV-1a
+unsigned int batch_hash(const void *data, int size)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < size; i++)
+    {
+        h = (h ^ ((const unsigned char *)data)[i]) * 16777619u;
+    }
+    return h;
+}
+
+// one line per job: a .sna or .rom file and its budget in T states, or in frames with an f suffix
+bool batch_load(const char *filename)
+{
+    char name[BATCH_NAME_MAX], budget[64], *end;
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    batch_size = 0;
+    while (fscanf(f, "%1023s %63s", name, budget) == 2)
+    {
+        batch_jobs = realloc(batch_jobs, (batch_size + 1) * sizeof(BATCHJOB));
+        batch_jobs[batch_size].filename = strdup(name);
+        batch_jobs[batch_size].t_states = strtoull(budget, &end, 10);
+        if (*end == 'f')
+        {
+            batch_jobs[batch_size].t_states *= ULA_FRAME_T_STATES;
+        }
+        batch_size++;
+    }
+    fclose(f);
+    return true;
+}
+
+// the owner takes jobs from the front of its queue, idle workers steal from the back of the others
+int batch_take(int worker)
+{
+    int i, job = -1;
+    for (i = 0; i < batch_threads && job == -1; i++)
+    {
+        BATCHQUEUE *queue = &batch_queues[(worker + i) % batch_threads];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->begin < queue->end)
+        {
+            job = (i == 0 ? queue->begin++ : --queue->end);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return job;
+}
+
+// clears the current machine, keeping its JIT code buffer
+void batch_reset_machine()
+{
+    unsigned char *code = jit_code;
+    if (code != NULL)
+    {
+        jit_flush();
+    }
+#ifdef Z80_OPCODE_STATS
+    z80_stats_merge();
+#endif
+    free(rt_timeline);
+    machine_init(machine);
+    jit_code = code;
+    z80_reset();
+}
+
+void batch_run_job(BATCHJOB *job)
+{
+    Z80STATE state;
+    unsigned long long start = time_in_ns();
+    batch_reset_machine();
+    if (access(job->filename, R_OK) != 0)
+    {
+        pthread_mutex_lock(&batch_output);
+        printf("%s error\n", job->filename);
+        pthread_mutex_unlock(&batch_output);
+        return;
+    }
+    else if (file_has_extension(job->filename, ".rom"))
+    {
+        file_load_rom(job->filename);
+    }
+    else if (file_has_extension(job->filename, ".sna"))
+    {
+        file_load_sna(job->filename);
+        z80_reg_pc = z80_pop16();
+        z80_iff1 = z80_iff2;
+    }
+    if (z80_decode_cache)
+    {
+        z80_decode_rom();
+    }
+    rt_add_task((TASK){.t_states = 0, ula_run});
+    rt_add_task((TASK){.t_states = 0, z80_run});
+    rt_run_until(job->t_states);
+    z80_get_state(&state);
+    pthread_mutex_lock(&batch_output);
+    printf("%s %llu %.3f %08x %08x\n", job->filename, z80_t_states_all, (double)(time_in_ns() - start) / TIME_NS_PER_SECOND,
+           batch_hash(&state, sizeof(Z80STATE)), batch_hash(memory, sizeof(memory)));
+    pthread_mutex_unlock(&batch_output);
+}
+
+void *batch_worker(void *args)
+{
+    int job, worker = (long)args;
+    machine_init(aligned_alloc(64, sizeof(MACHINE)));
+    if (jit_enabled)
+    {
+        jit_init();
+    }
+    while ((job = batch_take(worker)) != -1)
+    {
+        batch_run_job(&batch_jobs[job]);
+    }
+#ifdef Z80_OPCODE_STATS
+    z80_stats_merge();
+#endif
+    free(rt_timeline);
+    free(machine);
+    return NULL;
+}
+
+// every job runs headless and unthrottled on its own machine, one worker per host core
+int batch_run(const char *filename)
+{
+    int i;
+    pthread_t *workers;
+    if (!batch_load(filename))
+    {
+        printf("Cannot read %s\n", filename);
+        return 1;
+    }
+    batch_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    batch_threads = (batch_threads < 1 ? 1 : batch_threads);
+    batch_queues = malloc(batch_threads * sizeof(BATCHQUEUE));
+    workers = malloc(batch_threads * sizeof(pthread_t));
+    for (i = 0; i < batch_threads; i++)
+    {
+        batch_queues[i].begin = batch_size * i / batch_threads;
+        batch_queues[i].end = batch_size * (i + 1) / batch_threads;
+        pthread_mutex_init(&batch_queues[i].lock, NULL);
+        pthread_create(&workers[i], NULL, batch_worker, (void *)(long)i);
+    }
+    for (i = 0; i < batch_threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(batch_queues);
+    return 0;
+}
+
+// ===BENCH==============================================
+
+// holds each key for BENCH_KEY_DOWN_FRAMES and releases it for BENCH_KEY_UP_FRAMES, so the ROM sees every press
+void bench_type(void *context)
+{
+    if (bench_key_down)
+    {
+        memset(keyboard, 0xFF, sizeof(keyboard));
+        bench_key_down = false;
+        bench_keys++;
+        rt_add_task((TASK){.t_states = z80_t_states_all + BENCH_KEY_UP_FRAMES * ULA_FRAME_T_STATES, .task = bench_type});
+    }
+    else if (*bench_keys != 0)
+    {
+        if (isupper(*bench_keys))
+        {
+            register_set_or_unset_bit(keyboard[7], MAX1, false);
+        }
+        keyboard_set(*bench_keys, false);
+        bench_key_down = true;
+        rt_add_task((TASK){.t_states = z80_t_states_all + BENCH_KEY_DOWN_FRAMES * ULA_FRAME_T_STATES, .task = bench_type});
+    }
+}
+
+// boots the ROM, then types the keys or jumps to the code, and runs the workload for its frames without sleeping
+void bench_run_workload(BENCHMARK *workload, const char *rom, bool last)
+{
+    struct rusage usage;
+    unsigned long long t_states = BENCH_BOOT_FRAMES * ULA_FRAME_T_STATES;
+    unsigned long long ns, start = time_in_ns();
+    double seconds;
+    batch_reset_machine();
+    file_load_rom(rom);
+    if (z80_decode_cache)
+    {
+        z80_decode_rom();
+    }
+    rt_add_task((TASK){.t_states = 0, ula_run});
+    rt_add_task((TASK){.t_states = 0, z80_run});
+    if (workload->keys != NULL)
+    {
+        bench_keys = workload->keys;
+        bench_key_down = false;
+        rt_add_task((TASK){.t_states = t_states, .task = bench_type});
+        rt_run_until(t_states + workload->frames * ULA_FRAME_T_STATES);
+    }
+    else if (workload->code != NULL)
+    {
+        memcpy(memory + BENCH_CODE, workload->code, workload->code_size);
+        z80_reg_pc.byte_value = BENCH_CODE;
+        rt_run_until(workload->frames * ULA_FRAME_T_STATES);
+    }
+    else
+    {
+        rt_run_until(t_states);
+    }
+    ns = time_in_ns() - start;
+    seconds = (double)ns / TIME_NS_PER_SECOND;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("    {\"name\": \"%s\", \"t_states\": %llu, \"instructions\": %llu, \"seconds\": %.6f, "
+           "\"emulated_mhz\": %.3f, \"ns_per_instruction\": %.3f, \"frames_per_second\": %.1f, \"peak_rss_kb\": %ld}%s\n",
+           workload->name, z80_t_states_all, z80_instructions, seconds,
+           z80_t_states_all / seconds / 1000000.0, (double)ns / z80_instructions,
+           z80_t_states_all / (double)ULA_FRAME_T_STATES / seconds, usage.ru_maxrss, last ? "" : ",");
+}
+
+// prints one JSON object, so that runs can be compared against a baseline
+int bench_run(const char *rom)
+{
+    int i, n = sizeof(bench_workloads) / sizeof(BENCHMARK);
+    if (access(rom, R_OK) != 0)
+    {
+        printf("Cannot read %s\n", rom);
+        return 1;
+    }
+    printf("{\n  \"rom\": \"%s\", \"lazy\": %s, \"jit\": %s, \"cache\": %s,\n  \"workloads\": [\n", rom,
+           register_lazy ? "true" : "false", jit_enabled ? "true" : "false", z80_decode_cache ? "true" : "false");
+    for (i = 0; i < n; i++)
+    {
+        bench_run_workload(&bench_workloads[i], rom, i == n - 1);
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
+
+// ===PROFILE============================================
+
+// the frames are the PC and the sites of the calls still on the shadow call stack, innermost first;
+// an interrupt is recorded at the interrupted instruction
+int profile_walk(REG16 *frames)
+{
+    int i, depth = 1;
+    profile_unwind(z80_reg_sp.byte_value == 0 ? MAX16 : z80_reg_sp.byte_value);
+    frames[0] = z80_reg_pc;
+    for (i = profile_calls_size - 1; i >= 0 && depth < PROFILE_DEPTH; i--)
+    {
+        frames[depth++] = profile_calls[i].site;
+    }
+    return depth;
+}
+
+void profile_run(void *context)
+{
+    REG16 frames[PROFILE_DEPTH];
+    int i, depth = profile_walk(frames);
+    unsigned int h = batch_hash(frames, depth * sizeof(REG16)) % PROFILE_STACKS;
+    for (i = 0; i < PROFILE_STACKS; i++, h = (h + 1) % PROFILE_STACKS)
+    {
+        PROFILESTACK *stack = &profile_stacks[h];
+        if (stack->count == 0)
+        {
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(REG16));
+        }
+        if (stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(REG16)) == 0)
+        {
+            stack->count++;
+            break;
+        }
+    }
+    if (i == PROFILE_STACKS)
+    {
+        profile_dropped++;
+    }
+    rt_add_task((TASK){.t_states = z80_t_states_all + profile_period, .task = profile_run});
+}
+
+int profile_compare_symbols(const void *a, const void *b)
+{
+    return (int)((const PROFILESYMBOL *)a)->address - (int)((const PROFILESYMBOL *)b)->address;
+}
+
+bool profile_load_symbols(const char *filename)
+{
+    char line[256], label[PROFILE_LABEL_MAX], value[64];
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, " %63[^= \t] = %63s", label, value) == 2)
+        {
+            profile_symbols = realloc(profile_symbols, (profile_symbols_size + 1) * sizeof(PROFILESYMBOL));
+            strcpy(profile_symbols[profile_symbols_size].label, label);
+            profile_symbols[profile_symbols_size].address = strtoul(value + (value[0] == '$'), NULL, 16) & 0xFFFF;
+            profile_symbols_size++;
+        }
+    }
+    fclose(f);
+    qsort(profile_symbols, profile_symbols_size, sizeof(PROFILESYMBOL), profile_compare_symbols);
+    return true;
+}
+
+// the label at or before the address, the address itself without symbols
+void profile_print_frame(FILE *f, unsigned int address)
+{
+    int low = 0, high = profile_symbols_size - 1, mid;
+    while (low <= high)
+    {
+        mid = (low + high) / 2;
+        if (profile_symbols[mid].address <= address)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    if (high >= 0)
+    {
+        fprintf(f, "%s", profile_symbols[high].label);
+    }
+    else
+    {
+        fprintf(f, "%04X", address);
+    }
+}
+
+// one line per stack, outermost caller first
+void profile_save(const char *filename)
+{
+    int i, j;
+    FILE *f = fopen(filename, "w");
+    for (i = 0; i < PROFILE_STACKS; i++)
+    {
+        PROFILESTACK *stack = &profile_stacks[i];
+        if (stack->count > 0)
+        {
+            for (j = stack->depth - 1; j >= 0; j--)
+            {
+                profile_print_frame(f, stack->frames[j].byte_value);
+                fprintf(f, j > 0 ? ";" : " ");
+            }
+            fprintf(f, "%llu\n", stack->count);
+        }
+    }
+    fclose(f);
+    if (profile_dropped > 0)
+    {
+        printf("Profile table full, %llu samples dropped\n", profile_dropped);
+    }
+}
+
+bool main_has_option(int argc, char **argv, const char *option)
+{
+    int i;
+    for (i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], option) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// returns the argument after the option or NULL
+char *main_option_value(int argc, char **argv, const char *option)
+{
+    int i;
+    for (i = 2; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], option) == 0)
+        {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
 }
 
 int main(int argc, char **argv)
 {
     pthread_t rt_id, tape_load_id, tape_save_id;
     int fd, index, pcm_ok;
-    char *buffer;
+    bool headless;
+    sigset_t signals;
+    char *buffer, *speed, *slice, *symbols, *fusions;
     pthread_attr_t a;
     struct sched_param p = {.sched_priority = 10};
     if (system_little_endian())
     {
+        machine_init(&main_machine);
+        register_init_tables();
+        register_lazy_check = main_has_option(argc, argv, "-lazy-check");
+        register_lazy = register_lazy_check || main_has_option(argc, argv, "-lazy");
+        jit_check = main_has_option(argc, argv, "-jit-check");
+        jit_enabled = (jit_check || main_has_option(argc, argv, "-jit")) && jit_init();
+        z80_decode_cache = main_has_option(argc, argv, "-cache");
+        z80_fusion_profile = main_has_option(argc, argv, "-fusion-profile");
+        fusions = main_option_value(argc, argv, "-fusions");
+        if (fusions != NULL && !z80_fusion_load(fusions))
+        {
+            printf("Cannot read %s\n", fusions);
+        }
+        speed = main_option_value(argc, argv, "-speed");
+        if (speed != NULL)
+        {
+            time_speed = (strcmp(speed, "max") == 0 ? TIME_SPEED_MAX : atoi(speed));
+        }
+        slice = main_option_value(argc, argv, "-slice");
+        if (slice != NULL)
+        {
+            time_slice = (strcmp(slice, "frame") == 0 ? ULA_FRAME_T_STATES : strtoull(slice, NULL, 10));
+            pcm_chunk = time_slice / pcm_states;
+            pcm_chunk = (pcm_chunk < 1 ? 1 : pcm_chunk > PCM_SAMPLE ? PCM_SAMPLE : pcm_chunk);
+        }
+        profile_period = (main_option_value(argc, argv, "-profile") == NULL ? 0 : atoi(main_option_value(argc, argv, "-profile")));
+        rt_stats = main_has_option(argc, argv, "-rt-stats");
+        if (rt_stats)
+        {
+            signal(SIGUSR2, rt_stats_signal);
+        }
+        symbols = main_option_value(argc, argv, "-symbols");
+        if (symbols != NULL && !profile_load_symbols(symbols))
+        {
+            printf("Cannot read %s\n", symbols);
+        }
+#ifdef Z80_OPCODE_STATS
+        signal(SIGUSR1, z80_stats_signal);
+        atexit(z80_stats_print);
+#endif
+        if (argc >= 3 && strcmp(argv[1], "-batch") == 0)
+        {
+            return batch_run(argv[2]);
+        }
+        if (argc >= 3 && strcmp(argv[1], "-bench") == 0)
+        {
+            return bench_run(argv[2]);
+        }
 		z80_reset();
         if (argc >= 2)
         {
@@ -3497,10 +7786,40 @@ int main(int argc, char **argv)
                 return 1;
             }
         }
-        pcm_ok = pcm_config();
-        window_show(argc, argv);
+        if (z80_decode_cache)
+        {
+            z80_decode_rom();
+        }
+        headless = main_has_option(argc, argv, "-headless") || main_has_option(argc, argv, "--headless");
+        if (headless)
+        {
+            if (main_has_option(argc, argv, "-pcm"))
+            {
+                pcm_file = fopen("out.pcm", "w");
+            }
+            pcm_ok = 0;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        }
+        else
+        {
+            pcm_ok = pcm_config();
+            pcm_sync = pcm_ok == 0 && main_has_option(argc, argv, "-audio-sync");
+            if (pcm_sync && pcm_chunk == 1)
+            {
+                pcm_chunk = PCM_SAMPLE / 50;
+            }
+            window_show(argc, argv);
+        }
         rt_add_task((TASK){.t_states = 0, ula_run});
         rt_add_task((TASK){.t_states = 0, z80_run});
+        if (profile_period > 0)
+        {
+            profile_stacks = calloc(PROFILE_STACKS, sizeof(PROFILESTACK));
+            rt_add_task((TASK){.t_states = profile_period, profile_run});
+        }
         if (pcm_ok == 0)
         {
 			rt_add_task((TASK){.t_states = z80_t_states_all + pcm_states, pcm_run});
@@ -3509,35 +7828,63 @@ int main(int argc, char **argv)
 		pthread_attr_setinheritsched(&a, PTHREAD_EXPLICIT_SCHED);
 		pthread_attr_setschedpolicy(&a, SCHED_FIFO);
 		pthread_attr_setschedparam(&a, &p);
-        if (pthread_create(&rt_id, &a, rt_run, NULL) != 0)
+        if (pthread_create(&rt_id, &a, rt_run, machine) != 0)
         {
-			pthread_create(&rt_id, NULL, rt_run, NULL);
+			pthread_create(&rt_id, NULL, rt_run, machine);
 		}
         pthread_attr_destroy(&a);
-        pthread_create(&tape_load_id, NULL, tape_run_load, NULL);
-        pthread_create(&tape_save_id, NULL, tape_run_save, NULL);
-        glutDisplayFunc(draw_screen);
-        glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_CONTINUE_EXECUTION);
-        glutMainLoop();
+        pthread_create(&tape_load_id, NULL, tape_run_load, machine);
+        pthread_create(&tape_save_id, NULL, tape_run_save, machine);
+        if (headless)
+        {
+            sigwait(&signals, &index);
+        }
+        else
+        {
+            glutDisplayFunc(draw_screen);
+            glutTimerFunc(SCREEN_REFRESH_MS, screen_refresh, 0);
+            glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_CONTINUE_EXECUTION);
+            glutMainLoop();
+        }
         running = false;
-        if (pcm_ok == 0)
+        if (pcm_handle != NULL)
         {
 			snd_pcm_close(pcm_handle);
 		}
+        if (pcm_file != NULL)
+        {
+            fclose(pcm_file);
+        }
         pthread_join(rt_id, NULL);
         pthread_join(tape_load_id, NULL);
         pthread_join(tape_save_id, NULL);
-		if (argc == 3 && argv[2][0] == '-' && argv[2][1] == 'o')
+		if (main_has_option(argc, argv, "-o"))
         {
 			z80_push16(z80_reg_pc);
 			file_save_sna("out.sna");
 		}
+        if (main_has_option(argc, argv, "-ppm"))
+        {
+            file_save_ppm("out.ppm");
+        }
+        if (z80_fusion_profile)
+        {
+            z80_fusion_save("out.fusion");
+        }
+        if (profile_period > 0)
+        {
+            profile_save("out.folded");
+        }
+        if (rt_stats)
+        {
+            rt_stats_print();
+        }
     }
     return 0;
 }
 
 // TODO: ula task each 4 states and horizontal retrace
 // TODO: uart
-// TODO: use pixel shader with drawArrays
+// TODO: palette lookup in a pixel shader
 // https://stackoverflow.com/questions/19102180/how-does-gldrawarrays-know-what-to-draw
 // TODO: replace glut with x calls to create window and read keyboard